@@ -67,7 +67,7 @@ WebRtcStreamer.prototype.connect = function(videourl, audiourl, options, localst
 		console.log("Get IceServers");
 		sendRequest(this.request, this.srvurl + "/getIceServers", null, null, function(iceServers) { this.onReceiveGetIceServers(iceServers, videourl, audiourl, options, localstream); } , null, this);
 	} else {
-		this.onGetIceServers(this.iceServers, videourl, audiourl, options, localstream);
+		this.onReceiveGetIceServers(this.iceServers, videourl, audiourl, options, localstream);
 	}
 }
 
@@ -104,7 +104,7 @@ WebRtcStreamer.prototype.onReceiveGetIceServers = function(iceServers, videourl,
 		this.pc.peerid = peerid;
 		
 		var streamer = this;
-		var callurl = this.srvurl + "/call?peerid="+ peerid+"&url="+encodeURIComponent(videourl);
+		var callurl = this.srvurl + "/connect?peerid="+ peerid+"&url="+encodeURIComponent(videourl);
 		if (audiourl) {
 			callurl += "&audiourl="+encodeURIComponent(audiourl);
 		}
@@ -120,8 +120,11 @@ WebRtcStreamer.prototype.onReceiveGetIceServers = function(iceServers, videourl,
 		this.pc.createOffer(function(sessionDescription) {
 			console.log("Create offer:" + JSON.stringify(sessionDescription));
 			
+			// the offer is sent at once, the candidates gathered meanwhile are trickled once the answer is received
 			streamer.pc.setLocalDescription(sessionDescription
-				, function() { sendRequest(streamer.request, callurl, null, sessionDescription, streamer.onReceiveCall, null, streamer); }
+				, function() { 
+					sendRequest(streamer.request, callurl, null, streamer.pc.localDescription, streamer.onReceiveConnect, null, streamer);
+				}
 				, function() {} );
 			
 		}, function(error) { 
@@ -140,6 +143,7 @@ WebRtcStreamer.prototype.onReceiveGetIceServers = function(iceServers, videourl,
 WebRtcStreamer.prototype.createPeerConnection = function() {
 	console.log("createPeerConnection  config: " + JSON.stringify(this.pcConfig) + " option:"+  JSON.stringify(this.pcOptions));
 	var pc = new RTCPeerConnection(this.pcConfig, this.pcOptions);
+	pc.pendingCandidates = [];
 	var streamer = this;
 	pc.onicecandidate = function(evt) { streamer.onIceCandidate.call(streamer, evt); };
 	if (typeof pc.ontrack != "undefined") {
@@ -194,7 +198,12 @@ WebRtcStreamer.prototype.createPeerConnection = function() {
 */
 WebRtcStreamer.prototype.onIceCandidate = function (event) {
 	if (event.candidate) {
-		sendRequest(this.request, this.srvurl + "/addIceCandidate?peerid="+this.pc.peerid, null, event.candidate);
+		// the candidates are trickled when the server knows the peer, kept until then
+		if (this.pc.connected) {
+			sendRequest(this.request, this.srvurl + "/addIceCandidate?peerid="+this.pc.peerid, null, event.candidate);
+		} else {
+			this.pc.pendingCandidates.push(event.candidate);
+		}
 	} 
 	else {
 		console.log("End of candidates.");
@@ -232,6 +241,32 @@ WebRtcStreamer.prototype.onReceiveCall = function(dataJson) {
 		, function(error) { console.log ("setRemoteDescription error:" + JSON.stringify(error)); });
 }	
 
+/*
+* AJAX /connect callback, the candidates of the server are in the answer or gathered once it is applied
+*/
+WebRtcStreamer.prototype.onReceiveConnect = function(dataJson) {
+	var streamer = this;
+	console.log("answer: " + JSON.stringify(dataJson));
+	if (dataJson.iceServers) {
+		this.iceServers = { "iceServers": dataJson.iceServers };
+	}
+
+	// the server knows the peer, send the candidates gathered while waiting the answer
+	this.pc.connected = true;
+	for (var i=0; i<this.pc.pendingCandidates.length; i++) {
+		sendRequest(this.request, this.srvurl + "/addIceCandidate?peerid="+this.pc.peerid, null, this.pc.pendingCandidates[i]);
+	}
+	this.pc.pendingCandidates = [];
+
+	this.pc.setRemoteDescription(new RTCSessionDescription(dataJson)
+		, function()      { console.log ("setRemoteDescription ok");
+			if (!dataJson.iceGatheringComplete) {
+				sendRequest(streamer.request, streamer.srvurl + "/getIceCandidate?peerid="+streamer.pc.peerid, null, null, streamer.onReceiveCandidate, null, streamer);
+			}
+		}
+		, function(error) { console.log ("setRemoteDescription error:" + JSON.stringify(error)); });
+}
+
 /*
 * AJAX /getIceCandidate callback
 */
@@ -7,10 +7,15 @@
 ** 
 ** -------------------------------------------------------------------------*/
 
+#include <map>
+#include <memory>
+#include <mutex>
+
 #include "CivetServer.h"
 #include "PeerConnectionManager.h"
 
 typedef std::function<Json::Value(const struct mg_request_info *, const Json::Value &)> httpFunction;
+typedef std::function<std::string(const struct mg_request_info *)> httpVersion;
 
 /* ---------------------------------------------------------------------------
 **  http callback
@@ -21,8 +26,18 @@ class HttpServerRequestHandler : public CivetServer
 		HttpServerRequestHandler(PeerConnectionManager* webRtcServer, const std::vector<std::string>& options); 
 	
 		httpFunction getFunction(const std::string& uri);
+		Metrics & getMetrics() { return m_webRtcServer->getMetrics(); }
+
+		// answer of a cacheable uri for its current version, false if the uri is not cacheable
+		bool getCachedAnswer(const std::string& uri, const struct mg_request_info *req_info, std::string & version, std::shared_ptr<const std::string> & answer);
+		void setCachedAnswer(const std::string& uri, const std::string & version, std::shared_ptr<const std::string> answer);
 				
 	protected:
 		PeerConnectionManager* m_webRtcServer;
 		std::map<std::string,httpFunction> m_func;
+		static const size_t kMaxCachedVersions = 8;
+		// uris whose answer is kept while their version does not change
+		std::map<std::string,httpVersion> m_version;
+		std::mutex m_cacheMutex;
+		std::map<std::string,std::map<std::string,std::shared_ptr<const std::string>>> m_cache;
 };
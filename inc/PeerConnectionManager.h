@@ -11,6 +11,13 @@
 #define PEERCONNECTIONMANAGER_H_
 
 #include <string>
+#include <future>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <functional>
 
 #include "api/audio_codecs/builtin_audio_encoder_factory.h"
 #include "api/peerconnectioninterface.h"
@@ -18,26 +25,91 @@
 
 #include "modules/audio_device/include/audio_device.h"
 
+#include "p2p/base/basicpacketsocketfactory.h"
+#include "p2p/client/basicportallocator.h"
+
 #include "rtc_base/logging.h"
 #include "rtc_base/json.h"
+#include "rtc_base/thread.h"
+#include "rtc_base/network.h"
+
+#include "opuspassthrough.h"
+#include "videotiers.h"
+#include "pausablesource.h"
+#include "certificatepool.h"
+#include "loadmonitor.h"
+#include "admissioncontroller.h"
+#include "egressbandwidthmanager.h"
+#include "statshistory.h"
+#include "metrics.h"
+
+class RTSPSessionManager;
+
+class PeerConnectionManager : public rtc::MessageHandler {
+	public:
+		// receive the candidates of a PeerConnection as soon as they are gathered
+		typedef std::function<void(const Json::Value &)> IceCandidateListener;
+
+	private:
+	class FactoryShard {
+		public:
+			FactoryShard(int index, const webrtc::AudioDeviceModule::AudioLayer audioLayer, rtc::scoped_refptr<webrtc::AudioEncoderFactory> audioEncoderfactory, rtc::scoped_refptr<webrtc::AudioDecoderFactory> audioDecoderfactory, bool sharedVideoEncoders, bool gcmCiphers, Metrics* metrics);
+			virtual ~FactoryShard();
+
+			int                                                        index()             { return m_index;             }
+			rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> factory()           { return m_factory;           }
+			rtc::scoped_refptr<webrtc::AudioDeviceModule>              audioDeviceModule() { return m_audioDeviceModule; }
+			// allocator using the networks and sockets shared by the peers of the shard
+			std::unique_ptr<cricket::BasicPortAllocator> createPortAllocator(int minPort, int maxPort);
+			// streams created by the factory of the shard and their viewers (manager signaling thread)
+			struct StreamEntry {
+				rtc::scoped_refptr<webrtc::MediaStreamInterface>  stream;
+				std::shared_ptr<VideoTiers>                       tiers;
+				int                                               viewers;
+				std::vector<PausableSource*>                      sources;     // owned by the tracks of the stream
+				int                                               lingerMs;    // paused time kept without viewer
+				int64_t                                           idleSinceMs; // 0 while watched or warm
+				bool                                              warm;        // kept connected without viewer
+				bool                                              paused;
+				std::shared_ptr<FrameCounter>                     frameCounter; // frames of the encoded track
+				std::shared_ptr<SourceMetrics>                    metrics;      // frames received from the source
+			};
+			std::map<std::string, StreamEntry> & streams() { return m_streams; }
+			void acquireStream(const std::string & streamLabel);
+			// true when the last viewer closed the stream, false when it stays warm
+			bool releaseStream(const std::string & streamLabel);
+			void closeStream(const std::string & streamLabel);
+			void setWarm(const std::string & streamLabel, bool warm);
+
+		private:
+			void setPaused(StreamEntry & entry, bool paused);
 
+		private:
+			int                                                                       m_index;
+			std::unique_ptr<rtc::Thread>                                              m_networkThread;
+			std::unique_ptr<rtc::Thread>                                              m_workerThread;
+			std::unique_ptr<rtc::Thread>                                              m_signalingThread;
+			rtc::scoped_refptr<webrtc::AudioDeviceModule>                             m_audioDeviceModule;
+			rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface>                m_factory;
+			std::unique_ptr<rtc::BasicNetworkManager>                                 m_networkManager;
+			std::unique_ptr<rtc::BasicPacketSocketFactory>                            m_socketFactory;
+			std::map<std::string, StreamEntry>                                        m_streams;
+	};
 
-class PeerConnectionManager {
 	class VideoSink : public rtc::VideoSinkInterface<webrtc::VideoFrame> {
 		public:
 			VideoSink(webrtc::VideoTrackInterface* track): m_track(track) {
-				RTC_LOG(LS_ERROR) << __PRETTY_FUNCTION__ << " track:" << m_track->id();
+				RTC_LOG(LS_VERBOSE) << __PRETTY_FUNCTION__ << " track:" << m_track->id();
 				m_track->AddOrUpdateSink(this, rtc::VideoSinkWants());
 			}
 			virtual ~VideoSink() {
-				RTC_LOG(LS_ERROR) << __PRETTY_FUNCTION__ << " track:" << m_track->id();
+				RTC_LOG(LS_VERBOSE) << __PRETTY_FUNCTION__ << " track:" << m_track->id();
 				m_track->RemoveSink(this);
 			}		
 
 			// VideoSinkInterface implementation
 			virtual void OnFrame(const webrtc::VideoFrame& video_frame) {
-				rtc::scoped_refptr<webrtc::I420BufferInterface> buffer(video_frame.video_frame_buffer()->ToI420());
-				RTC_LOG(LS_ERROR) << __PRETTY_FUNCTION__ << " frame:" << buffer->width() << "x" << buffer->height();
+				// the received frames are not used, nothing to convert
 			}
 
 		protected:
@@ -46,9 +118,9 @@ class PeerConnectionManager {
 	
 	class SetSessionDescriptionObserver : public webrtc::SetSessionDescriptionObserver {
 		public:
-			static SetSessionDescriptionObserver* Create(webrtc::PeerConnectionInterface* pc)
+			static SetSessionDescriptionObserver* Create(webrtc::PeerConnectionInterface* pc, std::shared_ptr<std::promise<bool>> promise = nullptr)
 			{
-				return  new rtc::RefCountedObject<SetSessionDescriptionObserver>(pc);
+				return  new rtc::RefCountedObject<SetSessionDescriptionObserver>(pc, promise);
 			}
 			virtual void OnSuccess()
 			{
@@ -63,59 +135,71 @@ class PeerConnectionManager {
 					m_pc->remote_description()->ToString(&sdp);
 					RTC_LOG(INFO) << __PRETTY_FUNCTION__ << " Remote SDP:" << sdp;
 				}
+				if (m_promise) {
+					m_promise->set_value(true);
+				}
 			}
 			virtual void OnFailure(const std::string& error)
 			{
 				RTC_LOG(LERROR) << __PRETTY_FUNCTION__ << " " << error;
+				if (m_promise) {
+					m_promise->set_value(false);
+				}
 			}
 		protected:
-			SetSessionDescriptionObserver(webrtc::PeerConnectionInterface* pc) : m_pc(pc) {};
+			SetSessionDescriptionObserver(webrtc::PeerConnectionInterface* pc, std::shared_ptr<std::promise<bool>> promise) : m_pc(pc), m_promise(promise) {};
 
 		private:
-			webrtc::PeerConnectionInterface* m_pc;
+			webrtc::PeerConnectionInterface*     m_pc;
+			std::shared_ptr<std::promise<bool>>  m_promise;
 	};
 
 	class CreateSessionDescriptionObserver : public webrtc::CreateSessionDescriptionObserver {
 		public:
-			static CreateSessionDescriptionObserver* Create(webrtc::PeerConnectionInterface* pc)
+			static CreateSessionDescriptionObserver* Create(webrtc::PeerConnectionInterface* pc, std::shared_ptr<std::promise<bool>> promise = nullptr)
 			{
-				return  new rtc::RefCountedObject<CreateSessionDescriptionObserver>(pc);
+				return  new rtc::RefCountedObject<CreateSessionDescriptionObserver>(pc, promise);
 			}
 			virtual void OnSuccess(webrtc::SessionDescriptionInterface* desc)
 			{
 				std::string sdp;
 				desc->ToString(&sdp);
 				RTC_LOG(INFO) << __PRETTY_FUNCTION__ << " type:" << desc->type() << " sdp:" << sdp;
-				m_pc->SetLocalDescription(SetSessionDescriptionObserver::Create(m_pc), desc);
+				// completed when the description is set as local description
+				m_pc->SetLocalDescription(SetSessionDescriptionObserver::Create(m_pc, m_promise), desc);
 			}
 			virtual void OnFailure(const std::string& error) {
 				RTC_LOG(LERROR) << __PRETTY_FUNCTION__ << " " << error;
+				if (m_promise) {
+					m_promise->set_value(false);
+				}
 			}
 		protected:
-			CreateSessionDescriptionObserver(webrtc::PeerConnectionInterface* pc) : m_pc(pc) {};
+			CreateSessionDescriptionObserver(webrtc::PeerConnectionInterface* pc, std::shared_ptr<std::promise<bool>> promise) : m_pc(pc), m_promise(promise) {};
 
 		private:
-			webrtc::PeerConnectionInterface* m_pc;
+			webrtc::PeerConnectionInterface*     m_pc;
+			std::shared_ptr<std::promise<bool>>  m_promise;
 	};
 
-	class PeerConnectionStatsCollectorCallback : public webrtc::RTCStatsCollectorCallback {
+	class StatsDispatcher : public webrtc::RTCStatsCollectorCallback {
 		public:
-			PeerConnectionStatsCollectorCallback() {}
-			void clearReport() { m_report.clear(); }
-			Json::Value getReport() { return m_report; }
-
-		protected:
-			virtual void OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) {
-				for (const webrtc::RTCStats& stats : *report) {
-					Json::Value statsMembers;
-					for (const webrtc::RTCStatsMemberInterface* member : stats.Members()) {
-						statsMembers[member->name()] = member->ValueToString();
-					}
-					m_report[stats.id()] = statsMembers;
+			static StatsDispatcher* Create(const std::vector<rtc::scoped_refptr<webrtc::RTCStatsCollectorCallback>> & callbacks)
+			{
+				return  new rtc::RefCountedObject<StatsDispatcher>(callbacks);
+			}
+			// one report requested for all the consumers of the peer
+			virtual void OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) override
+			{
+				for (auto & callback : m_callbacks) {
+					callback->OnStatsDelivered(report);
 				}
 			}
+		protected:
+			StatsDispatcher(const std::vector<rtc::scoped_refptr<webrtc::RTCStatsCollectorCallback>> & callbacks) : m_callbacks(callbacks) {};
 
-			Json::Value m_report;
+		private:
+			std::vector<rtc::scoped_refptr<webrtc::RTCStatsCollectorCallback>> m_callbacks;
 	};
 
 	class DataChannelObserver : public webrtc::DataChannelObserver  {
@@ -130,14 +214,14 @@ class PeerConnectionManager {
 
 			// DataChannelObserver interface
 			virtual void OnStateChange() {
-				RTC_LOG(LERROR) << __PRETTY_FUNCTION__ << " channel:" << m_dataChannel->label() << " state:"<< webrtc::DataChannelInterface::DataStateString(m_dataChannel->state());
+				RTC_LOG(LS_VERBOSE) << __PRETTY_FUNCTION__ << " channel:" << m_dataChannel->label() << " state:"<< webrtc::DataChannelInterface::DataStateString(m_dataChannel->state());
 				std::string msg(m_dataChannel->label() + " " + webrtc::DataChannelInterface::DataStateString(m_dataChannel->state()));
 				webrtc::DataBuffer buffer(msg);
 				m_dataChannel->Send(buffer);
 			}
 			virtual void OnMessage(const webrtc::DataBuffer& buffer) {
 				std::string msg((const char*)buffer.data.data(),buffer.data.size());
-				RTC_LOG(LERROR) << __PRETTY_FUNCTION__ << " channel:" << m_dataChannel->label() << " msg:" << msg;
+				RTC_LOG(LS_VERBOSE) << __PRETTY_FUNCTION__ << " channel:" << m_dataChannel->label() << " msg:" << msg;
 			}
 
 		protected:
@@ -146,39 +230,30 @@ class PeerConnectionManager {
 
 	class PeerConnectionObserver : public webrtc::PeerConnectionObserver {
 		public:
-			PeerConnectionObserver(PeerConnectionManager* peerConnectionManager, const std::string& peerid, const webrtc::PeerConnectionInterface::RTCConfiguration & config, const webrtc::FakeConstraints & constraints)
+			PeerConnectionObserver(PeerConnectionManager* peerConnectionManager, FactoryShard* shard, const std::string& peerid, const webrtc::PeerConnectionInterface::RTCConfiguration & config, const webrtc::FakeConstraints & constraints, std::unique_ptr<cricket::PortAllocator> allocator, size_t statsDepth)
 			: m_peerConnectionManager(peerConnectionManager)
+			, m_shard(shard)
 			, m_peerid(peerid)
 			, m_localChannel(NULL)
 			, m_remoteChannel(NULL)
-			, iceCandidateList_(Json::arrayValue) {
+			, iceCandidateList_(Json::arrayValue)
+			, m_gatheringDone(m_gatheringPromise.get_future().share())
+			, m_gathered(false)
+			, m_bitrateMeter(BitrateMeter::Create())
+			, m_egressWeight(1)
+			, m_egressMaxKbps(0)
+			, m_statsHistory(StatsHistory::Create(statsDepth))
+			, m_localDescription(Json::objectValue) {
 				try {
-					// rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface> peerConFac(webrtc::CreatePeerConnectionFactory(
-					// 	rtc::Thread::Current(),
-			  //           rtc::Thread::Current(),
-			  //           NULL,
-			  //           m_peerConnectionManager->audioDeviceModule_,
-			  //           webrtc::CreateBuiltinAudioEncoderFactory(),
-			  //           m_peerConnectionManager->audioDecoderfactory_,
-			  //           NULL,
-			  //           NULL
-			  //       ));
-			  //       // m_peerConnectionManager->peer_connection_factory_ = peerConFac;
-			  //       // m_pc = peerConFac->CreatePeerConnection(config,
-					// 			   //  &constraints,
-					// 			   //  NULL,
-					// 			   //  NULL,
-					// 			   //  this);
-					m_pc = m_peerConnectionManager->peer_connection_factory_->CreatePeerConnection(config,
+					m_pc = m_shard->factory()->CreatePeerConnection(config,
 								    &constraints,
-								    NULL,
+								    std::move(allocator),
 								    NULL,
 								    this);
 				} catch(int e) {
-					RTC_LOG(WARNING) << __PRETTY_FUNCTION__ << "peer_connection_factory_->CreatePeerConnection failed";
+					RTC_LOG(WARNING) << __PRETTY_FUNCTION__ << "factory()->CreatePeerConnection failed";
 				}
 
-				m_statsCallback = new rtc::RefCountedObject<PeerConnectionStatsCollectorCallback>();
 				
 				//rtc::scoped_refptr<webrtc::DataChannelInterface>   channel = m_pc->CreateDataChannel("ServerDataChannel", NULL);
 				//m_localChannel = new DataChannelObserver(channel);
@@ -188,41 +263,71 @@ class PeerConnectionManager {
 				RTC_LOG(INFO) << __PRETTY_FUNCTION__;
 				delete m_localChannel;
 				delete m_remoteChannel;
-				m_pc->Close();
+				if (m_pc) {
+					m_pc->Close();
+				}
 			}
 
-			Json::Value getIceCandidateList() { return iceCandidateList_; 	}
-			
-			Json::Value getStats() {
-				m_statsCallback->clearReport();
-				m_pc->GetStats(m_statsCallback);
-				int count=10;
-				while ( (m_statsCallback->getReport().empty()) && (--count > 0) )
+			Json::Value getIceCandidateList() { 
+				std::lock_guard<std::mutex> lock(m_mutex);
+				return iceCandidateList_;
+			}
+
+			// give the candidates already gathered, then each new one, the listener is called without the lock
+			void setIceCandidateListener(IceCandidateListener listener) {
+				Json::Value gathered;
 				{
-					usleep(1000);
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_iceCandidateListener = listener;
+					gathered = iceCandidateList_;
 				}
-				return Json::Value(m_statsCallback->getReport());
-			};
+				if (listener) {
+					for (Json::Value::ArrayIndex i = 0; i < gathered.size(); ++i) {
+						listener(gathered[i]);
+					}
+				}
+			}
+
+			// ready when the local candidates are all in the local description
+			std::shared_future<bool> getGatheringDone() { return m_gatheringDone; }
+
+			// local SDP and streams, updated when the local description or its candidates change
+			Json::Value getLocalDescription() {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				return m_localDescription;
+			}
+			
 
 			rtc::scoped_refptr<webrtc::PeerConnectionInterface> getPeerConnection() { return m_pc; };
+			rtc::scoped_refptr<BitrateMeter> getBitrateMeter() { return m_bitrateMeter; };
+			rtc::scoped_refptr<StatsHistory> getStatsHistory() { return m_statsHistory; };
+			FactoryShard* getShard() { return m_shard; };
+			rtc::scoped_refptr<VideoTierSelector> getTierSelector() { return m_tierSelector; };
+			void setTierSelector(rtc::scoped_refptr<VideoTierSelector> tierSelector) { m_tierSelector = tierSelector; };
+			// share of the egress budget given to this peer
+			double getEgressWeight() { return m_egressWeight; };
+			int getEgressMaxKbps() { return m_egressMaxKbps; };
+			void setEgressLimits(double weight, int maxKbps) { m_egressWeight = weight; m_egressMaxKbps = maxKbps; };
+			const std::string & getStreamLabel() { return m_streamLabel; };
+			void setStreamLabel(const std::string & streamLabel) { m_streamLabel = streamLabel; };
 
 			// PeerConnectionObserver interface
 			virtual void OnAddStream(rtc::scoped_refptr<webrtc::MediaStreamInterface> stream)    {
-				RTC_LOG(LERROR) << __PRETTY_FUNCTION__ << " nb video tracks:" << stream->GetVideoTracks().size();
+				RTC_LOG(LS_VERBOSE) << __PRETTY_FUNCTION__ << " nb video tracks:" << stream->GetVideoTracks().size();
 				webrtc::VideoTrackVector videoTracks = stream->GetVideoTracks();
 				if (videoTracks.size()>0) {					
 					m_videosink.reset(new VideoSink(videoTracks.at(0)));
 				}
 			}
 			virtual void OnRemoveStream(rtc::scoped_refptr<webrtc::MediaStreamInterface> stream) {
-				RTC_LOG(LERROR) << __PRETTY_FUNCTION__;
+				RTC_LOG(LS_VERBOSE) << __PRETTY_FUNCTION__;
 			}
 			virtual void OnDataChannel(rtc::scoped_refptr<webrtc::DataChannelInterface> channel) {
-				RTC_LOG(LERROR) << __PRETTY_FUNCTION__;
+				RTC_LOG(LS_VERBOSE) << __PRETTY_FUNCTION__;
 				m_remoteChannel = new DataChannelObserver(channel);
 			}
 			virtual void OnRenegotiationNeeded()                              {
-				RTC_LOG(LERROR) << __PRETTY_FUNCTION__ << " peerid:" << m_peerid;
+				RTC_LOG(LS_VERBOSE) << __PRETTY_FUNCTION__ << " peerid:" << m_peerid;
 				//iceCandidateList_.clear();
 				//m_peerConnectionManager->hangUp(m_peerid);
 			}
@@ -230,37 +335,97 @@ class PeerConnectionManager {
 			virtual void OnIceCandidate(const webrtc::IceCandidateInterface* candidate);
 			
 			virtual void OnSignalingChange(webrtc::PeerConnectionInterface::SignalingState state) {
-				RTC_LOG(LERROR) << __PRETTY_FUNCTION__ << " state:" << state << " peerid:" << m_peerid;				
+				RTC_LOG(LS_VERBOSE) << __PRETTY_FUNCTION__ << " state:" << state << " peerid:" << m_peerid;
+				// a description was just set
+				this->updateLocalDescription();
 			}
 			virtual void OnIceConnectionChange(webrtc::PeerConnectionInterface::IceConnectionState state) {
 				RTC_LOG(INFO) << __PRETTY_FUNCTION__ << " state:" << state  << " peerid:" << m_peerid;
 				if ( (state == webrtc::PeerConnectionInterface::kIceConnectionFailed)
 				   ||(state == webrtc::PeerConnectionInterface::kIceConnectionClosed) )
 				{
-					iceCandidateList_.clear();
-					m_peerConnectionManager->hangUp(m_peerid);
+					{
+						std::lock_guard<std::mutex> lock(m_mutex);
+						iceCandidateList_.clear();
+					}
+					m_peerConnectionManager->hangUp(m_peerid, this);
 				}
 			}
 			
-			virtual void OnIceGatheringChange(webrtc::PeerConnectionInterface::IceGatheringState) {
+			virtual void OnIceGatheringChange(webrtc::PeerConnectionInterface::IceGatheringState state) {
+				RTC_LOG(INFO) << __PRETTY_FUNCTION__ << " state:" << state  << " peerid:" << m_peerid;
+				if (state == webrtc::PeerConnectionInterface::kIceGatheringComplete)
+				{
+					this->updateLocalDescription();
+					std::lock_guard<std::mutex> lock(m_mutex);
+					if (!m_gathered)
+					{
+						m_gathered = true;
+						m_gatheringPromise.set_value(true);
+					}
+				}
 			}
 
 
+		private:
+			void updateLocalDescription();
+
 		private:
 			PeerConnectionManager* m_peerConnectionManager;
+			FactoryShard*          m_shard;
 			const std::string m_peerid;
 			rtc::scoped_refptr<webrtc::PeerConnectionInterface> m_pc;
 			DataChannelObserver*    m_localChannel;
 			DataChannelObserver*    m_remoteChannel;
+			std::mutex              m_mutex;
 			Json::Value iceCandidateList_;
-			rtc::scoped_refptr<PeerConnectionStatsCollectorCallback> m_statsCallback;
+			std::promise<bool>                                       m_gatheringPromise;
+			std::shared_future<bool>                                 m_gatheringDone;
+			bool                                                     m_gathered;
+			IceCandidateListener                                     m_iceCandidateListener;
+			rtc::scoped_refptr<BitrateMeter>                         m_bitrateMeter;
+			double                                                   m_egressWeight;
+			int                                                      m_egressMaxKbps;
+			rtc::scoped_refptr<StatsHistory>                         m_statsHistory;
 			std::unique_ptr<VideoSink>                               m_videosink;
+			rtc::scoped_refptr<VideoTierSelector>                    m_tierSelector;
+			std::string                                              m_streamLabel;
+			Json::Value                                              m_localDescription;
 	};
 
 	public:
-		PeerConnectionManager(const std::string & stunurl,
-			const std::string & turnurl,
-			const webrtc::AudioDeviceModule::AudioLayer audioLayer);
+		// settings of the server, the defaults are the ones of the command line
+		struct Options {
+			Options() : audioLayer(webrtc::AudioDeviceModule::kDummyAudio), nbRtspSchedulers(2), maxRtspReconnects(8), minRtspReconnectDelayMs(1000), maxRtspReconnectDelayMs(60000)
+				, signalingTimeoutMs(2000), nbFactoryShards(1), shardPolicy("stream"), sharedVideoEncoders(false), lingerMs(0), warmPoolSize(8)
+				, nbCertificates(4), gcmCiphers(false), iceCandidatePoolSize(1), minPort(0), maxPort(0), egressBudgetKbps(0), statsIntervalMs(1000), statsDepth(60) {}
+			std::string                                          stunurl;
+			std::string                                          turnurl;
+			webrtc::AudioDeviceModule::AudioLayer                audioLayer;
+			int                                                  nbRtspSchedulers;
+			int                                                  maxRtspReconnects;
+			int                                                  minRtspReconnectDelayMs;
+			int                                                  maxRtspReconnectDelayMs;
+			int                                                  signalingTimeoutMs;
+			int                                                  nbFactoryShards;
+			std::string                                          shardPolicy;       // stream or roundrobin
+			bool                                                 sharedVideoEncoders;
+			int                                                  lingerMs;
+			int                                                  warmPoolSize;
+			std::map<std::string,std::string>                    urlList;           // url by stream name
+			std::string                                          configFile;
+			int                                                  nbCertificates;
+			bool                                                 gcmCiphers;
+			int                                                  iceCandidatePoolSize;
+			int                                                  minPort;           // UDP ports of ICE, 0 : any
+			int                                                  maxPort;
+			std::string                                          admissionLimits;
+			int                                                  egressBudgetKbps;  // 0 : no budget
+			int                                                  statsIntervalMs;   // 0 : no history
+			int                                                  statsDepth;
+		};
+
+		PeerConnectionManager(const Options & options);
 		virtual ~PeerConnectionManager();
 
 		bool InitializePeerConnection();
@@ -271,31 +436,138 @@ class PeerConnectionManager {
 		const Json::Value getAudioDeviceList();
 		const Json::Value getMediaList();
 		const Json::Value hangUp(const std::string &peerid);
-		const Json::Value call(const std::string &peerid, const std::string &pipename, const std::string & audiourl, const std::string & options, const Json::Value& jmessage);
+		// close the peer only if it is still the given observer
+		const Json::Value hangUp(const std::string &peerid, PeerConnectionObserver* peerConnectionObserver);
+		const Json::Value call(const std::string &peerid, const std::string &pipename, const std::string & audiourl, const std::string & options, const Json::Value& jmessage, const std::string& clientIp);
+		bool              setIceCandidateListener(const std::string &peerid, IceCandidateListener listener);
+		const Json::Value connect(const std::string &peerid, const std::string &pipename, const std::string & audiourl, const std::string & options, const Json::Value& jmessage, const std::string& clientIp);
 		const Json::Value getIceServers(const std::string& clientIp);
-		const Json::Value getPeerConnectionList();
-		const Json::Value getStreamList();
-		const Json::Value createOffer(const std::string &peerid, const std::string & videourl, const std::string & audiourl, const std::string & options);
+		const Json::Value getPeerConnectionList(const std::string & peerid, const std::string & streamLabel, const std::string & field, size_t last);
+		const Json::Value getStreamList(bool details = false);
+		const Json::Value getLatency(const std::string & streamLabel);
+		const Json::Value createOffer(const std::string &peerid, const std::string & videourl, const std::string & audiourl, const std::string & options, const std::string& clientIp);
 		void              setAnswer(const std::string &peerid, const Json::Value& jmessage);
 
+		// versions of the answers of getMediaList, getStreamList and getIceServers, they change when the answer may change
+		unsigned int      getMediaListVersion()  { return std::atomic_load(&mediaList_)->version; }
+		// the list changes with the streams and their viewers, its details with each snapshot
+		unsigned int      getStreamListVersion() { return std::atomic_load(&snapshot_)->streamListVersion; }
+		unsigned int      getSnapshotVersion()   { return std::atomic_load(&snapshot_)->version;  }
+		const std::string getIceServersVersion(const std::string& clientIp);
+
+		// counters written by the HTTP server, Prometheus text of the counters and the last snapshot
+		Metrics &         getMetrics() { return metrics_; }
+		const std::string renderMetrics();
+
+		// overide rtc::MessageHandler
+		virtual void      OnMessage(rtc::Message* msg);
 
 	protected:
-		PeerConnectionObserver*                 CreatePeerConnection(const std::string& peerid, webrtc::PeerConnectionInterface::RTCConfiguration &config);
-		bool                                    AddStream(webrtc::PeerConnectionInterface* peer_connection, const std::string & videourl, const std::string & audiourl, const std::string & options);
-		rtc::scoped_refptr<webrtc::VideoTrackInterface> CreateVideoTrack(const std::string &pipename, const std::string & options);
-		rtc::scoped_refptr<webrtc::AudioTrackInterface> CreateAudioTrack(const std::string & audiourl, const std::string & options);
-		bool                                    streamStillUsed(const std::string & streamLabel);
+		// state published for the read queries
+		struct PeerSnapshot {
+			std::string                                          peerid;
+			rtc::scoped_refptr<webrtc::PeerConnectionInterface>  peerConnection;
+			rtc::scoped_refptr<StatsHistory>                     statsHistory;
+			std::string                                          streamLabel;
+			Json::Value                                          content;
+		};
+		struct StreamSnapshot {
+			StreamSnapshot() : viewers(0), fps(0) {}
+			int                                                  viewers;
+			double                                               fps;
+			std::vector<std::shared_ptr<SourceMetrics>>          sources;   // one by shard
+		};
+		struct Snapshot {
+			Snapshot() : version(0), streamListVersion(0), egressKbps(0), encodeFps(0), qp(0) {}
+			unsigned int                                         version;
+			unsigned int                                         streamListVersion;
+			std::vector<PeerSnapshot>                            peers;
+			std::map<std::string, StreamSnapshot>                streams;   // by stream label
+			int                                                  egressKbps;
+			double                                               encodeFps;
+			double                                               qp;
+		};
+		// messages posted on the signaling thread
+		enum { kSnapshotMsg, kStatsMsg };
+		static const int                        kSnapshotPeriodMs = 500;
+		static const int                        kCertificateRotationMs = 60*60*1000;
+		static const int                        kIceGatheringTimeoutMs = 300;
+		static const int                        kDegradedBitrate = 300000;
+		static const int                        kEgressPeriodMs = 2000;
+
+		// streams declared on the command line or in the config file
+		struct MediaSettings {
+			std::string                                          videourl;
+			std::string                                          audiourl;
+			std::string                                          options;
+			bool                                                 warm;
+		};
+		struct MediaList {
+			MediaList() : version(0) {}
+			unsigned int                                         version;
+			std::map<std::string, MediaSettings>                 media;     // by name
+			Json::Value                                          json;      // answer of getMediaList
+		};
+
+
+	protected:
+		PeerConnectionObserver*                 CreatePeerConnection(const std::string& peerid, webrtc::PeerConnectionInterface::RTCConfiguration &config, FactoryShard* shard);
+		bool                                    AddStream(PeerConnectionObserver* peerConnectionObserver, const std::string & videourl, const std::string & audiourl, const std::string & options);
+		rtc::scoped_refptr<webrtc::VideoTrackInterface> CreateVideoTrack(FactoryShard* shard, const std::string &pipename, const std::string & options, std::vector<PausableSource*> & sources, std::shared_ptr<SourceMetrics> metrics);
+		rtc::scoped_refptr<webrtc::AudioTrackInterface> CreateAudioTrack(FactoryShard* shard, const std::string & audiourl, const std::string & options, std::vector<PausableSource*> & sources);
+		bool                                    createStream(FactoryShard* shard, const std::string & streamLabel, const std::string & videourl, const std::string & audiourl, const std::string & options);
+		void                                    expireStreams();
+		void                                    loadMediaList();
+		void                                    resolveMedia(std::string & videourl, std::string & audiourl, std::string & options);
+		bool                                    admit(const std::string & peerid, const std::string & clientIp, std::string & options, Json::Value & answer);
+		FactoryShard*                           selectShard(const std::string & streamLabel);
+		static std::string                      getStreamLabel(const std::string & videourl, const std::string & audiourl);
+		bool                                    waitFor(std::future<bool> & done, int64_t deadlineMs, const std::string & peerid, const char* step);
+
+		// run on the signaling thread that owns the maps
+		rtc::scoped_refptr<webrtc::PeerConnectionInterface> getPeerConnection(const std::string &peerid);
+		bool                                    registerPeerConnection(const std::string &peerid, PeerConnectionObserver* peerConnectionObserver);
+		bool                                    addStreamToPeer(const std::string &peerid, PeerConnectionObserver* peerConnectionObserver, const std::string & videourl, const std::string & audiourl, const std::string & options);
+		const Json::Value                       closePeerConnection(const std::string &peerid, PeerConnectionObserver* peerConnectionObserver = NULL);
 
 	protected:
-		rtc::scoped_refptr<webrtc::AudioDeviceModule>                             audioDeviceModule_;
 		rtc::scoped_refptr<webrtc::AudioDecoderFactory>                           audioDecoderfactory_;
-		rtc::scoped_refptr<webrtc::PeerConnectionFactoryInterface>                peer_connection_factory_;
+		rtc::scoped_refptr<PassthroughAudioEncoderFactory>                        audioEncoderfactory_;
+		// before the shards, their encoders record in it until they are destroyed
+		Metrics                                                                   metrics_;
+		std::vector<std::unique_ptr<FactoryShard>>                                shards_;
+		bool                                                                      shardByStream_;
+		std::atomic<unsigned int>                                                 nextShard_;
 		std::map<std::string, PeerConnectionObserver* >                           peer_connectionobs_map_;
-		std::map<std::string, rtc::scoped_refptr<webrtc::MediaStreamInterface> >  stream_map_;
 		std::string                                                               stunurl_;
 		std::string                                                               turnurl_;
 		std::string                                                               turnuser_;
 		std::string                                                               turnpass_;
+		int                                                                       signalingTimeoutMs_;
+		int                                                                       lingerMs_;
+		size_t                                                                    warmPoolSize_;
+		std::map<std::string,std::string>                                         urlList_;
+		std::string                                                               configFile_;
+		time_t                                                                    configTime_;
+		std::shared_ptr<const MediaList>                                          mediaList_;
+		std::unique_ptr<CertificatePool>                                          certificatePool_;
+		int                                                                       iceCandidatePoolSize_;
+		int                                                                       minPort_;
+		int                                                                       maxPort_;
+		bool                                                                      sharedVideoEncoders_;
+		std::unique_ptr<AdmissionController>                                      admission_;
+		std::atomic<int>                                                          peerCount_;
+		std::unique_ptr<EgressBandwidthManager>                                   egressManager_;
+		int64_t                                                                   lastEgressMs_;
+		int                                                                       statsIntervalMs_;
+		int                                                                       statsTickMs_;
+		int64_t                                                                   lastHistoryMs_;
+		size_t                                                                    statsDepth_;
+		rtc::Thread*                                                              signalingThread_;
+		std::shared_ptr<const Snapshot>                                           snapshot_;
+#ifdef HAVE_LIVE555
+		std::unique_ptr<RTSPSessionManager>                                       rtspSessionManager_;
+#endif
 };
 
 #endif
@@ -0,0 +1,65 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** admissioncontroller.h
+**
+** Decide if a new call is accepted from the measured load : peers, pixels
+** to encode, bitrate sent, CPU and call rate of the client.
+** Near the limits the new calls are degraded, over them they are rejected.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef ADMISSIONCONTROLLER_H_
+#define ADMISSIONCONTROLLER_H_
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+class AdmissionController
+{
+	public:
+		enum Decision { Accept, Degrade, Reject };
+
+		// limits given as "peers=500&pixelrate=100000000&egress=500000&cpu=90&callrate=2", 0 or missing : no limit
+		AdmissionController(const std::string & limits);
+
+		// measured load (signaling thread)
+		void update(double pixelRate, int egressKbps);
+
+		// peers : current number of PeerConnections, retryAfter in seconds for a rejected call
+		Decision admit(const std::string & clientIp, int peers, int & retryAfter, std::string & reason);
+
+	private:
+		double cpuLoad();
+
+	private:
+		// part of a limit from which the new calls are degraded
+		static constexpr double kDegradeRatio   = 0.8;
+		static const int        kRetryAfter     = 5;
+
+		int                                   m_maxPeers;
+		double                                m_maxPixelRate;
+		int                                   m_maxEgressKbps;
+		int                                   m_maxCpu;
+		double                                m_maxCallRate;
+
+		std::atomic<double>                   m_pixelRate;
+		std::atomic<int>                      m_egressKbps;
+		std::atomic<int>                      m_cpu;
+		unsigned long long                    m_lastCpuBusy;
+		unsigned long long                    m_lastCpuTotal;
+
+		// token bucket of the call rate by client address
+		struct Bucket {
+			double   tokens;
+			int64_t  lastMs;
+		};
+		std::mutex                            m_mutex;
+		std::map<std::string, Bucket>         m_buckets;
+};
+
+#endif
@@ -0,0 +1,107 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** asynclog.h
+**
+** Logging off the hot path : the messages are copied in a bounded ring buffer
+** and written to stderr by a background thread. The verbose
+** logs of the frame path are compiled out unless WEBRTCSTREAMER_VERBOSE_LOG
+** is defined, the repeated errors are rate limited by call site.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef ASYNCLOG_H_
+#define ASYNCLOG_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "rtc_base/logging.h"
+#include "rtc_base/timeutils.h"
+
+#include "ringbuffer.h"
+
+// verbose logs of the frames, nothing is evaluated when compiled out
+#ifdef WEBRTCSTREAMER_VERBOSE_LOG
+#define STREAMER_LOG_VERBOSE RTC_LOG(LS_VERBOSE)
+#else
+#define STREAMER_LOG_VERBOSE while (false) RTC_LOG(LS_VERBOSE)
+#endif
+
+// at most one message by periodMs for this call site, the others are not formatted
+#define STREAMER_LOG_EVERY_MS(sev, periodMs) \
+	( (!rtc::LogMessage::Loggable(rtc::sev)) \
+	|| (![]() -> LogRateLimiter & { static LogRateLimiter limiter; return limiter; }().allow(periodMs)) ) ? (void)0 : RTC_LOG(sev)
+
+class LogRateLimiter
+{
+	public:
+		LogRateLimiter() : m_nextMs(0) {}
+
+		bool allow(int periodMs) {
+			int64_t now = rtc::TimeMillis();
+			int64_t next = m_nextMs.load(std::memory_order_relaxed);
+			return (now >= next) && (m_nextMs.compare_exchange_strong(next, now + periodMs, std::memory_order_relaxed));
+		}
+
+	private:
+		std::atomic<int64_t> m_nextMs;
+};
+
+class AsyncLogSink
+{
+	public:
+		AsyncLogSink(size_t capacity = 256*1024, int flushPeriodMs = 50);
+		virtual ~AsyncLogSink();
+
+		// the sink of the process, NULL when the logs are written by the caller
+		static AsyncLogSink* instance() { return s_instance; }
+
+		// minimum severity of the messages, replaces rtc::LogMessage::LogToDebug
+		void                 setSeverity(rtc::LoggingSeverity severity);
+		rtc::LoggingSeverity severity() const { return m_severity; }
+
+		// messages lost because the ring buffer was full
+		uint64_t dropped() const { return m_dropped; }
+
+	private:
+		// rtc::LogMessage gives the severity of a stream when it is added, the
+		// severity is changed by adding the other stream before removing the
+		// active one, only the active stream writes
+		class Stream : public rtc::LogSink {
+			public:
+				Stream(AsyncLogSink* owner, int index) : m_owner(owner), m_index(index) {}
+
+				// overide rtc::LogSink
+				virtual void OnLogMessage(const std::string& message) override;
+
+			private:
+				AsyncLogSink* m_owner;
+				int           m_index;
+		};
+
+		void        write(const std::string& message);
+		void        run();
+		void        drain(std::string & out);
+
+	private:
+		static AsyncLogSink*                     s_instance;
+		int                                      m_flushPeriodMs;
+		std::mutex                               m_writeMutex;    // the producer side of the ring
+		RingBuffer<char>                         m_ring;
+		uint32_t                                 m_pending;       // length of the message whose header is read
+		std::mutex                               m_severityMutex;
+		Stream                                   m_streams[2];
+		std::atomic<int>                         m_active;        // index of the stream that writes, -1 if none
+		std::atomic<rtc::LoggingSeverity>        m_severity;
+		std::atomic<uint64_t>                    m_dropped;
+		std::atomic<bool>                        m_running;
+		std::thread                              m_thread;
+};
+
+#endif
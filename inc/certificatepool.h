@@ -0,0 +1,44 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** certificatepool.h
+**
+** DTLS certificates generated in background and shared by the new
+** PeerConnections, one certificate is replaced at each rotation period.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef CERTIFICATEPOOL_H_
+#define CERTIFICATEPOOL_H_
+
+#include <deque>
+#include <mutex>
+#include <memory>
+
+#include "rtc_base/thread.h"
+#include "rtc_base/rtccertificate.h"
+
+class CertificatePool : public rtc::MessageHandler
+{
+	public:
+		CertificatePool(size_t size, int rotationMs);
+		virtual ~CertificatePool();
+
+		// null until the first certificate is generated
+		rtc::scoped_refptr<rtc::RTCCertificate> get();
+
+		// overide rtc::MessageHandler
+		virtual void OnMessage(rtc::Message* msg);
+
+	private:
+		size_t                                               m_size;
+		int                                                  m_rotationMs;
+		std::unique_ptr<rtc::Thread>                         m_thread;
+		std::mutex                                           m_mutex;
+		std::deque<rtc::scoped_refptr<rtc::RTCCertificate>>  m_certificates;
+		size_t                                               m_next;
+};
+
+#endif
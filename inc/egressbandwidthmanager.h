@@ -0,0 +1,64 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** egressbandwidthmanager.h
+**
+** Divide the egress budget of the process between the PeerConnections by
+** the priority of their stream. A peer takes no more than its link carries,
+** what it leaves is shared by the others. The peers that share an encoder
+** receive the same bitrate, they get the same limit and their group costs
+** this limit for each of them.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef EGRESSBANDWIDTHMANAGER_H_
+#define EGRESSBANDWIDTHMANAGER_H_
+
+#include <string>
+#include <map>
+
+#include "api/peerconnectioninterface.h"
+
+#include "loadmonitor.h"
+
+class EgressBandwidthManager
+{
+	public:
+		struct Peer {
+			rtc::scoped_refptr<webrtc::PeerConnectionInterface>  peerConnection;
+			rtc::scoped_refptr<BitrateMeter>                     meter;
+			double                                               weight;
+			int                                                  maxKbps;   // 0 : not limited by the call
+			std::string                                          group;     // peers sharing an encoder, empty if none
+		};
+
+		// budgetKbps 0 : not limited
+		EgressBandwidthManager(int budgetKbps) : m_budgetKbps(budgetKbps) {}
+
+		int budgetKbps() { return m_budgetKbps; }
+
+		// divide the budget and set the limits that changed (signaling thread)
+		void allocate(const std::map<std::string, Peer> & peers);
+
+		// last limit given to a peer, 0 if none
+		int allocatedKbps(const std::string & peerid);
+
+	private:
+		int demandKbps(const Peer & peer);
+
+	private:
+		static const int        kDefaultMaxKbps = 8000;
+		static const int        kMinKbps        = 100;
+		// NACK per packet from which a peer is considered congested
+		static constexpr double kLossThreshold  = 0.05;
+		static constexpr double kBackoff        = 0.85;
+		// change of limit under which the peer keeps its limit
+		static constexpr double kHysteresis     = 0.1;
+
+		int                                   m_budgetKbps;
+		std::map<std::string, int>            m_allocated;
+};
+
+#endif
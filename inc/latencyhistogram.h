@@ -0,0 +1,49 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** latencyhistogram.h
+**
+** Histogram of durations in microseconds with log-linear buckets : exact up
+** to 8us, then 8 buckets by power of two (12% precision). Recording is a
+** relaxed atomic increment, it can stay enabled on the frame path.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef LATENCYHISTOGRAM_H_
+#define LATENCYHISTOGRAM_H_
+
+#include <atomic>
+#include <stdint.h>
+
+#include "rtc_base/json.h"
+
+class LatencyHistogram
+{
+	public:
+		LatencyHistogram();
+
+		void record(int64_t durationUs);
+		// add the samples of another histogram
+		void add(const LatencyHistogram & other);
+
+		// { "count", "p50", "p90", "p99", "max" } in microseconds, the percentiles are bucket upper bounds
+		Json::Value summary() const;
+
+	private:
+		static size_t   index(uint64_t value);
+		static uint64_t upperBound(size_t index);
+
+	private:
+		static const int      kSubBits  = 3;
+		static const size_t   kSub      = 1 << kSubBits;
+		// durations above 2^40us are counted in the last bucket
+		static const int      kMaxBits  = 40;
+		static const size_t   kBuckets  = (kMaxBits - kSubBits + 1) * kSub;
+
+		std::atomic<uint64_t> m_counts[kBuckets];
+		std::atomic<uint64_t> m_max;
+};
+
+#endif
@@ -0,0 +1,88 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** loadmonitor.h
+**
+** Measures of the load : frames of a stream, bitrate sent to a peer and
+** quality of its link.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef LOADMONITOR_H_
+#define LOADMONITOR_H_
+
+#include <atomic>
+#include <mutex>
+
+#include "api/mediastreaminterface.h"
+#include "api/stats/rtcstatscollectorcallback.h"
+
+/* ---------------------------------------------------------------------------
+**  count the frames of a video track
+** -------------------------------------------------------------------------*/
+class FrameCounter : public rtc::VideoSinkInterface<webrtc::VideoFrame>
+{
+	public:
+		FrameCounter(rtc::scoped_refptr<webrtc::VideoTrackInterface> track);
+		virtual ~FrameCounter();
+
+		// frames and pixels per second since the previous sample
+		void sample(double & fps, double & pixelRate);
+
+		// overide rtc::VideoSinkInterface
+		virtual void OnFrame(const webrtc::VideoFrame& frame) override;
+
+	private:
+		rtc::scoped_refptr<webrtc::VideoTrackInterface> m_track;
+		std::atomic<uint64_t>                           m_frames;
+		std::atomic<uint64_t>                           m_pixels;
+		uint64_t                                        m_lastFrames;
+		uint64_t                                        m_lastPixels;
+		int64_t                                         m_lastSampleUs;
+};
+
+/* ---------------------------------------------------------------------------
+**  bitrate sent to a peer, round trip time, losses and bandwidth estimation
+**  of its link, frames encoded for it from its statistics
+** -------------------------------------------------------------------------*/
+class BitrateMeter : public webrtc::RTCStatsCollectorCallback
+{
+	public:
+		static rtc::scoped_refptr<BitrateMeter> Create() {
+			return new rtc::RefCountedObject<BitrateMeter>();
+		}
+
+		int    bitrateKbps()   { return m_bitrateKbps;   }
+		int    availableKbps() { return m_availableKbps; }   // 0 : unknown
+		int    rttMs()         { return m_rttMs;         }
+		// NACK per packet sent since the previous statistics
+		double lossRatio()     { return m_lossRatio;     }
+		double encodeFps()     { return m_encodeFps;     }
+		// average QP of the frames encoded since the previous statistics, 0 : unknown
+		double qp()            { return m_qp;            }
+
+		// overide webrtc::RTCStatsCollectorCallback
+		virtual void OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) override;
+
+	protected:
+		BitrateMeter() : m_bitrateKbps(0), m_availableKbps(0), m_rttMs(0), m_lossRatio(0), m_encodeFps(0), m_qp(0), m_lastBytes(0), m_lastPackets(0), m_lastNacks(0), m_lastFrames(0), m_lastQpSum(0), m_lastTimestampUs(0) {}
+
+	private:
+		std::atomic<int>                                m_bitrateKbps;
+		std::atomic<int>                                m_availableKbps;
+		std::atomic<int>                                m_rttMs;
+		std::atomic<double>                             m_lossRatio;
+		std::atomic<double>                             m_encodeFps;
+		std::atomic<double>                             m_qp;
+		std::mutex                                      m_mutex;
+		uint64_t                                        m_lastBytes;
+		uint64_t                                        m_lastPackets;
+		uint64_t                                        m_lastNacks;
+		uint64_t                                        m_lastFrames;
+		uint64_t                                        m_lastQpSum;
+		int64_t                                         m_lastTimestampUs;
+};
+
+#endif
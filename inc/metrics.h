@@ -0,0 +1,92 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** metrics.h
+**
+** Counters written on the hot paths and read by the /metrics scrape, in the
+** Prometheus text format. Only atomics are shared, a scrape takes no lock
+** of the signaling thread.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <string>
+#include <sstream>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "latencyhistogram.h"
+
+/* ---------------------------------------------------------------------------
+**  frames received and decoded from a source, time of each stage of a frame
+** -------------------------------------------------------------------------*/
+class SourceMetrics
+{
+	public:
+		// stages of a frame in the capturers
+		enum Stage { kReceive, kBase64, kDecode, kConvert, kOnFrame, kStageCount };
+		static const char* stageName(Stage stage);
+
+		SourceMetrics() : m_frames(0), m_decodeUs(0), m_dropped(0) {}
+
+		void addFrame()                        { m_frames++; }
+		void addDecodeTime(int64_t durationUs) { m_decodeUs += durationUs; }
+		void addDropped()                      { m_dropped++; }
+
+		uint64_t frames() const                { return m_frames;   }
+		uint64_t decodeUs() const              { return m_decodeUs; }
+		uint64_t droppedFrames() const         { return m_dropped;  }
+
+		void addLatency(Stage stage, int64_t durationUs) { m_latency[stage].record(durationUs); }
+		// summary of the stages that recorded something, sources of the same stream merged
+		static Json::Value latency(const std::vector<std::shared_ptr<SourceMetrics>> & sources);
+
+	private:
+		std::atomic<uint64_t>   m_frames;
+		std::atomic<uint64_t>   m_decodeUs;
+		std::atomic<uint64_t>   m_dropped;
+		LatencyHistogram        m_latency[kStageCount];
+};
+
+/* ---------------------------------------------------------------------------
+**  counters of the process
+** -------------------------------------------------------------------------*/
+class Metrics
+{
+	public:
+		Metrics() : m_signalingRequests(0), m_signalingUs(0), m_httpRequests(0), m_httpInFlight(0) {}
+
+		// a call, an offer or an answer handled in durationUs
+		void signaling(int64_t durationUs) { m_signalingRequests++; m_signalingUs += durationUs; }
+
+		// requests handled by the civetweb workers
+		void requestStarted() { m_httpRequests++; m_httpInFlight++; }
+		void requestDone()    { m_httpInFlight--; }
+
+		// time to encode a frame and to packetize it for one peer, known with the shared encoders
+		LatencyHistogram & encodeLatency()    { return m_encodeLatency;    }
+		LatencyHistogram & packetizeLatency() { return m_packetizeLatency; }
+		Json::Value latency() const;
+
+		void render(std::ostringstream & os) const;
+
+		// write one sample, labels like stream="name" or empty
+		static void sample(std::ostringstream & os, const char* name, const std::string & labels, double value);
+		static void header(std::ostringstream & os, const char* name, const char* type, const char* help);
+		static std::string label(const char* name, const std::string & value);
+
+	private:
+		std::atomic<uint64_t>   m_signalingRequests;
+		std::atomic<uint64_t>   m_signalingUs;
+		std::atomic<uint64_t>   m_httpRequests;
+		std::atomic<int>        m_httpInFlight;
+		LatencyHistogram        m_encodeLatency;
+		LatencyHistogram        m_packetizeLatency;
+};
+
+#endif
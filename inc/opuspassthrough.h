@@ -0,0 +1,147 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** opuspassthrough.h
+**
+** Forward Opus packets received from a source to the WebRTC audio senders
+** without decoding and encoding them again.
+**
+** The source keeps the last packets in the store and feeds the audio track
+** with one 48kHz block of 10ms for each 10ms of received samples. The blocks
+** only carry the key of the source, the encoder of the track has no other
+** link to it. Each Opus encoder created by the factory reads the history of
+** the source with its own cursor, one packet for each 10ms of block, and
+** stamps them with the sample count of their TOC. The blocks without key are
+** encoded by the wrapped encoder.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef OPUSPASSTHROUGH_H_
+#define OPUSPASSTHROUGH_H_
+
+#include <string.h>
+#include <strings.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "api/audio_codecs/audio_encoder.h"
+#include "api/audio_codecs/audio_encoder_factory.h"
+#include "rtc_base/refcountedobject.h"
+
+/* ---------------------------------------------------------------------------
+**  history of Opus packets by source shared by all the encoders
+** -------------------------------------------------------------------------*/
+class OpusPacketStore
+{
+	public:
+		OpusPacketStore() : m_nextKey(1) {}
+
+		// register a source and return its key, remove it with its history
+		uint32_t addSource();
+		void     removeSource(uint32_t key);
+
+		// append a packet to the history of a source, the oldest one is dropped when it is full
+		void     push(uint32_t key, const uint8_t* data, size_t size, int samples);
+		// read the packet of a source at the cursor and move it to the next one, false if there is none
+		// a null cursor starts from the last packet, a cursor older than the history skips to its first packet
+		bool     read(uint32_t key, uint64_t* cursor, rtc::Buffer* encoded, int* samples);
+
+		// number of samples by channel at 48kHz of an Opus packet (RFC 6716 3.1), 0 if invalid
+		static int sampleCount(const uint8_t* data, size_t size);
+
+		// write/read the key of the source in a block of 10ms interleaved samples
+		static void tag(int16_t* audio, size_t samplesPerChannel, size_t channels, uint32_t key);
+		static bool untag(const int16_t* audio, size_t samplesPerChannel, size_t channels, uint32_t* key);
+
+		static const int kSampleRate = 48000;
+
+	private:
+		static const size_t kMaxPackets = 64;
+
+		struct Packet {
+			uint64_t             seq;
+			std::vector<uint8_t> data;
+			int                  samples;
+		};
+
+		struct History {
+			History() : nextSeq(1) {}
+			std::deque<Packet>   packets;
+			uint64_t             nextSeq;
+		};
+
+		std::mutex                                  m_mutex;
+		std::map<uint32_t, History>                 m_histories;
+		uint32_t                                    m_nextKey;
+};
+
+/* ---------------------------------------------------------------------------
+**  Opus encoder forwarding tagged packets
+** -------------------------------------------------------------------------*/
+class OpusPassthroughEncoder : public webrtc::AudioEncoder
+{
+	public:
+		OpusPassthroughEncoder(std::unique_ptr<webrtc::AudioEncoder> encoder, OpusPacketStore* store, int payloadType) : m_encoder(std::move(encoder)), m_store(store), m_payloadType(payloadType), m_key(0), m_cursor(0), m_credit(0), m_timestamp(0) {}
+
+		// overide webrtc::AudioEncoder
+		virtual int    SampleRateHz() const override              { return m_encoder->SampleRateHz();              }
+		virtual size_t NumChannels() const override               { return m_encoder->NumChannels();               }
+		virtual int    RtpTimestampRateHz() const override        { return m_encoder->RtpTimestampRateHz();        }
+		virtual size_t Num10MsFramesInNextPacket() const override { return m_encoder->Num10MsFramesInNextPacket(); }
+		virtual size_t Max10MsFramesInAPacket() const override    { return m_encoder->Max10MsFramesInAPacket();    }
+		virtual int    GetTargetBitrate() const override          { return m_encoder->GetTargetBitrate();          }
+		virtual void   Reset() override                           { m_encoder->Reset();                            }
+		virtual bool   SetFec(bool enable) override               { return m_encoder->SetFec(enable);              }
+		virtual bool   SetDtx(bool enable) override               { return m_encoder->SetDtx(enable);              }
+		virtual bool   SetApplication(Application application) override { return m_encoder->SetApplication(application); }
+		virtual void   SetMaxPlaybackRate(int frequency_hz) override    { m_encoder->SetMaxPlaybackRate(frequency_hz);     }
+		virtual void   OnReceivedUplinkPacketLossFraction(float uplink_packet_loss_fraction) override { m_encoder->OnReceivedUplinkPacketLossFraction(uplink_packet_loss_fraction); }
+		virtual void   OnReceivedUplinkBandwidth(int target_audio_bitrate_bps, rtc::Optional<int64_t> bwe_period_ms) override { m_encoder->OnReceivedUplinkBandwidth(target_audio_bitrate_bps, bwe_period_ms); }
+		virtual void   OnReceivedRtt(int rtt_ms) override         { m_encoder->OnReceivedRtt(rtt_ms);              }
+		virtual void   OnReceivedOverhead(size_t overhead_bytes_per_packet) override { m_encoder->OnReceivedOverhead(overhead_bytes_per_packet); }
+		virtual void   SetReceiverFrameLengthRange(int min_frame_length_ms, int max_frame_length_ms) override { m_encoder->SetReceiverFrameLengthRange(min_frame_length_ms, max_frame_length_ms); }
+
+	protected:
+		virtual EncodedInfo EncodeImpl(uint32_t rtp_timestamp, rtc::ArrayView<const int16_t> audio, rtc::Buffer* encoded) override;
+
+	private:
+		std::unique_ptr<webrtc::AudioEncoder> m_encoder;
+		OpusPacketStore*                      m_store;
+		int                                   m_payloadType;
+		uint32_t                              m_key;          // source of the blocks
+		uint64_t                              m_cursor;       // next packet to read in the history of the source
+		int                                   m_credit;       // samples received and not yet sent
+		uint32_t                              m_timestamp;    // rtp timestamp of the next packet
+};
+
+/* ---------------------------------------------------------------------------
+**  encoder factory wrapping the Opus encoders
+** -------------------------------------------------------------------------*/
+class PassthroughAudioEncoderFactory : public webrtc::AudioEncoderFactory
+{
+	public:
+		static rtc::scoped_refptr<PassthroughAudioEncoderFactory> Create(rtc::scoped_refptr<webrtc::AudioEncoderFactory> factory) {
+			return new rtc::RefCountedObject<PassthroughAudioEncoderFactory>(factory);
+		}
+
+		OpusPacketStore* store() { return &m_store; }
+
+		// overide webrtc::AudioEncoderFactory
+		virtual std::vector<webrtc::AudioCodecSpec> GetSupportedEncoders() override { return m_factory->GetSupportedEncoders(); }
+		virtual rtc::Optional<webrtc::AudioCodecInfo> QueryAudioEncoder(const webrtc::SdpAudioFormat& format) override { return m_factory->QueryAudioEncoder(format); }
+		virtual std::unique_ptr<webrtc::AudioEncoder> MakeAudioEncoder(int payload_type, const webrtc::SdpAudioFormat& format) override;
+
+	protected:
+		PassthroughAudioEncoderFactory(rtc::scoped_refptr<webrtc::AudioEncoderFactory> factory) : m_factory(factory) {}
+
+	private:
+		rtc::scoped_refptr<webrtc::AudioEncoderFactory> m_factory;
+		OpusPacketStore                                 m_store;
+};
+
+#endif
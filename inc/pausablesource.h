@@ -0,0 +1,24 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** pausablesource.h
+**
+** Source that can stay connected without decoding while nobody watch it.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef PAUSABLESOURCE_H_
+#define PAUSABLESOURCE_H_
+
+class PausableSource
+{
+	public:
+		virtual ~PausableSource() {}
+
+		// paused : keep the connection and what is needed to restart, stop decoding
+		virtual void setPaused(bool paused) = 0;
+};
+
+#endif
@@ -0,0 +1,84 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** ringbuffer.h
+**
+** Lock-free single producer / single consumer ring buffer of trivially
+** copyable elements, preallocated with a power of 2 capacity.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef RINGBUFFER_H_
+#define RINGBUFFER_H_
+
+#include <string.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+template<typename T>
+class RingBuffer
+{
+	public:
+		RingBuffer(size_t capacity) : m_head(0), m_tail(0) {
+			size_t size = 1;
+			while (size < capacity) {
+				size <<= 1;
+			}
+			m_buffer.resize(size);
+			m_mask = size - 1;
+		}
+
+		size_t capacity() const { return m_buffer.size(); }
+
+		// number of elements that can be read
+		size_t available() const {
+			return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_relaxed);
+		}
+
+		// producer side : copy up to count elements, return the number written
+		size_t write(const T* data, size_t count) {
+			size_t head = m_head.load(std::memory_order_relaxed);
+			size_t tail = m_tail.load(std::memory_order_acquire);
+			size_t space = m_buffer.size() - (head - tail);
+			if (count > space) {
+				count = space;
+			}
+			size_t offset = head & m_mask;
+			size_t first = std::min(count, m_buffer.size() - offset);
+			memcpy(&m_buffer[offset], data, first*sizeof(T));
+			memcpy(&m_buffer[0], data + first, (count - first)*sizeof(T));
+			m_head.store(head + count, std::memory_order_release);
+			return count;
+		}
+
+		// consumer side : copy up to count elements, return the number read
+		size_t read(T* data, size_t count) {
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+			size_t head = m_head.load(std::memory_order_acquire);
+			if (count > head - tail) {
+				count = head - tail;
+			}
+			size_t offset = tail & m_mask;
+			size_t first = std::min(count, m_buffer.size() - offset);
+			memcpy(data, &m_buffer[offset], first*sizeof(T));
+			memcpy(data + first, &m_buffer[0], (count - first)*sizeof(T));
+			m_tail.store(tail + count, std::memory_order_release);
+			return count;
+		}
+
+		// consumer side : drop all the readable elements
+		void clear() {
+			m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_release);
+		}
+
+	private:
+		std::vector<T>        m_buffer;
+		size_t                m_mask;
+		std::atomic<size_t>   m_head;
+		std::atomic<size_t>   m_tail;
+};
+
+#endif
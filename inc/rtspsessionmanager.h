@@ -0,0 +1,191 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** rtspsessionmanager.h
+**
+** Shared live555 schedulers : a small pool of threads each running one
+** live555 event loop, multiplexing many RTSP sessions. Audio and video
+** consumers of the same URL share one RTSP session.
+**
+** Over UDP the packet reordering threshold of the RTP sources follows the
+** jitter and the late packets given by their reception stats.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef RTSPSESSIONMANAGER_H_
+#define RTSPSESSIONMANAGER_H_
+
+#include <string>
+#include <map>
+#include <vector>
+#include <list>
+#include <queue>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <random>
+
+#include "liveMedia.hh"
+
+#include "environment.h"
+#include "rtspconnectionclient.h"
+
+#include "rtc_base/thread.h"
+#include "rtc_base/json.h"
+
+class RTSPSessionManager;
+
+/* ---------------------------------------------------------------------------
+**  one live555 event loop running in its own thread
+** -------------------------------------------------------------------------*/
+class RTSPScheduler : public rtc::Thread
+{
+	public:
+		RTSPScheduler();
+		virtual ~RTSPScheduler();
+
+		// run a task in the live555 thread (live555 objects are not thread safe)
+		void post(std::function<void()> task);
+
+		Environment& env()   { return m_env;      }
+		int sessionCount()   { return m_sessions; }
+		void addSession()    { m_sessions++;      }
+		void removeSession() { m_sessions--;      }
+
+		// overide rtc::Thread
+		virtual void Run();
+
+	private:
+		static void processTasks(void* clientData);
+
+	private:
+		Environment                           m_env;
+		EventTriggerId                        m_trigger;
+		std::mutex                            m_mutex;
+		std::queue<std::function<void()>>     m_tasks;
+		std::atomic<int>                      m_sessions;
+};
+
+/* ---------------------------------------------------------------------------
+**  one RTSP connection dispatching its subsessions to several consumers
+** -------------------------------------------------------------------------*/
+class RTSPSession : public RTSPConnection::Callback
+{
+	public:
+		enum State { STOPPED, CONNECTING, CONNECTED, WAITING };
+
+		RTSPSession(RTSPSessionManager& manager, RTSPScheduler& scheduler, const std::string & uri, int timeout, int rtptransport);
+		virtual ~RTSPSession();
+
+		// should be called from the live555 thread
+		void connect();
+		void disconnect();
+
+		void addSink(RTSPConnection::Callback* sink);
+		bool removeSink(RTSPConnection::Callback* sink);
+
+		RTSPScheduler& scheduler() { return m_scheduler; }
+		Json::Value    getStats();
+
+		// overide RTSPConnection::Callback
+		virtual bool    onNewSession(const char* id, const char* media, const char* codec, const char* sdp);
+		virtual bool    onData(const char* id, unsigned char* buffer, ssize_t size, struct timeval presentationTime);
+		virtual ssize_t onNewBuffer(unsigned char* buffer, ssize_t size);
+		virtual void    onConnectionTimeout(RTSPConnection& connection);
+		virtual void    onDataTimeout(RTSPConnection& connection);
+		virtual void    onError(RTSPConnection& connection, const char* error);
+
+	private:
+		void        scheduleReconnect(const std::string & reason);
+		static void reconnectTask(void* clientData);
+		void        releaseReconnectSlot();
+		RTPSource*  rtpSource(const std::string & id);
+		void        updateReordering();
+		static void receptionTask(void* clientData);
+
+	private:
+		// reception of a subsession from the stats of its RTP source
+		struct Reception {
+			Reception() : thresholdMs(kDefaultReorderMs), jitterMs(0), expected(0), received(0), lost(0), late(0) {}
+			int       thresholdMs;
+			double    jitterMs;
+			unsigned  expected;
+			unsigned  received;
+			unsigned  lost;
+			unsigned  late;
+		};
+		static const int kDefaultReorderMs = 100;
+		static const int kMinReorderMs     = 20;
+		static const int kMaxReorderMs     = 500;
+		static const int kReceptionPeriodMs = 1000;
+
+	private:
+		RTSPSessionManager&                               m_manager;
+		RTSPScheduler&                                    m_scheduler;
+		std::string                                       m_uri;
+		int                                               m_timeout;
+		int                                               m_rtptransport;
+		std::unique_ptr<RTSPConnection>                   m_connection;
+		std::mutex                                        m_mutex;
+		std::list<RTSPConnection::Callback*>              m_sinks;
+		std::map<std::string, RTSPConnection::Callback*>  m_routes;
+		RTSPConnection::Callback*                         m_lastAccepted;
+
+		// reconnection backoff
+		std::atomic<int>                                  m_state;
+		std::atomic<int>                                  m_attempts;
+		std::atomic<int>                                  m_reconnectCount;
+		std::atomic<int64_t>                              m_nextRetryMs;
+		bool                                              m_holdSlot;
+		TaskToken                                         m_reconnectTask;
+		std::string                                       m_lastError;
+		std::mt19937                                      m_random;
+
+		// reordering threshold of the RTP sources
+		bool                                              m_reorderEnabled;
+		std::map<std::string, Reception>                  m_reception;
+		TaskToken                                         m_receptionTask;
+};
+
+/* ---------------------------------------------------------------------------
+**  pool of schedulers and registry of the RTSP sessions by URL
+** -------------------------------------------------------------------------*/
+class RTSPSessionManager
+{
+	public:
+		RTSPSessionManager(int nbSchedulers, int maxConcurrentReconnects, int minReconnectDelayMs, int maxReconnectDelayMs);
+		virtual ~RTSPSessionManager();
+
+		// attach a consumer to the session of the uri (created if needed)
+		void subscribe(RTSPConnection::Callback* sink, const std::string & uri, int timeout, const std::string & rtptransport);
+		// detach a consumer, the session is closed when nobody use it
+		void unsubscribe(RTSPConnection::Callback* sink, const std::string & uri);
+
+		// reconnection state of the session of the uri
+		Json::Value getStats(const std::string & uri);
+
+		static int decodeRTPTransport(const std::string & rtpTransportString);
+
+		// process wide limit of the reconnections in progress
+		bool acquireReconnectSlot();
+		void releaseReconnectSlot() { m_reconnecting--; }
+		int  minReconnectDelayMs()  { return m_minReconnectDelayMs; }
+		int  maxReconnectDelayMs()  { return m_maxReconnectDelayMs; }
+
+	private:
+		RTSPScheduler* getScheduler();
+
+	private:
+		int                                          m_maxConcurrentReconnects;
+		int                                          m_minReconnectDelayMs;
+		int                                          m_maxReconnectDelayMs;
+		std::atomic<int>                             m_reconnecting;
+		std::vector<std::unique_ptr<RTSPScheduler>>  m_schedulers;
+		std::mutex                                   m_mutex;
+		std::map<std::string, RTSPSession*>          m_sessions;
+};
+
+#endif
@@ -12,43 +12,34 @@
 
 #include <string.h>
 #include <vector>
+#include <list>
+#include <atomic>
 
-#include "environment.h"
-#include "rtspconnectionclient.h"
+#include "rtspsessionmanager.h"
+#include "pausablesource.h"
+#include "metrics.h"
+#include "asynclog.h"
 
-#include "rtc_base/thread.h"
 #include "api/video_codecs/video_decoder.h"
 #include "media/base/videocapturer.h"
 #include "media/engine/internaldecoderfactory.h"
 
 #include "h264_stream.h"
 
-class RTSPVideoCapturer : public cricket::VideoCapturer, public RTSPConnection::Callback, public rtc::Thread, public webrtc::DecodedImageCallback
+class RTSPVideoCapturer : public cricket::VideoCapturer, public RTSPConnection::Callback, public webrtc::DecodedImageCallback, public PausableSource
 {
 	public:
-		RTSPVideoCapturer(const std::string & uri, int timeout, const std::string & rtptransport);
+		RTSPVideoCapturer(RTSPSessionManager & sessionManager, const std::string & uri, int timeout, const std::string & rtptransport, std::shared_ptr<SourceMetrics> metrics);
 		virtual ~RTSPVideoCapturer();
 
 		// overide RTSPConnection::Callback
 		virtual bool onNewSession(const char* id, const char* media, const char* codec, const char* sdp);
 		virtual bool onData(const char* id, unsigned char* buffer, ssize_t size, struct timeval presentationTime);
 		virtual ssize_t onNewBuffer(unsigned char* buffer, ssize_t size);
-                virtual void    onConnectionTimeout(RTSPConnection& connection) {
-                        connection.start();
-                }
-                virtual void    onDataTimeout(RTSPConnection& connection)       {
-                        connection.start();
-                }
-                virtual void    onError(RTSPConnection& connection,const char* erro)       {
-                        connection.start();
-                }		
 
 		// overide webrtc::DecodedImageCallback
 		virtual int32_t Decoded(webrtc::VideoFrame& decodedImage);
 
-		// overide rtc::Thread
-		virtual void Run();
-
 		// overide cricket::VideoCapturer
 		virtual cricket::CaptureState Start(const cricket::VideoFormat& format);
 		virtual void Stop();
@@ -56,15 +47,34 @@ class RTSPVideoCapturer : public cricket::VideoCapturer, public RTSPConnection::
 		virtual bool IsScreencast() const { return false; };
 		virtual bool IsRunning() { return this->capture_state() == cricket::CS_RUNNING; }
 
+		// overide PausableSource
+		virtual void setPaused(bool paused) { m_paused = paused; }
+
+	private:
+		bool decode(const char* id, unsigned char* buffer, ssize_t size, struct timeval presentationTime);
+		// keep the last IDR and its parameter sets to show a picture on resume
+		void cache(unsigned char* buffer, ssize_t size, struct timeval presentationTime);
+
+		struct CachedData {
+			std::vector<uint8_t> data;
+			struct timeval       presentationTime;
+		};
 
 	private:
-		Environment                           m_env;
-		RTSPConnection                        m_connection;
+		RTSPSessionManager&                   m_sessionManager;
+		std::string                           m_uri;
+		int                                   m_timeout;
+		std::string                           m_rtptransport;
 		webrtc::InternalDecoderFactory        m_factory;
 		std::unique_ptr<webrtc::VideoDecoder> m_decoder;
 		std::vector<uint8_t>                  m_cfg;
 		std::string                           m_codec;
                 h264_stream_t*                        m_h264;
+		std::atomic<bool>                     m_paused;
+		std::list<CachedData>                 m_cache;
+		bool                                  m_waitIdr;
+		std::shared_ptr<SourceMetrics>        m_metrics;
+		int64_t                               m_onFrameUs;
 };
 
 
@@ -72,10 +82,13 @@ class RTSPVideoCapturer : public cricket::VideoCapturer, public RTSPConnection::
 #include "api/audio_codecs/builtin_audio_decoder_factory.h"
 #include <iostream>
 
-class RTSPAudioSource : public webrtc::Notifier<webrtc::AudioSourceInterface>, public rtc::Thread, public RTSPConnection::Callback {
+#include "ringbuffer.h"
+#include "opuspassthrough.h"
+
+class RTSPAudioSource : public webrtc::Notifier<webrtc::AudioSourceInterface>, public RTSPConnection::Callback, public PausableSource {
 	public:
-		static rtc::scoped_refptr<RTSPAudioSource> Create(rtc::scoped_refptr<webrtc::AudioDecoderFactory> audioDecoderFactory, const std::string & uri) {
-			rtc::scoped_refptr<RTSPAudioSource> source(new rtc::RefCountedObject<RTSPAudioSource>(audioDecoderFactory, uri));
+		static rtc::scoped_refptr<RTSPAudioSource> Create(RTSPSessionManager & sessionManager, rtc::scoped_refptr<webrtc::AudioDecoderFactory> audioDecoderFactory, OpusPacketStore* opusStore, const std::string & uri, int timeout, const std::string & rtptransport) {
+			rtc::scoped_refptr<RTSPAudioSource> source(new rtc::RefCountedObject<RTSPAudioSource>(sessionManager, audioDecoderFactory, opusStore, uri, timeout, rtptransport));
 			return source;
 		}
 
@@ -90,9 +103,6 @@ class RTSPAudioSource : public webrtc::Notifier<webrtc::AudioSourceInterface>, p
 			RTC_LOG(INFO) << "RTSPAudioSource::RemoveSink ";
 			m_sink = NULL;
 		}
-		
-		// overide rtc::Thread
-		virtual void Run() { m_env.mainloop(); } 		
 
 		// overide RTSPConnection::Callback
 		virtual bool onNewSession(const char* id, const char* media, const char* codec, const char* sdp) {
@@ -122,12 +132,28 @@ class RTSPAudioSource : public webrtc::Notifier<webrtc::AudioSourceInterface>, p
 					}
 				}
 				RTC_LOG(INFO) << "RTSPAudioSource::onNewSession freq:" << m_freq << " channel:" << m_channel;
+
+				// preallocate buffers : largest decoded frame, 10ms chunk and 500ms of queued samples
+				m_decoded.resize(m_freq*m_channel*kMaxFrameMs/1000);
+				m_chunk.resize(m_freq*m_channel/100);
+				m_buffer.reset(new RingBuffer<int16_t>(m_freq*m_channel/2));
 				
 				if (strcmp(codec, "PCMU") == 0) 
 				{
 					m_decoder = m_factory->MakeAudioDecoder(webrtc::SdpAudioFormat(codec, m_freq, m_channel));
 					success = true;
 				}
+				else if ( (strcmp(codec, "OPUS") == 0) && (m_opusStore) )
+				{
+					// forward Opus packets to the encoders without decoding
+					RTC_LOG(INFO) << "RTSPAudioSource::onNewSession Opus passthrough";
+					m_freq = OpusPacketStore::kSampleRate;
+					m_chunk.resize(m_freq*m_channel/100);
+					m_decoder.reset();
+					m_opusSamples = 0;
+					m_passthrough = true;
+					success = true;
+				}
 				else if (strcmp(codec, "OPUS") == 0) 
 				{
 					m_decoder = m_factory->MakeAudioDecoder(webrtc::SdpAudioFormat(codec, m_freq, m_channel));
@@ -144,53 +170,99 @@ class RTSPAudioSource : public webrtc::Notifier<webrtc::AudioSourceInterface>, p
 		
 		virtual bool onData(const char* id, unsigned char* buffer, ssize_t size, struct timeval presentationTime) {
 			bool success = false;
-			int segmentLength = m_freq/100;
-			if (m_sink) {								
-				if (m_decoder.get() != NULL) {				
-					int16_t decoded[size];
+			if (m_paused) {
+				// nothing to restart from, audio frames are independent
+				success = true;
+			} else if (m_sink) {
+				int samples = m_passthrough ? OpusPacketStore::sampleCount(buffer, size) : 0;
+				int segmentLength = m_freq/100;
+				if ( (m_passthrough) && (samples > 0) && (samples < segmentLength) ) {
+					// the encoder sends one packet by block of 10ms, the shorter packets are decoded
+					RTC_LOG(LS_WARNING) << "RTSPAudioSource::onData Opus packet of " << samples << " samples, passthrough disabled";
+					m_passthrough = false;
+					m_decoder = m_factory->MakeAudioDecoder(webrtc::SdpAudioFormat("opus", m_freq, m_channel));
+				}
+				if (m_passthrough) {
+					// one block of 10ms with the key of the source for each 10ms of samples
+					if (samples > 0) {
+						m_opusStore->push(m_opusKey, buffer, size, samples);
+						m_opusSamples += samples;
+						while (m_opusSamples >= segmentLength) {
+							OpusPacketStore::tag(m_chunk.data(), segmentLength, m_channel, m_opusKey);
+							m_sink->OnData(m_chunk.data(), 16, m_freq, m_channel, segmentLength);
+							m_opusSamples -= segmentLength;
+						}
+						success = true;
+					} else {
+						STREAMER_LOG_EVERY_MS(LS_ERROR, 1000) << "RTSPAudioSource::onData error:Invalid Opus packet";
+					}
+				} else if ( (m_decoder.get() != NULL) && (m_buffer) ) {
 					webrtc::AudioDecoder::SpeechType speech_type;
-					int res = m_decoder->Decode(buffer, size, m_freq, sizeof(decoded), decoded, &speech_type);
-					RTC_LOG(LS_VERBOSE) << "RTSPAudioSource::onData size:" << size << " decoded:" << res;
+					int res = m_decoder->Decode(buffer, size, m_freq, m_decoded.size()*sizeof(int16_t), m_decoded.data(), &speech_type);
+					STREAMER_LOG_VERBOSE << "RTSPAudioSource::onData size:" << size << " decoded:" << res;
 					if (res > 0) {
-						for (int i = 0 ; i < res*m_channel; ++i) {
-							m_buffer.push(decoded[i]);
+						// res is the number of samples across all channels
+						size_t written = m_buffer->write(m_decoded.data(), res);
+						if (written < (size_t)res) {
+							STREAMER_LOG_EVERY_MS(LS_WARNING, 1000) << "RTSPAudioSource::onData overflow drop:" << (res - written);
 						}
 					} else {
-						RTC_LOG(LS_ERROR) << "RTSPAudioSource::onData error:Decode Audio failed";
-					}																
-					while (m_buffer.size() > segmentLength*m_channel) {
-						int16_t outbuffer[segmentLength*m_channel];
-						for (int i=0; i<segmentLength*m_channel; ++i) {
-							uint16_t value = m_buffer.front();
-							outbuffer[i] = value;
-							m_buffer.pop();
-						}
-						m_sink->OnData(outbuffer, 16, m_freq, m_channel, segmentLength);
+						STREAMER_LOG_EVERY_MS(LS_ERROR, 1000) << "RTSPAudioSource::onData error:Decode Audio failed";
+					}
+					// forward by chunks of 10ms
+					int segmentLength = m_freq/100;
+					while (m_buffer->available() >= m_chunk.size()) {
+						m_buffer->read(m_chunk.data(), m_chunk.size());
+						m_sink->OnData(m_chunk.data(), 16, m_freq, m_channel, segmentLength);
 					}
 					success = true;
 				} else {
-					RTC_LOG(LS_ERROR) << "RTSPAudioSource::onData error:No Audio decoder";
+					STREAMER_LOG_EVERY_MS(LS_ERROR, 1000) << "RTSPAudioSource::onData error:No Audio decoder";
 				}
 			} else {
-				RTC_LOG(LS_ERROR) << "RTSPAudioSource::onData error:No Audio Sink";
+				STREAMER_LOG_EVERY_MS(LS_ERROR, 1000) << "RTSPAudioSource::onData error:No Audio Sink";
 			}
 			return success;
 		}
 
 	protected:
-		RTSPAudioSource(rtc::scoped_refptr<webrtc::AudioDecoderFactory> audioDecoderFactory, const std::string & uri) : m_connection(m_env, this, uri.c_str()), m_factory(audioDecoderFactory), m_sink(NULL), m_freq(8000), m_channel(1) { rtc::Thread::Start(); }
-		virtual ~RTSPAudioSource() override { m_env.stop(); rtc::Thread::Stop(); }
+		RTSPAudioSource(RTSPSessionManager & sessionManager, rtc::scoped_refptr<webrtc::AudioDecoderFactory> audioDecoderFactory, OpusPacketStore* opusStore, const std::string & uri, int timeout, const std::string & rtptransport) 
+			: m_sessionManager(sessionManager), m_uri(uri), m_factory(audioDecoderFactory), m_opusStore(opusStore), m_opusKey(0), m_opusSamples(0), m_passthrough(false), m_paused(false), m_sink(NULL), m_freq(8000), m_channel(1) { 
+			if (m_opusStore) {
+				m_opusKey = m_opusStore->addSource();
+			}
+			m_sessionManager.subscribe(this, m_uri, timeout, rtptransport); 
+		}
+		virtual ~RTSPAudioSource() override {
+			m_sessionManager.unsubscribe(this, m_uri);
+			if (m_opusStore) {
+				m_opusStore->removeSource(m_opusKey);
+			}
+		}
+
+	public:
+		// overide PausableSource
+		virtual void setPaused(bool paused) { m_paused = paused; }
 
 
 	private:
-		Environment                             m_env;
-		RTSPConnection                          m_connection; 
+		RTSPSessionManager&                     m_sessionManager;
+		std::string                             m_uri;
 		rtc::scoped_refptr<webrtc::AudioDecoderFactory> m_factory;
 		std::unique_ptr<webrtc::AudioDecoder>   m_decoder;
+		OpusPacketStore*                        m_opusStore;
+		uint32_t                                m_opusKey;
+		int                                     m_opusSamples;   // samples received and not yet given in a block
+		bool                                    m_passthrough;
+		std::atomic<bool>                       m_paused;
 		webrtc::AudioTrackSinkInterface*        m_sink;
 		int                                     m_freq;
 		int                                     m_channel;
-		std::queue<uint16_t>                    m_buffer;
+		std::vector<int16_t>                    m_decoded;
+		std::vector<int16_t>                    m_chunk;
+		std::unique_ptr<RingBuffer<int16_t>>    m_buffer;
+
+		static const int                        kMaxFrameMs = 120;
 };
 
 
@@ -0,0 +1,162 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** sharedvideoencoder.h
+**
+** Encode a stream once for all the viewers.
+**
+** The viewers of a track receive the same frame buffers. The encoder given
+** to each PeerConnection joins a group that already encoded the frames it
+** receives, the group encodes each frame once and every member packetizes
+** the same encoded images. Keyframe requests of the members are coalesced.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef SHAREDVIDEOENCODER_H_
+#define SHAREDVIDEOENCODER_H_
+
+#include <list>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <vector>
+
+#include "api/video_codecs/video_encoder.h"
+#include "api/video/video_frame_buffer.h"
+#include "rtc_base/scoped_ref_ptr.h"
+#include "api/video_codecs/video_encoder_factory.h"
+#include "api/video_codecs/sdp_video_format.h"
+#include "modules/video_coding/include/video_error_codes.h"
+
+#include "latencyhistogram.h"
+
+class SharedVideoEncoder;
+
+/* ---------------------------------------------------------------------------
+**  one real encoder shared by several SharedVideoEncoder
+** -------------------------------------------------------------------------*/
+class SharedEncoderGroup : public webrtc::EncodedImageCallback
+{
+	public:
+		// encoded images of one frame (one per simulcast layer)
+		struct Output {
+			webrtc::EncodedImage                            image;
+			std::vector<uint8_t>                            data;
+			webrtc::CodecSpecificInfo                       info;
+			bool                                            hasInfo;
+			std::unique_ptr<webrtc::RTPFragmentationHeader> fragmentation;
+		};
+		// the buffer is held while cached, its address cannot be reused by another frame
+		struct EncodedFrame {
+			rtc::scoped_refptr<webrtc::VideoFrameBuffer>    buffer;
+			uint32_t                                        rtpTimestamp;   // of the frame given to the encoder
+			std::list<std::shared_ptr<Output>>              outputs;
+		};
+
+		// the histograms can be null
+		SharedEncoderGroup(std::unique_ptr<webrtc::VideoEncoder> encoder, const webrtc::SdpVideoFormat & format, const webrtc::VideoCodec & settings, LatencyHistogram* encodeLatency, LatencyHistogram* packetizeLatency);
+		virtual ~SharedEncoderGroup();
+
+		int32_t init(int numberOfCores, size_t maxPayloadSize);
+		bool    matches(const webrtc::SdpVideoFormat & format, const webrtc::VideoCodec & settings);
+		bool    hasFrame(const webrtc::VideoFrameBuffer* buffer);
+
+		void    addMember(SharedVideoEncoder* member);
+		void    removeMember(SharedVideoEncoder* member);
+		size_t  memberCount();
+		void    setRateAllocation(SharedVideoEncoder* member, const webrtc::BitrateAllocation & allocation, uint32_t framerate);
+
+		// encode the frame if no member did it, give the encoded images to the callback
+		int32_t encode(const webrtc::VideoFrame & frame, bool keyframe, webrtc::EncodedImageCallback* callback);
+
+		// overide webrtc::EncodedImageCallback
+		virtual Result OnEncodedImage(const webrtc::EncodedImage& image, const webrtc::CodecSpecificInfo* info, const webrtc::RTPFragmentationHeader* fragmentation) override;
+
+	private:
+		void applyRateAllocation();
+
+	private:
+		static const size_t   kCacheSize = 8;
+		static const int64_t  kMinKeyframeIntervalMs = 300;
+
+		// calls to the encoder, taken before m_mutex that protects the cache and the members
+		std::mutex                                        m_encoderMutex;
+		std::mutex                                        m_mutex;
+		std::unique_ptr<webrtc::VideoEncoder>             m_encoder;
+		webrtc::SdpVideoFormat                            m_format;
+		webrtc::VideoCodec                                m_settings;
+		std::deque<EncodedFrame>                          m_frames;
+		std::map<SharedVideoEncoder*, std::pair<webrtc::BitrateAllocation, uint32_t>> m_members;
+		bool                                              m_keyframePending;
+		int64_t                                           m_lastKeyframeMs;
+		LatencyHistogram*                                 m_encodeLatency;
+		LatencyHistogram*                                 m_packetizeLatency;
+};
+
+/* ---------------------------------------------------------------------------
+**  encoder factory creating SharedVideoEncoder
+** -------------------------------------------------------------------------*/
+class SharedVideoEncoderFactory : public webrtc::VideoEncoderFactory
+{
+	public:
+		SharedVideoEncoderFactory(std::unique_ptr<webrtc::VideoEncoderFactory> factory, bool shared, LatencyHistogram* encodeLatency = NULL, LatencyHistogram* packetizeLatency = NULL)
+			: m_factory(std::move(factory)), m_shared(shared), m_encodeLatency(encodeLatency), m_packetizeLatency(packetizeLatency) {}
+
+		// group that already encoded the buffer with the same settings, null if none
+		std::shared_ptr<SharedEncoderGroup> find(const webrtc::SdpVideoFormat & format, const webrtc::VideoCodec & settings, const webrtc::VideoFrameBuffer* buffer);
+		// new group with its own encoder
+		std::shared_ptr<SharedEncoderGroup> create(const webrtc::SdpVideoFormat & format, const webrtc::VideoCodec & settings, int numberOfCores, size_t maxPayloadSize);
+
+		// overide webrtc::VideoEncoderFactory
+		virtual std::vector<webrtc::SdpVideoFormat> GetSupportedFormats() const override { return m_factory->GetSupportedFormats(); }
+		virtual CodecInfo QueryVideoEncoder(const webrtc::SdpVideoFormat& format) const override { return m_factory->QueryVideoEncoder(format); }
+		virtual std::unique_ptr<webrtc::VideoEncoder> CreateVideoEncoder(const webrtc::SdpVideoFormat& format) override;
+
+	private:
+		std::unique_ptr<webrtc::VideoEncoderFactory>      m_factory;
+		bool                                              m_shared;
+		LatencyHistogram*                                 m_encodeLatency;
+		LatencyHistogram*                                 m_packetizeLatency;
+		std::mutex                                        m_mutex;
+		std::list<std::weak_ptr<SharedEncoderGroup>>      m_groups;
+};
+
+/* ---------------------------------------------------------------------------
+**  encoder of one PeerConnection, member of a SharedEncoderGroup
+** -------------------------------------------------------------------------*/
+class SharedVideoEncoder : public webrtc::VideoEncoder
+{
+	public:
+		SharedVideoEncoder(SharedVideoEncoderFactory* factory, const webrtc::SdpVideoFormat & format) : m_factory(factory), m_format(format), m_numberOfCores(1), m_maxPayloadSize(0), m_callback(NULL), m_framerate(0) {}
+		virtual ~SharedVideoEncoder() { this->leave(); }
+
+		// overide webrtc::VideoEncoder
+		virtual int32_t InitEncode(const webrtc::VideoCodec* codec_settings, int32_t number_of_cores, size_t max_payload_size) override;
+		virtual int32_t RegisterEncodeCompleteCallback(webrtc::EncodedImageCallback* callback) override { m_callback = callback; return WEBRTC_VIDEO_CODEC_OK; }
+		virtual int32_t Release() override { this->leave(); return WEBRTC_VIDEO_CODEC_OK; }
+		virtual int32_t Encode(const webrtc::VideoFrame& frame, const webrtc::CodecSpecificInfo* codec_specific_info, const std::vector<webrtc::FrameType>* frame_types) override;
+		virtual int32_t SetChannelParameters(uint32_t packet_loss, int64_t rtt) override { return WEBRTC_VIDEO_CODEC_OK; }
+		virtual int32_t SetRateAllocation(const webrtc::BitrateAllocation& allocation, uint32_t framerate) override;
+		// the resolution is the same for all the members
+		virtual ScalingSettings GetScalingSettings() const override { return ScalingSettings(false); }
+		virtual const char* ImplementationName() const override { return "SharedVideoEncoder"; }
+
+	private:
+		void leave();
+
+	private:
+		SharedVideoEncoderFactory*            m_factory;
+		webrtc::SdpVideoFormat                m_format;
+		webrtc::VideoCodec                    m_settings;
+		int32_t                               m_numberOfCores;
+		size_t                                m_maxPayloadSize;
+		webrtc::EncodedImageCallback*         m_callback;
+		webrtc::BitrateAllocation             m_allocation;
+		uint32_t                              m_framerate;
+		std::shared_ptr<SharedEncoderGroup>   m_group;
+};
+
+#endif
@@ -0,0 +1,53 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** statshistory.h
+**
+** Numeric statistics of a PeerConnection kept in a ring buffer. Each field
+** is named type[.kind].id.member, like
+** outbound-rtp.video.RTCOutboundRTPVideoStream_1234.bytesSent, only the
+** nominated candidate pair and its candidates are kept.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef STATSHISTORY_H_
+#define STATSHISTORY_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <mutex>
+
+#include "api/stats/rtcstatscollectorcallback.h"
+#include "rtc_base/json.h"
+
+class StatsHistory : public webrtc::RTCStatsCollectorCallback
+{
+	public:
+		static rtc::scoped_refptr<StatsHistory> Create(size_t depth) {
+			return new rtc::RefCountedObject<StatsHistory>(depth);
+		}
+
+		// the last samples, oldest first, of the fields starting with field (all if empty)
+		// { "timestamps": [ms,...], "fields": { name: [value or null,...] } }
+		Json::Value query(const std::string & field, size_t last);
+
+		// overide webrtc::RTCStatsCollectorCallback
+		virtual void OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) override;
+
+	protected:
+		StatsHistory(size_t depth) : m_depth(std::max<size_t>(depth, 1)), m_timestamps(m_depth, 0), m_next(0), m_count(0) {}
+
+	private:
+		size_t                                      m_depth;
+		std::mutex                                  m_mutex;
+		std::vector<int64_t>                        m_timestamps;
+		std::map<std::string, std::vector<double>>  m_series;
+		size_t                                      m_next;
+		size_t                                      m_count;
+};
+
+#endif
@@ -0,0 +1,45 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** tracecapture.h
+**
+** Capture of the trace events of WebRTC and of webrtc-streamer in the Chrome
+** trace format (chrome://tracing, Perfetto). The categories stay disabled
+** out of a capture, the macros of rtc_base/trace_event.h then only test a
+** byte. During a capture each thread writes in its own ring buffer.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef TRACECAPTURE_H_
+#define TRACECAPTURE_H_
+
+#include "rtc_base/json.h"
+
+// category of the trace events of webrtc-streamer
+#define TRACE_CATEGORY "webrtcstreamer"
+
+class TraceCapture
+{
+	public:
+		// give the trace events to the capture, once at startup
+		static void install();
+
+		// record the events during durationMs, null if a capture is already running
+		static Json::Value capture(int durationMs);
+
+	private:
+		static const unsigned char* getCategoryEnabled(const char* name);
+		static void addTraceEvent(char phase,
+			const unsigned char* categoryEnabled,
+			const char* name,
+			unsigned long long id,
+			int numArgs,
+			const char** argNames,
+			const unsigned char* argTypes,
+			const unsigned long long* argValues,
+			unsigned char flags);
+};
+
+#endif
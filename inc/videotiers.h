@@ -0,0 +1,124 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** videotiers.h
+**
+** Quality tiers of a video stream : each tier is a track scaled from the
+** source track, each PeerConnection sends the tier that fits its bandwidth
+** estimation.
+**
+** -------------------------------------------------------------------------*/
+
+#ifndef VIDEOTIERS_H_
+#define VIDEOTIERS_H_
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+
+#include "api/peerconnectioninterface.h"
+#include "api/stats/rtcstatscollectorcallback.h"
+#include "common_video/include/i420_buffer_pool.h"
+#include "media/base/adaptedvideotracksource.h"
+#include "rtc_base/json.h"
+
+/* ---------------------------------------------------------------------------
+**  source scaling the frames of a track to a maximum height and frame rate
+** -------------------------------------------------------------------------*/
+class TierVideoSource : public rtc::AdaptedVideoTrackSource, public rtc::VideoSinkInterface<webrtc::VideoFrame>
+{
+	public:
+		// height or fps 0 : not limited
+		static rtc::scoped_refptr<TierVideoSource> Create(rtc::scoped_refptr<webrtc::VideoTrackInterface> track, int height, int fps = 0) {
+			return new rtc::RefCountedObject<TierVideoSource>(track, height, fps);
+		}
+
+		// overide rtc::VideoSinkInterface
+		virtual void OnFrame(const webrtc::VideoFrame& frame) override;
+
+		// overide rtc::AdaptedVideoTrackSource
+		virtual bool is_screencast() const override { return false; }
+		virtual rtc::Optional<bool> needs_denoising() const override { return rtc::Optional<bool>(false); }
+		virtual SourceState state() const override { return kLive; }
+		virtual bool remote() const override { return false; }
+
+	protected:
+		TierVideoSource(rtc::scoped_refptr<webrtc::VideoTrackInterface> track, int height, int fps);
+		virtual ~TierVideoSource();
+
+	private:
+		rtc::scoped_refptr<webrtc::VideoTrackInterface> m_track;
+		int                                             m_height;
+		int64_t                                         m_minIntervalUs;
+		int64_t                                         m_lastFrameUs;
+		webrtc::I420BufferPool                          m_pool;
+};
+
+/* ---------------------------------------------------------------------------
+**  tiers of a stream
+** -------------------------------------------------------------------------*/
+class VideoTiers
+{
+	public:
+		struct Tier {
+			int                                              height;
+			int                                              bitrateKbps;
+			rtc::scoped_refptr<webrtc::VideoTrackInterface>  track;
+		};
+
+		// parse "height:kbps,height:kbps,..." sorted by decreasing bitrate, empty if invalid
+		static std::vector<Tier> parse(const std::string & config);
+
+		VideoTiers(const std::vector<Tier> & tiers) : m_tiers(tiers) {}
+
+		size_t        size() const                { return m_tiers.size(); }
+		const Tier &  at(size_t index) const      { return m_tiers.at(index); }
+
+	private:
+		std::vector<Tier> m_tiers;
+};
+
+/* ---------------------------------------------------------------------------
+**  choose the tier sent to a PeerConnection from its bandwidth estimation
+** -------------------------------------------------------------------------*/
+class VideoTierSelector : public webrtc::RTCStatsCollectorCallback
+{
+	public:
+		static rtc::scoped_refptr<VideoTierSelector> Create(std::shared_ptr<VideoTiers> tiers, rtc::scoped_refptr<webrtc::RtpSenderInterface> sender) {
+			return new rtc::RefCountedObject<VideoTierSelector>(tiers, sender);
+		}
+
+		Json::Value getStats();
+		// index of the tier sent
+		size_t      currentTier();
+
+		// overide webrtc::RTCStatsCollectorCallback
+		virtual void OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report) override;
+
+	protected:
+		VideoTierSelector(std::shared_ptr<VideoTiers> tiers, rtc::scoped_refptr<webrtc::RtpSenderInterface> sender);
+
+	private:
+		void select(size_t index);
+		void setMaxBitrate(int bitrateKbps);
+
+	private:
+		// consecutive estimations needed to change of tier, estimations given to a probe
+		static const int kDownSamples  = 2;
+		static const int kUpSamples    = 4;
+		static const int kProbeSamples = 4;
+
+		std::mutex                                       m_mutex;
+		std::shared_ptr<VideoTiers>                      m_tiers;
+		rtc::scoped_refptr<webrtc::RtpSenderInterface>   m_sender;
+		size_t                                           m_current;
+		int                                              m_down;
+		int                                              m_up;
+		int                                              m_probe;        // estimations since the probe of the upper tier began, 0 if none
+		double                                           m_bandwidthKbps;
+};
+
+#endif
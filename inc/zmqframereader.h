@@ -2,6 +2,7 @@
 #define ZMQFRAMEREADER_H_
 
 #include <string.h>
+#include <atomic>
 
 #include "rtc_base/thread.h"
 
@@ -11,10 +12,13 @@
 
 #include <zmq.hpp>
 
-class ZMQFrameReader : public cricket::VideoCapturer, public rtc::Thread, public webrtc::DecodedImageCallback
+#include "pausablesource.h"
+#include "metrics.h"
+
+class ZMQFrameReader : public cricket::VideoCapturer, public rtc::Thread, public webrtc::DecodedImageCallback, public PausableSource
 {
 	public:
-		ZMQFrameReader(const std::string &pipename);
+		ZMQFrameReader(const std::string &pipename, std::shared_ptr<SourceMetrics> metrics);
 		virtual ~ZMQFrameReader();
 
 		// overide webrtc::DecodedImageCallback
@@ -30,12 +34,18 @@ class ZMQFrameReader : public cricket::VideoCapturer, public rtc::Thread, public
 		virtual bool IsScreencast() const { return false; };
 		virtual bool IsRunning() { return this->capture_state() == cricket::CS_RUNNING; }
 
+		// overide PausableSource
+		virtual void setPaused(bool paused) { m_paused = paused; }
+
 	private:
 		std::vector<uint8_t>                  m_cfg;
 		zmq::context_t                        m_zmqctx;
 		zmq::socket_t                         m_zmqsocket;
+		std::atomic<bool>                     m_paused;
+		zmq::message_t                        m_lastMessage;
 		bool                                  running;
 		std::string                           pipename;
+		std::shared_ptr<SourceMetrics>        m_metrics;
 };
 
 #endif
\ No newline at end of file
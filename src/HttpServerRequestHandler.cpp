@@ -7,11 +7,53 @@
 **
 ** -------------------------------------------------------------------------*/
 
+#include <string.h>
+#include <strings.h>
+
 #include <iostream>
+#include <sstream>
+#include <set>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
 
 #include "HttpServerRequestHandler.h"
+#include "tracecapture.h"
+#include "asynclog.h"
 
 #include "rtc_base/logging.h"
+#include "rtc_base/timeutils.h"
+
+/* ---------------------------------------------------------------------------
+**  write a response with its headers, the connection is kept open when the
+**  server and the client allow it
+** -------------------------------------------------------------------------*/
+static void writeResponse(CivetServer *server, struct mg_connection *conn, const char* status, const char* contentType, const std::string & headers, const std::string & body)
+{
+	const struct mg_request_info *req_info = mg_get_request_info(conn);
+	const char* enabled = mg_get_option(server->getContext(), "enable_keep_alive");
+	const char* connection = mg_get_header(conn, "Connection");
+	bool keepAlive = false;
+	if ( (enabled) && (strcmp(enabled, "yes") == 0) )
+	{
+		// HTTP/1.1 keeps the connection unless the client asks to close it, HTTP/1.0 only if asked
+		keepAlive = (connection) ? (strcasecmp(connection, "keep-alive") == 0) : ( (req_info->http_version) && (strcmp(req_info->http_version, "1.1") == 0) );
+	}
+
+	std::ostringstream os;
+	os << "HTTP/1.1 " << status << "\r\n";
+	os << "Content-Type: " << contentType << "\r\n";
+	os << "Content-Length: " << body.size() << "\r\n";
+	os << headers;
+	os << "Connection: " << (keepAlive ? "keep-alive" : "close") << "\r\n";
+	os << "\r\n";
+	std::string header(os.str());
+	mg_write(conn, header.c_str(), header.size());
+	mg_write(conn, body.c_str(), body.size());
+}
 
 /* ---------------------------------------------------------------------------
 **  Civet HTTP callback
@@ -29,9 +71,10 @@ class RequestHandler : public CivetHandler
 		httpFunction fct = httpServer->getFunction(req_info->request_uri);
 		if (fct != NULL)
 		{
-			Json::Value  jmessage;
+			httpServer->getMetrics().requestStarted();
 
-			// read input
+			// read input, even when the answer is cached the body must not be left for the next request of the connection
+			Json::Value  jmessage;
 			long long tlen = req_info->content_length;
 			if (tlen > 0)
 			{
@@ -51,7 +94,7 @@ class RequestHandler : public CivetHandler
 
 					nlen += rlen;
 				}
-				std::cout << "body:" << body << std::endl;
+				STREAMER_LOG_VERBOSE << "body:" << body;
 
 				// parse in
 				Json::Reader reader;
@@ -61,25 +104,42 @@ class RequestHandler : public CivetHandler
 				}
 			}
 
-			// invoke API implementation
-			Json::Value out(fct(req_info, jmessage));
-
-			// fill out
-			if (out.isNull() == false)
+			// the answers that did not change are not rebuilt
+			std::string version;
+			std::shared_ptr<const std::string> answer;
+			bool cacheable = httpServer->getCachedAnswer(req_info->request_uri, req_info, version, answer);
+			if (!answer)
 			{
-				std::string answer(Json::StyledWriter().write(out));
-				std::cout << "answer:" << answer << std::endl;
+				// invoke API implementation
+				Json::Value out(fct(req_info, jmessage));
 
-				mg_printf(conn,"HTTP/1.1 200 OK\r\n");
-				mg_printf(conn,"Access-Control-Allow-Origin: *\r\n");
-				mg_printf(conn,"Content-Type: application/json\r\n");
-				mg_printf(conn,"Content-Length: %zd\r\n", answer.size());
-				mg_printf(conn,"Connection: close\r\n");
-				mg_printf(conn,"\r\n");
-				mg_printf(conn,answer.c_str());
+				// fill out
+				if ( (out.isObject()) && (out.isMember("retryAfter")) )
+				{
+					// rejected by the admission control
+					std::string retryAfter("Retry-After: " + std::to_string(out["retryAfter"].asInt()) + "\r\n");
+					writeResponse(server, conn, "503 Service Unavailable", "application/json", "Access-Control-Allow-Origin: *\r\n" + retryAfter, Json::FastWriter().write(out));
+
+					ret = true;
+				}
+				else if (out.isNull() == false)
+				{
+					answer = std::make_shared<const std::string>(Json::FastWriter().write(out));
+					if (cacheable)
+					{
+						httpServer->setCachedAnswer(req_info->request_uri, version, answer);
+					}
+				}
+			}
+
+			if (answer)
+			{
+				STREAMER_LOG_VERBOSE << "answer:" << *answer;
+				writeResponse(server, conn, "200 OK", "application/json", "Access-Control-Allow-Origin: *\r\n", *answer);
 
 				ret = true;
 			}
+			httpServer->getMetrics().requestDone();
 		}
 
 		return ret;
@@ -95,6 +155,251 @@ class RequestHandler : public CivetHandler
 };
 
 
+/* ---------------------------------------------------------------------------
+**  Civet HTTP callback of the Prometheus scrape, answered from the counters
+**  and the last snapshot without waiting for the signaling thread
+** -------------------------------------------------------------------------*/
+class MetricsHandler : public CivetHandler
+{
+  public:
+	MetricsHandler(PeerConnectionManager* webRtcServer) : m_webRtcServer(webRtcServer) {}
+
+	bool handleGet(CivetServer *server, struct mg_connection *conn)
+	{
+		writeResponse(server, conn, "200 OK", "text/plain; version=0.0.4", "", m_webRtcServer->renderMetrics());
+		return true;
+	}
+
+  protected:
+	PeerConnectionManager*                                        m_webRtcServer;
+};
+
+/* ---------------------------------------------------------------------------
+**  Civet WebSocket callback : offer/answer, candidates and hangup on one
+**  connection, the candidates of the server are pushed when gathered
+**
+**  The messages are queued in the outbox of the connection and written by a
+**  sender thread, a slow client does not block the thread that gathers the
+**  candidates.
+** -------------------------------------------------------------------------*/
+class SignalingWebSocketHandler : public CivetWebSocketHandler
+{
+  public:
+	SignalingWebSocketHandler(PeerConnectionManager* webRtcServer) : m_webRtcServer(webRtcServer), m_running(true) {
+		m_sender = std::thread(&SignalingWebSocketHandler::run, this);
+	}
+	virtual ~SignalingWebSocketHandler() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_running = false;
+		}
+		m_pending.notify_one();
+		m_sender.join();
+	}
+
+	virtual bool handleConnection(CivetServer *server, const struct mg_connection *conn)
+	{
+		return true;
+	}
+
+	virtual void handleReadyState(CivetServer *server, struct mg_connection *conn)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_outboxes[conn] = std::make_shared<Outbox>(conn);
+	}
+
+	virtual bool handleData(CivetServer *server, struct mg_connection *conn, int bits, char *data, size_t data_len)
+	{
+		if ((bits & 0x0f) == MG_WEBSOCKET_OPCODE_CONNECTION_CLOSE)
+		{
+			return false;
+		}
+		if ((bits & 0x0f) != MG_WEBSOCKET_OPCODE_TEXT)
+		{
+			return true;
+		}
+
+		Json::Value in;
+		Json::Reader reader;
+		if (!reader.parse(std::string(data, data_len), in))
+		{
+			RTC_LOG(WARNING) << "Received unknown websocket message:" << std::string(data, data_len);
+			return true;
+		}
+
+		std::shared_ptr<Outbox> outbox;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::map<const struct mg_connection*, std::shared_ptr<Outbox>>::iterator it = m_outboxes.find(conn);
+			if (it != m_outboxes.end())
+			{
+				outbox = it->second;
+			}
+		}
+		if (!outbox)
+		{
+			return false;
+		}
+
+		std::string type = in.get("type", "").asString();
+		std::string peerid = in.get("peerid", "").asString();
+		const struct mg_request_info *req_info = mg_get_request_info(conn);
+		if ( (type == "call") || (type == "connect") )
+		{
+			int64_t startUs = rtc::TimeMicros();
+			Json::Value answer = m_webRtcServer->call(peerid, in.get("url", "").asString(), in.get("audiourl", "").asString(), in.get("options", "").asString(), in["sdp"], req_info->remote_addr);
+			m_webRtcServer->getMetrics().signaling(rtc::TimeMicros() - startUs);
+			Json::Value out;
+			out["type"] = "answer";
+			out["peerid"] = peerid;
+			out["sdp"] = answer;
+			if (type == "connect")
+			{
+				out["iceServers"] = m_webRtcServer->getIceServers(req_info->remote_addr)["iceServers"];
+			}
+			// queued before the candidates
+			this->send(outbox, out);
+
+			// candidates pushed until the hangup, the outbox is not used once the connection is closed
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				outbox->peers.insert(peerid);
+			}
+			std::weak_ptr<Outbox> weakOutbox(outbox);
+			m_webRtcServer->setIceCandidateListener(peerid, [this, weakOutbox, peerid](const Json::Value & candidate) {
+				Json::Value out;
+				out["type"] = "candidate";
+				out["peerid"] = peerid;
+				out["candidate"] = candidate;
+				this->send(weakOutbox.lock(), out);
+			});
+		}
+		else if (type == "candidate")
+		{
+			m_webRtcServer->addIceCandidate(peerid, in["candidate"]);
+		}
+		else if (type == "hangup")
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				outbox->peers.erase(peerid);
+			}
+			m_webRtcServer->setIceCandidateListener(peerid, nullptr);
+			m_webRtcServer->hangUp(peerid);
+		}
+		else
+		{
+			RTC_LOG(WARNING) << "Received unknown websocket message type:" << type;
+		}
+		return true;
+	}
+
+	virtual void handleClose(CivetServer *server, const struct mg_connection *conn)
+	{
+		// no more push on this connection, its calls are closed
+		std::shared_ptr<Outbox> outbox;
+		std::set<std::string> peers;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::map<const struct mg_connection*, std::shared_ptr<Outbox>>::iterator it = m_outboxes.find(conn);
+			if (it != m_outboxes.end())
+			{
+				outbox = it->second;
+				peers = outbox->peers;
+				outbox->messages.clear();
+				m_outboxes.erase(it);
+			}
+		}
+		if (outbox)
+		{
+			// wait for a write in progress, the sender skips a closed outbox
+			std::lock_guard<std::mutex> lock(outbox->writeMutex);
+			outbox->closed = true;
+		}
+		for (const std::string & peerid : peers)
+		{
+			m_webRtcServer->setIceCandidateListener(peerid, nullptr);
+			m_webRtcServer->hangUp(peerid);
+		}
+	}
+
+  protected:
+	struct Outbox {
+		Outbox(struct mg_connection* conn) : conn(conn), closed(false) {}
+		struct mg_connection*    conn;
+		std::mutex               writeMutex;   // held while writing, closed is set under it
+		bool                     closed;
+		std::deque<std::string>  messages;     // protected by m_mutex as the peers
+		std::set<std::string>    peers;
+	};
+
+	void send(std::shared_ptr<Outbox> outbox, const Json::Value & out)
+	{
+		if (outbox)
+		{
+			std::string message(Json::FastWriter().write(out));
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				std::map<const struct mg_connection*, std::shared_ptr<Outbox>>::iterator it = m_outboxes.find(outbox->conn);
+				if ( (it == m_outboxes.end()) || (it->second != outbox) )
+				{
+					return;
+				}
+				outbox->messages.push_back(message);
+			}
+			m_pending.notify_one();
+		}
+	}
+
+	// write the queued messages of all the connections
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_running)
+		{
+			std::list<std::pair<std::shared_ptr<Outbox>, std::deque<std::string>>> pending;
+			for (auto & it : m_outboxes)
+			{
+				if (!it.second->messages.empty())
+				{
+					pending.push_back(std::make_pair(it.second, std::deque<std::string>()));
+					pending.back().second.swap(it.second->messages);
+				}
+			}
+			if (pending.empty())
+			{
+				m_pending.wait(lock);
+				continue;
+			}
+
+			lock.unlock();
+			for (auto & it : pending)
+			{
+				std::lock_guard<std::mutex> writeLock(it.first->writeMutex);
+				for (const std::string & message : it.second)
+				{
+					if (it.first->closed)
+					{
+						break;
+					}
+					mg_lock_connection(it.first->conn);
+					mg_websocket_write(it.first->conn, MG_WEBSOCKET_OPCODE_TEXT, message.c_str(), message.size());
+					mg_unlock_connection(it.first->conn);
+				}
+			}
+			lock.lock();
+		}
+	}
+
+  protected:
+	PeerConnectionManager*                                                  m_webRtcServer;
+	std::mutex                                                              m_mutex;
+	std::condition_variable                                                 m_pending;
+	bool                                                                    m_running;
+	std::map<const struct mg_connection*, std::shared_ptr<Outbox>>          m_outboxes;
+	std::thread                                                             m_sender;
+};
+
 int log_message(const struct mg_connection *conn, const char *message) 
 {
 	fprintf(stderr, "%s\n", message);
@@ -143,7 +448,21 @@ HttpServerRequestHandler::HttpServerRequestHandler(PeerConnectionManager* webRtc
             CivetServer::getParam(req_info->query_string, "audiourl", audiourl);
             CivetServer::getParam(req_info->query_string, "options", options);
         }
-		return m_webRtcServer->call(peerid, url, audiourl, options, in);
+		return m_webRtcServer->call(peerid, url, audiourl, options, in, req_info->remote_addr);
+	};
+
+	m_func["/connect"]               = [this](const struct mg_request_info *req_info, const Json::Value & in) -> Json::Value {
+		std::string peerid;
+		std::string url;
+		std::string audiourl;
+		std::string options;
+		if (req_info->query_string) {
+            CivetServer::getParam(req_info->query_string, "peerid", peerid);
+            CivetServer::getParam(req_info->query_string, "url", url);
+            CivetServer::getParam(req_info->query_string, "audiourl", audiourl);
+            CivetServer::getParam(req_info->query_string, "options", options);
+        }
+		return m_webRtcServer->connect(peerid, url, audiourl, options, in, req_info->remote_addr);
 	};
 
 	m_func["/hangup"]                = [this](const struct mg_request_info *req_info, const Json::Value & in) -> Json::Value {
@@ -151,7 +470,6 @@ HttpServerRequestHandler::HttpServerRequestHandler(PeerConnectionManager* webRtc
 		if (req_info->query_string) {
             CivetServer::getParam(req_info->query_string, "peerid", peerid);
         }
-        RTC_LOG(LS_ERROR) << "herehere12";
 		return m_webRtcServer->hangUp(peerid);
 	};
 
@@ -166,7 +484,7 @@ HttpServerRequestHandler::HttpServerRequestHandler(PeerConnectionManager* webRtc
             CivetServer::getParam(req_info->query_string, "audiourl", audiourl);
             CivetServer::getParam(req_info->query_string, "options", options);
         }
-		return m_webRtcServer->createOffer(peerid, url, audiourl, options);
+		return m_webRtcServer->createOffer(peerid, url, audiourl, options, req_info->remote_addr);
 	};
 	m_func["/setAnswer"]             = [this](const struct mg_request_info *req_info, const Json::Value & in) -> Json::Value {
 		std::string peerid;
@@ -195,11 +513,44 @@ HttpServerRequestHandler::HttpServerRequestHandler(PeerConnectionManager* webRtc
 	};
 
 	m_func["/getPeerConnectionList"] = [this](const struct mg_request_info *req_info, const Json::Value & in) -> Json::Value {
-		return m_webRtcServer->getPeerConnectionList();
+		std::string peerid;
+		std::string stream;
+		std::string field;
+		std::string last;
+		if (req_info->query_string) {
+			CivetServer::getParam(req_info->query_string, "peerid", peerid);
+			CivetServer::getParam(req_info->query_string, "stream", stream);
+			CivetServer::getParam(req_info->query_string, "field", field);
+			CivetServer::getParam(req_info->query_string, "last", last);
+		}
+		// the last sample by default
+		return m_webRtcServer->getPeerConnectionList(peerid, stream, field, last.empty() ? 1 : std::max(atoi(last.c_str()), 0));
 	};
 
 	m_func["/getStreamList"] = [this](const struct mg_request_info *req_info, const Json::Value & in) -> Json::Value {
-		return m_webRtcServer->getStreamList();
+		std::string details;
+		if (req_info->query_string) {
+			CivetServer::getParam(req_info->query_string, "details", details);
+		}
+		return m_webRtcServer->getStreamList(details == "1");
+	};
+
+	m_func["/getLatency"]            = [this](const struct mg_request_info *req_info, const Json::Value & in) -> Json::Value {
+		std::string stream;
+		if (req_info->query_string) {
+			CivetServer::getParam(req_info->query_string, "stream", stream);
+		}
+		return m_webRtcServer->getLatency(stream);
+	};
+
+	m_func["/trace"]                 = [](const struct mg_request_info *req_info, const Json::Value & in) -> Json::Value {
+		std::string seconds;
+		if (req_info->query_string) {
+			CivetServer::getParam(req_info->query_string, "seconds", seconds);
+		}
+		// the capture holds a worker thread, its duration is bounded
+		int duration = seconds.empty() ? 5 : std::min(std::max(atoi(seconds.c_str()), 1), 60);
+		return TraceCapture::capture(duration*1000);
 	};
 
 	m_func["/help"]                  = [this](const struct mg_request_info *req_info, const Json::Value & in) -> Json::Value {
@@ -220,17 +571,62 @@ HttpServerRequestHandler::HttpServerRequestHandler(PeerConnectionManager* webRtc
 		if (req_info->query_string) {
 			CivetServer::getParam(req_info->query_string, "level", loglevel);
 			if (!loglevel.empty()) {
-				rtc::LogMessage::LogToDebug((rtc::LoggingSeverity)atoi(loglevel.c_str()));
+				if (AsyncLogSink::instance()) {
+					AsyncLogSink::instance()->setSeverity((rtc::LoggingSeverity)atoi(loglevel.c_str()));
+				} else {
+					rtc::LogMessage::LogToDebug((rtc::LoggingSeverity)atoi(loglevel.c_str()));
+				}
 			}
 		}
-		Json::Value answer(rtc::LogMessage::GetLogToDebug());
+		Json::Value answer(AsyncLogSink::instance() ? AsyncLogSink::instance()->severity() : rtc::LogMessage::GetLogToDebug());
 		return answer;
 	};
 
+	// time to handle the signaling requests
+	for (const char* uri : { "/call", "/connect", "/createOffer", "/setAnswer" }) {
+		httpFunction fct = m_func[uri];
+		m_func[uri] = [this, fct](const struct mg_request_info *req_info, const Json::Value & in) -> Json::Value {
+			int64_t startUs = rtc::TimeMicros();
+			Json::Value answer(fct(req_info, in));
+			m_webRtcServer->getMetrics().signaling(rtc::TimeMicros() - startUs);
+			return answer;
+		};
+	}
+
+	// answers kept while their version does not change, /help and /version never change
+	m_version["/getMediaList"]       = [this](const struct mg_request_info *req_info) -> std::string {
+		return std::to_string(m_webRtcServer->getMediaListVersion());
+	};
+
+	m_version["/getStreamList"]      = [this](const struct mg_request_info *req_info) -> std::string {
+		// the list is kept while the streams and viewers do not change, its details hold live measures of the snapshot
+		std::string details;
+		if (req_info->query_string) {
+			CivetServer::getParam(req_info->query_string, "details", details);
+		}
+		std::string version = std::to_string(m_webRtcServer->getStreamListVersion());
+		if (details == "1") {
+			version += ".details." + std::to_string(m_webRtcServer->getSnapshotVersion());
+		}
+		return version;
+	};
+
+	m_version["/getIceServers"]      = [this](const struct mg_request_info *req_info) -> std::string {
+		return m_webRtcServer->getIceServersVersion(req_info->remote_addr);
+	};
+
+	m_version["/help"]               = [](const struct mg_request_info *req_info) -> std::string {
+		return std::string();
+	};
+
+	m_version["/version"]            = m_version["/help"];
+
 	// register handlers
 	for (auto it : m_func) {
 		this->addHandler(it.first, new RequestHandler());
 	}
+	this->addHandler("/metrics", new MetricsHandler(m_webRtcServer));
+	this->addWebSocketHandler("/ws", new SignalingWebSocketHandler(m_webRtcServer));
 }
 
 httpFunction HttpServerRequestHandler::getFunction(const std::string& uri)
@@ -245,3 +641,33 @@ httpFunction HttpServerRequestHandler::getFunction(const std::string& uri)
 	return fct;
 }
 
+bool HttpServerRequestHandler::getCachedAnswer(const std::string& uri, const struct mg_request_info *req_info, std::string & version, std::shared_ptr<const std::string> & answer)
+{
+	std::map<std::string,httpVersion>::iterator it = m_version.find(uri);
+	if (it == m_version.end())
+	{
+		return false;
+	}
+	version = it->second(req_info);
+
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	std::map<std::string,std::shared_ptr<const std::string>> & answers = m_cache[uri];
+	std::map<std::string,std::shared_ptr<const std::string>>::iterator cached = answers.find(version);
+	if (cached != answers.end())
+	{
+		answer = cached->second;
+	}
+	return true;
+}
+
+void HttpServerRequestHandler::setCachedAnswer(const std::string& uri, const std::string & version, std::shared_ptr<const std::string> answer)
+{
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	std::map<std::string,std::shared_ptr<const std::string>> & answers = m_cache[uri];
+	// the old versions are dropped when a uri has too many of them
+	if ( (answers.size() >= kMaxCachedVersions) && (answers.find(version) == answers.end()) )
+	{
+		answers.clear();
+	}
+	answers[version] = answer;
+}
@@ -9,14 +9,23 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <utility>
 #include <vector>
+#include <algorithm>
+#include <functional>
+#include <sys/stat.h>
 
 #include "api/audio_codecs/builtin_audio_encoder_factory.h"
 #include "api/audio_codecs/builtin_audio_decoder_factory.h"
 #include "modules/video_capture/video_capture_factory.h"
 #include "media/engine/webrtcvideocapturerfactory.h"
 
+#include "rtc_base/timeutils.h"
+#include "rtc_base/trace_event.h"
+#include "media/engine/internalencoderfactory.h"
+#include "media/engine/internaldecoderfactory.h"
+
 #include "modules/audio_device/include/fake_audio_device.h"
 
 #include "test/fake_audio_device.h"
@@ -29,8 +38,13 @@
 #endif
 
 #include "zmqframereader.h"
+#include "sharedvideoencoder.h"
+#include "videotiers.h"
+#include "tracecapture.h"
+#include "asynclog.h"
 
 const char kVideoLabel[] = "video_label";
+const char kAudioLabel[] = "audio_label";
 
 // Names used for a IceCandidate JSON object.
 const char kCandidateSdpMidName[] = "sdpMid";
@@ -46,28 +60,246 @@ const char kStunURLTypeName[] = "stunurl";
 const char kTurnURLTypeName[] = "turnurl";
 
 /* ---------------------------------------------------------------------------
-**  Constructor
+**  FactoryShard : a PeerConnectionFactory with its own threads
 ** -------------------------------------------------------------------------*/
-PeerConnectionManager::PeerConnectionManager(
-	const std::string & stunurl,
-	const std::string & turnurl,
-	const webrtc::AudioDeviceModule::AudioLayer audioLayer
-	): audioDeviceModule_(webrtc::FakeAudioDeviceModule::Create(0, audioLayer)),
-	audioDecoderfactory_(webrtc::CreateBuiltinAudioDecoderFactory()),
-	peer_connection_factory_(
-		webrtc::CreatePeerConnectionFactory(
-			NULL,
-            rtc::Thread::Current(),
-            NULL,
-            audioDeviceModule_,
-            webrtc::CreateBuiltinAudioEncoderFactory(),
-            audioDecoderfactory_,
+PeerConnectionManager::FactoryShard::FactoryShard(
+	int index,
+	const webrtc::AudioDeviceModule::AudioLayer audioLayer,
+	rtc::scoped_refptr<webrtc::AudioEncoderFactory> audioEncoderfactory,
+	rtc::scoped_refptr<webrtc::AudioDecoderFactory> audioDecoderfactory,
+	bool sharedVideoEncoders,
+	bool gcmCiphers,
+	Metrics* metrics
+	): m_index(index),
+	m_networkThread(rtc::Thread::CreateWithSocketServer()),
+	m_workerThread(rtc::Thread::Create()),
+	m_signalingThread(rtc::Thread::Create()),
+	m_audioDeviceModule(webrtc::FakeAudioDeviceModule::Create(0, audioLayer))
+{
+	m_networkThread->SetName("network-" + std::to_string(index), NULL);
+	m_networkThread->Start();
+	m_workerThread->SetName("worker-" + std::to_string(index), NULL);
+	m_workerThread->Start();
+	m_signalingThread->SetName("signaling-" + std::to_string(index), NULL);
+	m_signalingThread->Start();
+
+	m_factory = webrtc::CreatePeerConnectionFactory(
+            m_networkThread.get(),
+            m_workerThread.get(),
+            m_signalingThread.get(),
+            m_audioDeviceModule,
+            audioEncoderfactory,
+            audioDecoderfactory,
+            std::unique_ptr<webrtc::VideoEncoderFactory>(new SharedVideoEncoderFactory(std::unique_ptr<webrtc::VideoEncoderFactory>(new webrtc::InternalEncoderFactory()), sharedVideoEncoders, &metrics->encodeLatency(), &metrics->packetizeLatency())),
+            std::unique_ptr<webrtc::VideoDecoderFactory>(new webrtc::InternalDecoderFactory()),
             NULL,
             NULL
-        )
-	), stunurl_(stunurl),
-	turnurl_(turnurl)
+        );
+
+	// enumerated once for all the peers, used on the network thread
+	m_networkThread->Invoke<void>(RTC_FROM_HERE, [this]() {
+		m_networkManager.reset(new rtc::BasicNetworkManager());
+		m_socketFactory.reset(new rtc::BasicPacketSocketFactory(m_networkThread.get()));
+	});
+
+	// the audio comes from the sources, not from the audio device
+	if (m_factory)
+	{
+		m_workerThread->Invoke<void>(RTC_FROM_HERE, [this]() {
+			m_audioDeviceModule->Terminate();
+		});
+	}
+
+	// AES-GCM SRTP can use the AES instructions of the CPU
+	if ( (m_factory) && (gcmCiphers) )
+	{
+		webrtc::PeerConnectionFactoryInterface::Options options;
+		options.crypto_options.enable_gcm_cipher_suites = true;
+		m_factory->SetOptions(options);
+	}
+}
+
+PeerConnectionManager::FactoryShard::~FactoryShard()
+{
+	// release the factory before stopping its threads
+	m_streams.clear();
+	m_factory = NULL;
+	m_audioDeviceModule = NULL;
+	m_networkThread->Invoke<void>(RTC_FROM_HERE, [this]() {
+		m_socketFactory.reset();
+		m_networkManager.reset();
+	});
+}
+
+std::unique_ptr<cricket::BasicPortAllocator> PeerConnectionManager::FactoryShard::createPortAllocator(int minPort, int maxPort)
+{
+	std::unique_ptr<cricket::BasicPortAllocator> allocator(new cricket::BasicPortAllocator(m_networkManager.get(), m_socketFactory.get()));
+	if ( (minPort > 0) && (maxPort >= minPort) )
+	{
+		allocator->SetPortRange(minPort, maxPort);
+	}
+	return allocator;
+}
+
+void PeerConnectionManager::FactoryShard::acquireStream(const std::string & streamLabel)
+{
+	std::map<std::string, StreamEntry>::iterator it = m_streams.find(streamLabel);
+	if (it != m_streams.end())
+	{
+		it->second.viewers++;
+		if (it->second.paused)
+		{
+			// warm stream, restart decoding
+			RTC_LOG(INFO) << "Resume stream " << streamLabel;
+			this->setPaused(it->second, false);
+			it->second.idleSinceMs = 0;
+		}
+	}
+}
+
+bool PeerConnectionManager::FactoryShard::releaseStream(const std::string & streamLabel)
+{
+	bool closed = false;
+	std::map<std::string, StreamEntry>::iterator it = m_streams.find(streamLabel);
+	if ( (it != m_streams.end()) && (--it->second.viewers <= 0) )
+	{
+		if (it->second.warm)
+		{
+			// always warm, keep the connection to the source without decoding
+			RTC_LOG(INFO) << "Pause warm stream " << streamLabel;
+			this->setPaused(it->second, true);
+		}
+		else if (it->second.lingerMs > 0)
+		{
+			// keep the connection to the source without decoding
+			RTC_LOG(INFO) << "Pause stream no more used " << streamLabel << " linger:" << it->second.lingerMs;
+			this->setPaused(it->second, true);
+			it->second.idleSinceMs = rtc::TimeMillis();
+		}
+		else
+		{
+			this->closeStream(streamLabel);
+			closed = true;
+		}
+	}
+	return closed;
+}
+
+void PeerConnectionManager::FactoryShard::setWarm(const std::string & streamLabel, bool warm)
+{
+	std::map<std::string, StreamEntry>::iterator it = m_streams.find(streamLabel);
+	if (it != m_streams.end())
+	{
+		it->second.warm = warm;
+		if (it->second.viewers <= 0)
+		{
+			if (warm)
+			{
+				// ingest without viewer, decoding starts with the first one
+				this->setPaused(it->second, true);
+				it->second.idleSinceMs = 0;
+			}
+			else if (it->second.idleSinceMs == 0)
+			{
+				// closed after its linger like a stream left by its last viewer
+				it->second.idleSinceMs = rtc::TimeMillis();
+			}
+		}
+	}
+}
+
+void PeerConnectionManager::FactoryShard::setPaused(StreamEntry & entry, bool paused)
+{
+	for (PausableSource* source : entry.sources)
+	{
+		source->setPaused(paused);
+	}
+	entry.paused = paused;
+}
+
+void PeerConnectionManager::FactoryShard::closeStream(const std::string & streamLabel)
+{
+	std::map<std::string, StreamEntry>::iterator it = m_streams.find(streamLabel);
+	if (it != m_streams.end())
+	{
+		RTC_LOG(INFO) << "Close stream no more used " << streamLabel;
+		rtc::scoped_refptr<webrtc::MediaStreamInterface> stream = it->second.stream;
+
+		// remove video tracks
+		while (stream->GetVideoTracks().size() > 0)
+		{
+			stream->RemoveTrack(stream->GetVideoTracks().at(0));
+		}
+		// remove audio tracks
+		while (stream->GetAudioTracks().size() > 0)
+		{
+			stream->RemoveTrack(stream->GetAudioTracks().at(0));
+		}
+
+		// release the capturer with the last reference
+		m_streams.erase(it);
+	}
+}
+
+/* ---------------------------------------------------------------------------
+**  Constructor
+** -------------------------------------------------------------------------*/
+PeerConnectionManager::PeerConnectionManager(const Options & options)
+	: audioDecoderfactory_(webrtc::CreateBuiltinAudioDecoderFactory()),
+	audioEncoderfactory_(PassthroughAudioEncoderFactory::Create(webrtc::CreateBuiltinAudioEncoderFactory())),
+	shardByStream_(options.shardPolicy != "roundrobin"),
+	nextShard_(0),
+	stunurl_(options.stunurl),
+	turnurl_(options.turnurl),
+	signalingTimeoutMs_(options.signalingTimeoutMs),
+	lingerMs_(options.lingerMs),
+	warmPoolSize_(std::max(options.warmPoolSize, 0)),
+	urlList_(options.urlList),
+	configFile_(options.configFile),
+	configTime_(0),
+	mediaList_(new MediaList()),
+	iceCandidatePoolSize_(options.iceCandidatePoolSize),
+	minPort_(options.minPort),
+	maxPort_(options.maxPort),
+	sharedVideoEncoders_(options.sharedVideoEncoders),
+	admission_(new AdmissionController(options.admissionLimits)),
+	peerCount_(0),
+	lastEgressMs_(0),
+	statsIntervalMs_(options.statsIntervalMs),
+	statsTickMs_( (options.statsIntervalMs > 0) ? std::min(options.statsIntervalMs, (int)kSnapshotPeriodMs) : kSnapshotPeriodMs ),
+	lastHistoryMs_(0),
+	statsDepth_(std::max(options.statsDepth, 1)),
+	signalingThread_(rtc::Thread::Current()),
+	snapshot_(new Snapshot())
 {
+	// each shard has its own signaling, worker and network threads
+	for (int i = 0; i < std::max(options.nbFactoryShards, 1); ++i)
+	{
+		shards_.push_back(std::unique_ptr<FactoryShard>(new FactoryShard(i, options.audioLayer, audioEncoderfactory_, audioDecoderfactory_, options.sharedVideoEncoders, options.gcmCiphers, &metrics_)));
+	}
+
+	// DTLS certificates generated before the peers need them
+	if (options.nbCertificates > 0)
+	{
+		certificatePool_.reset(new CertificatePool(options.nbCertificates, kCertificateRotationMs));
+	}
+	RTC_LOG(INFO) << "DTLS certificates:" << options.nbCertificates << " AES-GCM:" << options.gcmCiphers;
+	RTC_LOG(INFO) << "ICE candidate pool:" << iceCandidatePoolSize_ << " UDP ports:" << minPort_ << "-" << maxPort_;
+	RTC_LOG(INFO) << "PeerConnectionFactory shards:" << shards_.size() << " policy:" << (shardByStream_ ? "stream" : "roundrobin") << " shared video encoders:" << options.sharedVideoEncoders;
+	RTC_LOG(INFO) << "Stream linger:" << lingerMs_ << "ms warm pool:" << warmPoolSize_;
+
+	// the uplink is divided between the peers by the priority of their stream
+	if (options.egressBudgetKbps > 0)
+	{
+		egressManager_.reset(new EgressBandwidthManager(options.egressBudgetKbps));
+	}
+	RTC_LOG(INFO) << "Egress budget:" << options.egressBudgetKbps << "kbps";
+	RTC_LOG(INFO) << "Stats interval:" << statsIntervalMs_ << "ms history:" << statsDepth_;
+
+#ifdef HAVE_LIVE555
+	rtspSessionManager_.reset(new RTSPSessionManager(options.nbRtspSchedulers, options.maxRtspReconnects, options.minRtspReconnectDelayMs, options.maxRtspReconnectDelayMs));
+#endif
+
 	if (turnurl_.length() > 0)
 	{
 		std::size_t pos = turnurl_.find('@');
@@ -94,6 +326,7 @@ PeerConnectionManager::PeerConnectionManager(
 ** -------------------------------------------------------------------------*/
 PeerConnectionManager::~PeerConnectionManager()
 {
+	signalingThread_->Clear(this);
 }
 
 
@@ -102,9 +335,208 @@ PeerConnectionManager::~PeerConnectionManager()
 ** -------------------------------------------------------------------------*/
 const Json::Value PeerConnectionManager::getMediaList()
 {
-	Json::Value value(Json::arrayValue);
+	// precomputed when the streams are declared
+	return std::atomic_load(&mediaList_)->json;
+}
 
-	return value;
+/* ---------------------------------------------------------------------------
+**  check the types of the config file, the reason of the first error if any
+** -------------------------------------------------------------------------*/
+static std::string checkConfig(const Json::Value & config)
+{
+	if (!config.isObject())
+	{
+		return "config is not an object";
+	}
+	const Json::Value & urls = config["urls"];
+	if ( (!urls.isNull()) && (!urls.isObject()) )
+	{
+		return "urls is not an object";
+	}
+	for (const std::string & name : urls.getMemberNames())
+	{
+		const Json::Value & item = urls[name];
+		if (!item.isObject())
+		{
+			return "urls." + name + " is not an object";
+		}
+		for (const char* key : { "video", "audio", "options" })
+		{
+			if ( (item.isMember(key)) && (!item[key].isString()) )
+			{
+				return "urls." + name + "." + key + " is not a string";
+			}
+		}
+		if ( (item.isMember("warm")) && (!item["warm"].isConvertibleTo(Json::booleanValue)) )
+		{
+			return "urls." + name + ".warm is not a boolean";
+		}
+		for (const char* key : { "fps", "height", "bitrate", "tiers", "linger", "priority" })
+		{
+			if ( (item.isMember(key)) && (!item[key].isString()) && (!item[key].isConvertibleTo(Json::intValue)) )
+			{
+				return "urls." + name + "." + key + " is not an integer";
+			}
+		}
+	}
+	return "";
+}
+
+/* ---------------------------------------------------------------------------
+**  load the streams declared on the command line and in the config file,
+**  start the warm ones (signaling thread)
+** -------------------------------------------------------------------------*/
+void PeerConnectionManager::loadMediaList()
+{
+	std::shared_ptr<MediaList> mediaList(new MediaList());
+
+	for (auto & it : urlList_)
+	{
+		MediaSettings & settings = mediaList->media[it.first];
+		settings.videourl = it.second;
+		settings.warm = false;
+	}
+
+	if (!configFile_.empty())
+	{
+		// the file is read again until it parses, it can be in the middle of a write
+		struct stat fileStat;
+		time_t configTime = configTime_;
+		if (stat(configFile_.c_str(), &fileStat) == 0)
+		{
+			configTime = fileStat.st_mtime;
+		}
+
+		std::ifstream is(configFile_);
+		Json::Value config;
+		Json::Reader reader;
+		std::string error;
+		if (!reader.parse(is, config))
+		{
+			error = reader.getFormattedErrorMessages();
+		}
+		else
+		{
+			error = checkConfig(config);
+		}
+		if (!error.empty())
+		{
+			STREAMER_LOG_EVERY_MS(LS_ERROR, 10000) << "Cannot load config file:" << configFile_ << " " << error;
+			if (!std::atomic_load(&mediaList_)->media.empty())
+			{
+				// keep the streams of the last valid config
+				return;
+			}
+		}
+		else
+		{
+			configTime_ = configTime;
+			const Json::Value & urls = config["urls"];
+			for (const std::string & name : urls.getMemberNames())
+			{
+				const Json::Value & item = urls[name];
+				MediaSettings & settings = mediaList->media[name];
+				settings.videourl = item.get("video", "").asString();
+				settings.audiourl = item.get("audio", "").asString();
+				settings.options = item.get("options", "").asString();
+				settings.warm = item.get("warm", false).asBool();
+
+				// the settings of the stream are options of AddStream
+				for (const char* key : { "fps", "height", "bitrate", "tiers", "linger", "priority" })
+				{
+					if (item.isMember(key))
+					{
+						const Json::Value & value = item[key];
+						settings.options += settings.options.empty() ? "" : "&";
+						settings.options += std::string(key) + "=" + (value.isString() ? value.asString() : std::to_string(value.asInt()));
+					}
+				}
+			}
+		}
+	}
+
+	// answer of getMediaList
+	mediaList->json = Json::Value(Json::arrayValue);
+	for (auto & it : mediaList->media)
+	{
+		Json::Value media;
+		media["video"] = it.first;
+		if (!it.second.audiourl.empty())
+		{
+			media["audio"] = it.first;
+		}
+		mediaList->json.append(media);
+	}
+
+	// streams no more warm are closed after their linger
+	std::shared_ptr<const MediaList> previous = std::atomic_load(&mediaList_);
+	for (auto & it : previous->media)
+	{
+		std::map<std::string, MediaSettings>::iterator current = mediaList->media.find(it.first);
+		bool stillWarm = (current != mediaList->media.end()) && (current->second.warm)
+			&& (current->second.videourl == it.second.videourl) && (current->second.audiourl == it.second.audiourl);
+		if ( (it.second.warm) && (!stillWarm) )
+		{
+			for (auto & shard : shards_)
+			{
+				shard->setWarm(getStreamLabel(it.second.videourl, it.second.audiourl), false);
+			}
+		}
+	}
+
+	// warm streams ingest before their first viewer
+	for (auto & it : mediaList->media)
+	{
+		if (it.second.warm)
+		{
+			std::string streamLabel = getStreamLabel(it.second.videourl, it.second.audiourl);
+			FactoryShard* shard = NULL;
+			for (auto & candidate : shards_)
+			{
+				if (candidate->streams().find(streamLabel) != candidate->streams().end())
+				{
+					shard = candidate.get();
+				}
+			}
+			if (shard == NULL)
+			{
+				shard = this->selectShard(streamLabel);
+				if (!this->createStream(shard, streamLabel, it.second.videourl, it.second.audiourl, it.second.options))
+				{
+					RTC_LOG(LS_ERROR) << "Cannot start warm stream:" << it.first;
+				}
+			}
+			shard->setWarm(streamLabel, true);
+		}
+	}
+
+	RTC_LOG(INFO) << "Media list:" << mediaList->media.size();
+	mediaList->version = previous->version + 1;
+	std::atomic_store(&mediaList_, std::shared_ptr<const MediaList>(mediaList));
+}
+
+/* ---------------------------------------------------------------------------
+**  replace the name of a declared stream with its urls and options
+** -------------------------------------------------------------------------*/
+void PeerConnectionManager::resolveMedia(std::string & videourl, std::string & audiourl, std::string & options)
+{
+	std::shared_ptr<const MediaList> mediaList = std::atomic_load(&mediaList_);
+	std::map<std::string, MediaSettings>::const_iterator it = mediaList->media.find(videourl);
+	if (it != mediaList->media.end())
+	{
+		if ( (audiourl.empty()) || (audiourl == videourl) )
+		{
+			audiourl = it->second.audiourl;
+		}
+		videourl = it->second.videourl;
+
+		// options of the request first, they override the declared ones
+		if (!it->second.options.empty())
+		{
+			options += options.empty() ? "" : "&";
+			options += it->second.options;
+		}
+	}
 }
 
 /* ---------------------------------------------------------------------------
@@ -142,7 +574,8 @@ const Json::Value PeerConnectionManager::getAudioDeviceList()
 {
 	Json::Value value(Json::arrayValue);
 
-	int16_t num_audioDevices = audioDeviceModule_->RecordingDevices();
+	rtc::scoped_refptr<webrtc::AudioDeviceModule> audioDeviceModule = shards_.front()->audioDeviceModule();
+	int16_t num_audioDevices = audioDeviceModule->RecordingDevices();
 	RTC_LOG(INFO) << "nb audio devices:" << num_audioDevices;
 
 	std::map<std::string,std::string> deviceMap;
@@ -150,7 +583,7 @@ const Json::Value PeerConnectionManager::getAudioDeviceList()
 	{
 		char name[webrtc::kAdmMaxDeviceNameSize] = {0};
 		char id[webrtc::kAdmMaxGuidSize] = {0};
-		if (audioDeviceModule_->RecordingDeviceName(i, name, id) != -1)
+		if (audioDeviceModule->RecordingDeviceName(i, name, id) != -1)
 		{
 			RTC_LOG(INFO) << "audio device name:" << name << " id:" << id;
 			deviceMap[name]=id;
@@ -227,11 +660,25 @@ const Json::Value PeerConnectionManager::getIceServers(const std::string& client
 	return iceServers;
 }
 
+/* ---------------------------------------------------------------------------
+**  the servers are given at startup, only the address of the embedded STUN
+**  server depends on the client
+** -------------------------------------------------------------------------*/
+const std::string PeerConnectionManager::getIceServersVersion(const std::string& clientIp)
+{
+	std::string version;
+	if (stunurl_.find("0.0.0.0:") == 0) {
+		version = getServerIpFromClientIp(inet_addr(clientIp.c_str()));
+	}
+	return version;
+}
+
 /* ---------------------------------------------------------------------------
 **  add ICE candidate to a PeerConnection
 ** -------------------------------------------------------------------------*/
 const Json::Value PeerConnectionManager::addIceCandidate(const std::string& peerid, const Json::Value& jmessage)
 {
+	TRACE_EVENT1(TRACE_CATEGORY, "PeerConnectionManager::addIceCandidate", "peerid", peerid.c_str());
 	bool result = false;
 	std::string sdp_mid;
 	int sdp_mlineindex = 0;
@@ -251,10 +698,9 @@ const Json::Value PeerConnectionManager::addIceCandidate(const std::string& peer
 		}
 		else
 		{
-			std::map<std::string, PeerConnectionObserver* >::iterator  it = peer_connectionobs_map_.find(peerid);
-			if (it != peer_connectionobs_map_.end())
+			rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = this->getPeerConnection(peerid);
+			if (peerConnection)
 			{
-				rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = it->second->getPeerConnection();
 				if (!peerConnection->AddIceCandidate(candidate.get()))
 				{
 					RTC_LOG(WARNING) << "Failed to apply the received candidate";
@@ -279,19 +725,39 @@ const Json::Value PeerConnectionManager::addIceCandidate(const std::string& peer
 const Json::Value
 PeerConnectionManager::createOffer(
 	const std::string &peerid,
-	const std::string & videourl,
-	const std::string & audiourl,
-	const std::string & options)
+	const std::string & videoname,
+	const std::string & audioname,
+	const std::string & requestOptions,
+	const std::string & clientIp)
 {
+	TRACE_EVENT1(TRACE_CATEGORY, "PeerConnectionManager::createOffer", "peerid", peerid.c_str());
+	// streams declared by name use their settings
+	std::string videourl(videoname);
+	std::string audiourl(audioname);
+	std::string options(requestOptions);
+	this->resolveMedia(videourl, audiourl, options);
+
 	Json::Value offer;
+	if (!this->admit(peerid, clientIp, options, offer))
+	{
+		return offer;
+	}
 	RTC_LOG(INFO) << __FUNCTION__;
+	int64_t deadlineMs = rtc::TimeMillis() + signalingTimeoutMs_;
 	webrtc::PeerConnectionInterface::RTCConfiguration config;
 
-	PeerConnectionObserver* peerConnectionObserver = this->CreatePeerConnection(peerid, config);
+	PeerConnectionObserver* peerConnectionObserver = this->CreatePeerConnection(peerid, config, this->selectShard(getStreamLabel(videourl, audiourl)));
 	if (!peerConnectionObserver)
 	{
 		RTC_LOG(LERROR) << "Failed to initialize PeerConnection";
 	}
+	else if (!this->registerPeerConnection(peerid, peerConnectionObserver))
+	{
+		// the observer is not published, nobody else uses it
+		RTC_LOG(LERROR) << "[peerid=" << peerid << "] already in use";
+		delete peerConnectionObserver;
+		offer["error"] = "peerid already in use";
+	}
 	else
 	{
 		rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = peerConnectionObserver->getPeerConnection();
@@ -310,26 +776,22 @@ PeerConnectionManager::createOffer(
 			RTC_LOG(WARNING) << "set bitrate:" << bitrate;
 		}			
 		
-		if (!this->AddStream(peerConnectionObserver->getPeerConnection(), videourl, audiourl, options))
+		if (!this->addStreamToPeer(peerid, peerConnectionObserver, videourl, audiourl, options))
 		{
 			RTC_LOG(WARNING) << "Can't add stream";
 		}
 
-		// register peerid
-		peer_connectionobs_map_.insert(std::pair<std::string, PeerConnectionObserver* >(peerid, peerConnectionObserver));
-
-		// ask to create offer
-		peerConnectionObserver->getPeerConnection()->CreateOffer(CreateSessionDescriptionObserver::Create(peerConnectionObserver->getPeerConnection()), NULL);
+		// ask to create offer, completed when it is set as local description
+		std::shared_ptr<std::promise<bool>> localDone(new std::promise<bool>());
+		std::future<bool> localSet = localDone->get_future();
+		peerConnection->CreateOffer(CreateSessionDescriptionObserver::Create(peerConnection, localDone), NULL);
 
-		// waiting for offer
-		int count=10;
-		while ( (peerConnectionObserver->getPeerConnection()->local_description() == NULL) && (--count > 0) )
+		// answer with the created offer
+		const webrtc::SessionDescriptionInterface* desc = NULL;
+		if (this->waitFor(localSet, deadlineMs, peerid, "create offer"))
 		{
-			usleep(1000);
+			desc = peerConnection->local_description();
 		}
-
-		// answer with the created offer
-		const webrtc::SessionDescriptionInterface* desc = peerConnectionObserver->getPeerConnection()->local_description();
 		if (desc)
 		{
 			std::string sdp;
@@ -341,6 +803,8 @@ PeerConnectionManager::createOffer(
 		else
 		{
 			RTC_LOG(LERROR) << "Failed to create offer";
+			offer["error"] = "Failed to create offer";
+			this->hangUp(peerid, peerConnectionObserver);
 		}
 	}
 	return offer;
@@ -351,6 +815,7 @@ PeerConnectionManager::createOffer(
 ** -------------------------------------------------------------------------*/
 void PeerConnectionManager::setAnswer(const std::string &peerid, const Json::Value& jmessage)
 {
+	TRACE_EVENT1(TRACE_CATEGORY, "PeerConnectionManager::setAnswer", "peerid", peerid.c_str());
 	RTC_LOG(INFO) << jmessage;
 
 	std::string type;
@@ -371,10 +836,9 @@ void PeerConnectionManager::setAnswer(const std::string &peerid, const Json::Val
 		{
 			RTC_LOG(LERROR) << "From peerid:" << peerid << " received session description :" << session_description->type();
 
-			std::map<std::string, PeerConnectionObserver* >::iterator  it = peer_connectionobs_map_.find(peerid);
-			if (it != peer_connectionobs_map_.end())
+			rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = this->getPeerConnection(peerid);
+			if (peerConnection)
 			{
-				rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = it->second->getPeerConnection();
 				peerConnection->SetRemoteDescription(SetSessionDescriptionObserver::Create(peerConnection), session_description);
 			}
 		}
@@ -409,13 +873,25 @@ void extractturnserver(std::string *turnurl, std::string *turnuser, std::string
 const Json::Value
 PeerConnectionManager::call(
 	const std::string &peerid,
-	const std::string &videourl,
-	const std::string &audiourl,
-	const std::string &options,
-	const Json::Value &jmessage)
+	const std::string &videoname,
+	const std::string &audioname,
+	const std::string &requestOptions,
+	const Json::Value &jmessage,
+	const std::string &clientIp)
 {
-	RTC_LOG(INFO) << __FUNCTION__;
+	TRACE_EVENT1(TRACE_CATEGORY, "PeerConnectionManager::call", "peerid", peerid.c_str());
+	// streams declared by name use their settings
+	std::string videourl(videoname);
+	std::string audiourl(audioname);
+	std::string options(requestOptions);
+	this->resolveMedia(videourl, audiourl, options);
+
 	Json::Value answer;
+	if (!this->admit(peerid, clientIp, options, answer))
+	{
+		return answer;
+	}
+	RTC_LOG(INFO) << __FUNCTION__;
 
 	std::string type;
 	std::string sdp;
@@ -472,17 +948,22 @@ PeerConnectionManager::call(
 	}
 	else
 	{
-		RTC_LOG(WARNING) << "here1";
-		PeerConnectionObserver* peerConnectionObserver = this->CreatePeerConnection(peerid, config);
-		RTC_LOG(WARNING) << "here222";
+		int64_t deadlineMs = rtc::TimeMillis() + signalingTimeoutMs_;
+		PeerConnectionObserver* peerConnectionObserver = this->CreatePeerConnection(peerid, config, this->selectShard(getStreamLabel(videourl, audiourl)));
 		if (!peerConnectionObserver)
 		{
-			RTC_LOG(WARNING) << "here111";
 			RTC_LOG(LERROR) << "Failed to initialize PeerConnection";
 		}
+		else if (!this->registerPeerConnection(peerid, peerConnectionObserver))
+		{
+			// the observer is not published, nobody else uses it
+			RTC_LOG(LERROR) << "[peerid=" << peerid << "] already in use";
+			delete peerConnectionObserver;
+			answer["error"] = "peerid already in use";
+		}
 		else
 		{
-			RTC_LOG(WARNING) << "here2";
+			// the observer can be closed by a hangup during the next steps, it is only used through its peerid
 			rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = peerConnectionObserver->getPeerConnection();
 			
 			// set bandwidth
@@ -499,16 +980,10 @@ PeerConnectionManager::call(
 				RTC_LOG(WARNING) << "set bitrate:" << bitrate;
 			}			
 			
-			RTC_LOG(WARNING) << "here3";
-			
 			RTC_LOG(INFO) << "nbStreams local:" << peerConnection->local_streams()->count() << " remote:" << peerConnection->remote_streams()->count() << " localDescription:" << peerConnection->local_description();
 
-			// register peerid
-			peer_connectionobs_map_.insert(std::pair<std::string, PeerConnectionObserver* >(peerid, peerConnectionObserver));
-
-			RTC_LOG(WARNING) << "here4";
-
 			// set remote offer
+			bool remoteSet = false;
 			webrtc::SessionDescriptionInterface* session_description(webrtc::CreateSessionDescription(type, sdp, NULL));
 			if (!session_description)
 			{
@@ -516,183 +991,228 @@ PeerConnectionManager::call(
 			}
 			else
 			{
-				RTC_LOG(WARNING) << "here5";
-				peerConnection->SetRemoteDescription(SetSessionDescriptionObserver::Create(peerConnection), session_description);
-			}
-			
-			// waiting for remote description
-			int count=10;
-			while ( (peerConnection->remote_description() == NULL) && (--count > 0) )
-			{
-				usleep(1000);
-			}
-
-			RTC_LOG(WARNING) << "here6";
-
-			if (peerConnection->remote_description() == NULL) {
-				RTC_LOG(WARNING) << "remote_description is NULL";
+				std::shared_ptr<std::promise<bool>> remoteDone(new std::promise<bool>());
+				std::future<bool> remoteDescription = remoteDone->get_future();
+				peerConnection->SetRemoteDescription(SetSessionDescriptionObserver::Create(peerConnection, remoteDone), session_description);
+				remoteSet = this->waitFor(remoteDescription, deadlineMs, peerid, "set remote description");
 			}
 
-			RTC_LOG(WARNING) << "here7";
-
-			// add local stream
-			if (!this->AddStream(peerConnection, videourl, audiourl, options))
+			const webrtc::SessionDescriptionInterface* desc = NULL;
+			if (remoteSet)
 			{
-				RTC_LOG(WARNING) << "Can't add stream";
-			}
-
-			RTC_LOG(WARNING) << "here8";
+				// add local stream
+				if (!this->addStreamToPeer(peerid, peerConnectionObserver, videourl, audiourl, options))
+				{
+					RTC_LOG(WARNING) << "Can't add stream";
+				}
 
-			// create answer
-			webrtc::FakeConstraints constraints;
-			constraints.AddMandatory(webrtc::MediaConstraintsInterface::kOfferToReceiveVideo, "false");
-			constraints.AddMandatory(webrtc::MediaConstraintsInterface::kOfferToReceiveAudio, "false");
-			peerConnection->CreateAnswer(CreateSessionDescriptionObserver::Create(peerConnection), &constraints);
+				// create answer, completed when it is set as local description
+				webrtc::FakeConstraints constraints;
+				constraints.AddMandatory(webrtc::MediaConstraintsInterface::kOfferToReceiveVideo, "false");
+				constraints.AddMandatory(webrtc::MediaConstraintsInterface::kOfferToReceiveAudio, "false");
+				std::shared_ptr<std::promise<bool>> localDone(new std::promise<bool>());
+				std::future<bool> localDescription = localDone->get_future();
+				peerConnection->CreateAnswer(CreateSessionDescriptionObserver::Create(peerConnection, localDone), &constraints);
 
-			RTC_LOG(INFO) << "nbStreams local:" << peerConnection->local_streams()->count() << " remote:" << peerConnection->remote_streams()->count()
-					<< " localDescription:" << peerConnection->local_description()
-					<< " remoteDescription:" << peerConnection->remote_description();
+				if (this->waitFor(localDescription, deadlineMs, peerid, "create answer"))
+				{
+					desc = peerConnection->local_description();
+				}
 
-			// waiting for answer
-			count=10;
-			while ( (peerConnection->local_description() == NULL) && (--count > 0) )
-			{
-				usleep(1000);
+				RTC_LOG(INFO) << "nbStreams local:" << peerConnection->local_streams()->count() << " remote:" << peerConnection->remote_streams()->count()
+						<< " localDescription:" << peerConnection->local_description()
+						<< " remoteDescription:" << peerConnection->remote_description();
 			}
 
-			RTC_LOG(WARNING) << "here9";
-
-			RTC_LOG(INFO) << "nbStreams local:" << peerConnection->local_streams()->count() << " remote:" << peerConnection->remote_streams()->count()
-					<< " localDescription:" << peerConnection->local_description()
-					<< " remoteDescription:" << peerConnection->remote_description();
-
-			RTC_LOG(WARNING) << "here10";
-
 			// return the answer
-			const webrtc::SessionDescriptionInterface* desc = peerConnection->local_description();
 			if (desc)
 			{
-				RTC_LOG(WARNING) << "here11";
 				std::string sdp;
 				desc->ToString(&sdp);
 
 				answer[kSessionDescriptionTypeName] = desc->type();
 				answer[kSessionDescriptionSdpName] = sdp;
-
-				RTC_LOG(WARNING) << "here12";
 			}
 			else
 			{
-				RTC_LOG(WARNING) << "here13";
 				RTC_LOG(LERROR) << "Failed to create answer";
+				answer["error"] = "Failed to create answer";
+				this->hangUp(peerid, peerConnectionObserver);
 			}
 		}
 	}
 
-	RTC_LOG(WARNING) << "[peerid=" << peerid << "] returning answer:" << answer;
+	STREAMER_LOG_VERBOSE << "[peerid=" << peerid << "] returning answer:" << answer;
 	return answer;
 }
 
-bool PeerConnectionManager::streamStillUsed(const std::string & streamLabel)
+/* ---------------------------------------------------------------------------
+**  call answering with the server candidates in the SDP and the ICE servers
+** -------------------------------------------------------------------------*/
+const Json::Value
+PeerConnectionManager::connect(
+	const std::string &peerid,
+	const std::string &videourl,
+	const std::string &audiourl,
+	const std::string &options,
+	const Json::Value &jmessage,
+	const std::string &clientIp)
 {
-	bool stillUsed = false;
-	for (auto it: peer_connectionobs_map_)
+	TRACE_EVENT1(TRACE_CATEGORY, "PeerConnectionManager::connect", "peerid", peerid.c_str());
+	Json::Value answer = this->call(peerid, videourl, audiourl, options, jmessage, clientIp);
+	if (answer.isMember(kSessionDescriptionSdpName))
 	{
-		rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = it.second->getPeerConnection();
-		rtc::scoped_refptr<webrtc::StreamCollectionInterface> localstreams (peerConnection->local_streams());
-		for (unsigned int i = 0; i<localstreams->count(); i++)
-		{
-			if (localstreams->at(i)->label() == streamLabel)
+		// wait a little for the end of the gathering, the candidates not gathered in time are given by getIceCandidate
+		std::shared_future<bool> gathered = signalingThread_->Invoke<std::shared_future<bool>>(RTC_FROM_HERE, [this, &peerid]() {
+			std::shared_future<bool> done;
+			std::map<std::string, PeerConnectionObserver* >::iterator it = peer_connectionobs_map_.find(peerid);
+			if (it != peer_connectionobs_map_.end())
 			{
-				stillUsed = true;
-				break;
+				done = it->second->getGatheringDone();
 			}
+			return done;
+		});
+		bool gatheringComplete = (gathered.valid()) && (gathered.wait_for(std::chrono::milliseconds(kIceGatheringTimeoutMs)) == std::future_status::ready);
+		if (!gatheringComplete)
+		{
+			RTC_LOG(INFO) << "[peerid=" << peerid << "] ICE gathering not complete after " << kIceGatheringTimeoutMs << "ms";
+		}
+		// the client asks the other candidates only when some are missing
+		answer["iceGatheringComplete"] = gatheringComplete;
+
+		rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = this->getPeerConnection(peerid);
+		if ( (peerConnection) && (peerConnection->local_description()) )
+		{
+			std::string sdp;
+			peerConnection->local_description()->ToString(&sdp);
+			answer[kSessionDescriptionSdpName] = sdp;
 		}
+
+		// the client can reuse them for its next connections
+		answer["iceServers"] = this->getIceServers(clientIp)["iceServers"];
 	}
-	return stillUsed;
+	return answer;
 }
 
 /* ---------------------------------------------------------------------------
-**  hangup a call
+**  push the candidates of a PeerConnection
 ** -------------------------------------------------------------------------*/
-const Json::Value PeerConnectionManager::hangUp(const std::string &peerid)
+bool PeerConnectionManager::setIceCandidateListener(const std::string &peerid, IceCandidateListener listener)
 {
-	bool result = false;
-	RTC_LOG(INFO) << __FUNCTION__ << " " << peerid;
+	return signalingThread_->Invoke<bool>(RTC_FROM_HERE, [this, &peerid, &listener]() {
+		bool found = false;
+		std::map<std::string, PeerConnectionObserver* >::iterator it = peer_connectionobs_map_.find(peerid);
+		if (it != peer_connectionobs_map_.end())
+		{
+			it->second->setIceCandidateListener(listener);
+			found = true;
+		}
+		return found;
+	});
+}
 
-	std::map<std::string, PeerConnectionObserver* >::iterator  it = peer_connectionobs_map_.find(peerid);
-	if (it != peer_connectionobs_map_.end())
+/* ---------------------------------------------------------------------------
+**  admission of a new call, the answer of a rejected call has its retry delay
+** -------------------------------------------------------------------------*/
+bool PeerConnectionManager::admit(const std::string & peerid, const std::string & clientIp, std::string & options, Json::Value & answer)
+{
+	int retryAfter = 0;
+	std::string reason;
+	AdmissionController::Decision decision = admission_->admit(clientIp, peerCount_, retryAfter, reason);
+	if (decision == AdmissionController::Reject)
 	{
-		RTC_LOG(LS_ERROR) << "Close PeerConnection";
-		PeerConnectionObserver* pcObserver = it->second;
-		rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = pcObserver->getPeerConnection();
-		peer_connectionobs_map_.erase(it);
-
-		rtc::scoped_refptr<webrtc::StreamCollectionInterface> localstreams (peerConnection->local_streams());
-		Json::Value streams;
-		
-		RTC_LOG(LS_ERROR) << "peerConnection->Close()";
-		peerConnection->Close();
-		delete pcObserver;
-		RTC_LOG(LS_ERROR) << "done peerConnection->Close()";
+		RTC_LOG(WARNING) << "[peerid=" << peerid << "] call rejected:" << reason;
+		answer["error"] = reason;
+		answer["retryAfter"] = retryAfter;
+	}
+	else if (decision == AdmissionController::Degrade)
+	{
+		// only the new viewers get a lower bitrate, the options of the request come after
+		RTC_LOG(INFO) << "[peerid=" << peerid << "] call " << reason;
+		options = "bitrate=" + std::to_string(kDegradedBitrate) + (options.empty() ? "" : "&" + options);
+	}
+	return (decision != AdmissionController::Reject);
+}
 
-		for (unsigned int i = 0; i<localstreams->count(); i++)
+/* ---------------------------------------------------------------------------
+**  wait for the completion of a signaling step, the steps of a call share one deadline
+** -------------------------------------------------------------------------*/
+bool PeerConnectionManager::waitFor(std::future<bool> & done, int64_t deadlineMs, const std::string & peerid, const char* step)
+{
+	bool success = false;
+	int64_t remainingMs = std::max<int64_t>(deadlineMs - rtc::TimeMillis(), 0);
+	if (done.wait_for(std::chrono::milliseconds(remainingMs)) != std::future_status::ready)
+	{
+		RTC_LOG(LERROR) << "[peerid=" << peerid << "] signaling timeout of " << signalingTimeoutMs_ << "ms reached waiting to " << step;
+	}
+	else
+	{
+		success = done.get();
+		if (!success)
 		{
-			std::string streamLabel = localstreams->at(i)->label();
-
-			bool stillUsed = this->streamStillUsed(streamLabel);
-			if (!stillUsed)
-			{
-				RTC_LOG(LS_ERROR) << "Close PeerConnection no more used " << streamLabel;
-				std::map<std::string, rtc::scoped_refptr<webrtc::MediaStreamInterface> >::iterator it = stream_map_.find(streamLabel);
-				RTC_LOG(LS_ERROR) << "herehere";
-				if (it != stream_map_.end())
-				{
+			RTC_LOG(LERROR) << "[peerid=" << peerid << "] failed to " << step;
+		}
+	}
+	return success;
+}
 
-					RTC_LOG(LS_ERROR) << "herehere2";
-					// remove video tracks
-					while (it->second->GetVideoTracks().size() > 0)
-					{
-						RTC_LOG(LS_ERROR) << "herehere123";
-						it->second->RemoveTrack(it->second->GetVideoTracks().at(0));
-						RTC_LOG(LS_ERROR) << "herehere1233124";
-					}
+/* ---------------------------------------------------------------------------
+**  hangup a call
+** -------------------------------------------------------------------------*/
+const Json::Value PeerConnectionManager::hangUp(const std::string &peerid)
+{
+	TRACE_EVENT1(TRACE_CATEGORY, "PeerConnectionManager::hangUp", "peerid", peerid.c_str());
+	return signalingThread_->Invoke<Json::Value>(RTC_FROM_HERE, [this, &peerid]() {
+		return this->closePeerConnection(peerid);
+	});
+}
 
-					RTC_LOG(LS_ERROR) << "herehere3";
-					// remove audio tracks
-					while (it->second->GetAudioTracks().size() > 0)
-					{
-						it->second->RemoveTrack(it->second->GetAudioTracks().at(0));
-					}
+const Json::Value PeerConnectionManager::hangUp(const std::string &peerid, PeerConnectionObserver* peerConnectionObserver)
+{
+	return signalingThread_->Invoke<Json::Value>(RTC_FROM_HERE, [this, &peerid, peerConnectionObserver]() {
+		return this->closePeerConnection(peerid, peerConnectionObserver);
+	});
+}
 
-					RTC_LOG(LS_ERROR) << "herehere4";
+/* ---------------------------------------------------------------------------
+**  close a PeerConnection and the streams no more used (signaling thread)
+** -------------------------------------------------------------------------*/
+const Json::Value PeerConnectionManager::closePeerConnection(const std::string &peerid, PeerConnectionObserver* peerConnectionObserver)
+{
+	bool result = false;
+	RTC_LOG(INFO) << __FUNCTION__ << " " << peerid;
 
-					it->second.release();
-					RTC_LOG(LS_ERROR) << "herehere5";
-					stream_map_.erase(it);
-					RTC_LOG(LS_ERROR) << "herehere6";
-				}
+	std::map<std::string, PeerConnectionObserver* >::iterator  it = peer_connectionobs_map_.find(peerid);
+	// an observer that is not registered, or replaced under the same peerid, is not closed here
+	if ( (it != peer_connectionobs_map_.end()) && ( (peerConnectionObserver == NULL) || (it->second == peerConnectionObserver) ) )
+	{
+		RTC_LOG(INFO) << "Close PeerConnection peerid:" << peerid;
+		PeerConnectionObserver* pcObserver = it->second;
+		FactoryShard* shard = pcObserver->getShard();
+		std::string streamLabel = pcObserver->getStreamLabel();
+		rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = pcObserver->getPeerConnection();
+		peer_connectionobs_map_.erase(it);
+		peerCount_--;
 
-				RTC_LOG(LS_ERROR) << "herehere7";
-			}
+		STREAMER_LOG_VERBOSE << "peerConnection->Close()";
+		peerConnection->Close();
+		delete pcObserver;
+		STREAMER_LOG_VERBOSE << "done peerConnection->Close()";
 
-			RTC_LOG(LS_ERROR) << "herehere8";
+		// the stream is closed with its last viewer
+		if (!streamLabel.empty())
+		{
+			shard->releaseStream(streamLabel);
 		}
 
-		RTC_LOG(LS_ERROR) << "herehere9";
-
 		result = true;
-
-		RTC_LOG(LS_ERROR) << "herehere10";
 	}
 	Json::Value answer;
 
-	RTC_LOG(LS_ERROR) << "herehere11";
 	if (result) {
 		answer = result;
 	}
 
-	RTC_LOG(LS_ERROR) << "herehere12";
 
 	return answer;
 }
@@ -704,102 +1224,485 @@ const Json::Value PeerConnectionManager::hangUp(const std::string &peerid)
 const Json::Value PeerConnectionManager::getIceCandidateList(const std::string &peerid)
 {
 	RTC_LOG(INFO) << __FUNCTION__;
-	
-	Json::Value value;
-	std::map<std::string, PeerConnectionObserver* >::iterator  it = peer_connectionobs_map_.find(peerid);
-	if (it != peer_connectionobs_map_.end())
+
+	// candidates are appended by the signaling thread
+	return signalingThread_->Invoke<Json::Value>(RTC_FROM_HERE, [this, &peerid]() {
+		Json::Value value;
+		std::map<std::string, PeerConnectionObserver* >::iterator  it = peer_connectionobs_map_.find(peerid);
+		if (it != peer_connectionobs_map_.end())
+		{
+			PeerConnectionObserver* obs = it->second;
+			if (obs)
+			{
+				value = obs->getIceCandidateList();
+			}
+			else
+			{
+				RTC_LOG(LS_ERROR) << "No observer for peer:" << peerid;
+			}
+		} else {
+			RTC_LOG(WARNING) << __FUNCTION__ << "failed to getIceCandidateList";
+		}
+		return value;
+	});
+}
+
+/* ---------------------------------------------------------------------------
+**  get PeerConnection list
+** -------------------------------------------------------------------------*/
+const Json::Value PeerConnectionManager::getPeerConnectionList(const std::string & peerid, const std::string & streamLabel, const std::string & field, size_t last)
+{
+	std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&snapshot_);
+
+	Json::Value value(Json::arrayValue);
+	for (const PeerSnapshot & peer : snapshot->peers)
 	{
-		PeerConnectionObserver* obs = it->second;
-		if (obs)
+		// empty filters match all the peers, the stream matches the beginning of its label
+		if ( (!peerid.empty()) && (peer.peerid != peerid) )
 		{
-			value = obs->getIceCandidateList();
+			continue;
 		}
-		else
+		if (peer.streamLabel.compare(0, streamLabel.size(), streamLabel) != 0)
 		{
-			RTC_LOG(LS_ERROR) << "No observer for peer:" << peerid;
+			continue;
 		}
-	} else {
-		RTC_LOG(WARNING) << __FUNCTION__ << "failed to getIceCandidateList";
+		Json::Value content(peer.content);
+
+		// stats sampled in background
+		content["stats"] = peer.statsHistory->query(field, last);
+
+		Json::Value pc;
+		pc[peer.peerid] = content;
+		value.append(pc);
 	}
 	return value;
 }
 
 /* ---------------------------------------------------------------------------
-**  get PeerConnection list
+**  get StreamList list, the labels or with details an object by label
 ** -------------------------------------------------------------------------*/
-const Json::Value PeerConnectionManager::getPeerConnectionList()
+const Json::Value PeerConnectionManager::getStreamList(bool details)
 {
-	Json::Value value(Json::arrayValue);
-	for (auto it : peer_connectionobs_map_)
+	std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&snapshot_);
+
+	if (!details)
 	{
-		Json::Value content;
+		Json::Value value(Json::arrayValue);
+		for (auto & it : snapshot->streams)
+		{
+			value.append(it.first);
+		}
+		return value;
+	}
 
-		// get local SDP
-		rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = it.second->getPeerConnection();
-		if ( (peerConnection) && (peerConnection->local_description()) ) {
-			std::string sdp;
-			peerConnection->local_description()->ToString(&sdp);
-			content["sdp"] = sdp;
-
-			Json::Value streams;
-			rtc::scoped_refptr<webrtc::StreamCollectionInterface> localstreams (peerConnection->local_streams());
-			if (localstreams) {
-				for (unsigned int i = 0; i<localstreams->count(); i++) {
-					if (localstreams->at(i)) {
-						Json::Value tracks;
-						
-						const webrtc::VideoTrackVector& videoTracks = localstreams->at(i)->GetVideoTracks();
-						for (unsigned int j=0; j<videoTracks.size() ; j++)
-						{
-							Json::Value track;
-							tracks[videoTracks.at(j)->kind()].append(videoTracks.at(j)->id());
-						}
-						const webrtc::AudioTrackVector& audioTracks = localstreams->at(i)->GetAudioTracks();
-						for (unsigned int j=0; j<audioTracks.size() ; j++)
-						{
-							Json::Value track;
-							tracks[audioTracks.at(j)->kind()].append(audioTracks.at(j)->id());
-						}
-						
-						Json::Value stream;
-						stream[localstreams->at(i)->label()] = tracks;
-						
-						streams.append(stream);						
-					}
+	Json::Value value(Json::objectValue);
+	for (auto & it : snapshot->streams)
+	{
+		const std::string & label = it.first;
+		Json::Value stream(Json::objectValue);
+		stream["viewers"] = it.second.viewers;
+		stream["latency"] = SourceMetrics::latency(it.second.sources);
+#ifdef HAVE_LIVE555
+		// stream label is videourl|audiourl
+		std::istringstream is(label);
+		std::string url;
+		while (std::getline(is, url, '|'))
+		{
+			if (url.find("rtsp://") == 0)
+			{
+				Json::Value rtsp = rtspSessionManager_->getStats(url);
+				if (!rtsp.isNull()) {
+					stream["rtsp"].append(rtsp);
 				}
 			}
-			content["streams"] = streams;
 		}
-		
-		// get Stats
-		content["stats"] = it.second->getStats();
-
-		Json::Value pc;
-		pc[it.first] = content;
-		value.append(pc);
+#endif
+		value[label] = stream;
 	}
 	return value;
 }
 
 /* ---------------------------------------------------------------------------
-**  get StreamList list
+**  latency of the stages of the frames by stream and of the shared encoders
 ** -------------------------------------------------------------------------*/
-const Json::Value PeerConnectionManager::getStreamList()
+const Json::Value PeerConnectionManager::getLatency(const std::string & streamLabel)
 {
-	Json::Value value(Json::arrayValue);
-	for (auto it : stream_map_)
+	std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&snapshot_);
+
+	Json::Value value = metrics_.latency();
+	value["streams"] = Json::Value(Json::objectValue);
+	for (auto & it : snapshot->streams)
 	{
-		value.append(it.first);
+		// the stream matches the beginning of the label, all the streams if empty
+		if (it.first.compare(0, streamLabel.size(), streamLabel) == 0)
+		{
+			value["streams"][it.first] = SourceMetrics::latency(it.second.sources);
+		}
 	}
 	return value;
 }
 
+/* ---------------------------------------------------------------------------
+**  Prometheus text of the counters and of the last snapshot
+** -------------------------------------------------------------------------*/
+const std::string PeerConnectionManager::renderMetrics()
+{
+	std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&snapshot_);
+
+	std::ostringstream os;
+	Metrics::header(os, "webrtcstreamer_stream_viewers", "gauge", "PeerConnections receiving the stream");
+	for (auto & it : snapshot->streams)
+	{
+		Metrics::sample(os, "webrtcstreamer_stream_viewers", Metrics::label("stream", it.first), it.second.viewers);
+	}
+	Metrics::header(os, "webrtcstreamer_stream_fps", "gauge", "Frames per second of the video track sent");
+	for (auto & it : snapshot->streams)
+	{
+		Metrics::sample(os, "webrtcstreamer_stream_fps", Metrics::label("stream", it.first), it.second.fps);
+	}
+
+	// the sources of a stream opened by several shards are summed
+	Metrics::header(os, "webrtcstreamer_stream_frames_total", "counter", "Frames received and decoded from the source");
+	for (auto & it : snapshot->streams)
+	{
+		uint64_t frames = 0;
+		for (auto & source : it.second.sources)
+		{
+			frames += source->frames();
+		}
+		Metrics::sample(os, "webrtcstreamer_stream_frames_total", Metrics::label("stream", it.first), frames);
+	}
+	Metrics::header(os, "webrtcstreamer_stream_decode_seconds_total", "counter", "Time spent decoding the source");
+	for (auto & it : snapshot->streams)
+	{
+		uint64_t decodeUs = 0;
+		for (auto & source : it.second.sources)
+		{
+			decodeUs += source->decodeUs();
+		}
+		Metrics::sample(os, "webrtcstreamer_stream_decode_seconds_total", Metrics::label("stream", it.first), decodeUs / 1e6);
+	}
+	Metrics::header(os, "webrtcstreamer_stream_dropped_frames_total", "counter", "Frames of the source that could not be decoded");
+	for (auto & it : snapshot->streams)
+	{
+		uint64_t dropped = 0;
+		for (auto & source : it.second.sources)
+		{
+			dropped += source->droppedFrames();
+		}
+		Metrics::sample(os, "webrtcstreamer_stream_dropped_frames_total", Metrics::label("stream", it.first), dropped);
+	}
+
+	Metrics::header(os, "webrtcstreamer_peers", "gauge", "PeerConnections");
+	Metrics::sample(os, "webrtcstreamer_peers", "", peerCount_);
+	Metrics::header(os, "webrtcstreamer_egress_kbps", "gauge", "Bitrate sent to all the peers");
+	Metrics::sample(os, "webrtcstreamer_egress_kbps", "", snapshot->egressKbps);
+	Metrics::header(os, "webrtcstreamer_encode_fps", "gauge", "Frames encoded per second for all the peers");
+	Metrics::sample(os, "webrtcstreamer_encode_fps", "", snapshot->encodeFps);
+	Metrics::header(os, "webrtcstreamer_encode_qp", "gauge", "Average QP of the encoded frames");
+	Metrics::sample(os, "webrtcstreamer_encode_qp", "", snapshot->qp);
+
+	metrics_.render(os);
+	return os.str();
+}
+
+/* ---------------------------------------------------------------------------
+**  find a PeerConnection
+** -------------------------------------------------------------------------*/
+rtc::scoped_refptr<webrtc::PeerConnectionInterface> PeerConnectionManager::getPeerConnection(const std::string &peerid)
+{
+	return signalingThread_->Invoke<rtc::scoped_refptr<webrtc::PeerConnectionInterface>>(RTC_FROM_HERE, [this, &peerid]() {
+		rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection;
+		std::map<std::string, PeerConnectionObserver* >::iterator  it = peer_connectionobs_map_.find(peerid);
+		if (it != peer_connectionobs_map_.end())
+		{
+			peerConnection = it->second->getPeerConnection();
+		}
+		return peerConnection;
+	});
+}
+
+/* ---------------------------------------------------------------------------
+**  register a PeerConnection
+** -------------------------------------------------------------------------*/
+bool PeerConnectionManager::registerPeerConnection(const std::string &peerid, PeerConnectionObserver* peerConnectionObserver)
+{
+	return signalingThread_->Invoke<bool>(RTC_FROM_HERE, [this, &peerid, peerConnectionObserver]() {
+		// the peers counted by the admission are the registered ones
+		bool inserted = peer_connectionobs_map_.insert(std::pair<std::string, PeerConnectionObserver* >(peerid, peerConnectionObserver)).second;
+		if (inserted)
+		{
+			peerCount_++;
+		}
+		return inserted;
+	});
+}
+
+/* ---------------------------------------------------------------------------
+**  add the stream to a registered PeerConnection, false if it was closed
+** -------------------------------------------------------------------------*/
+bool PeerConnectionManager::addStreamToPeer(const std::string &peerid, PeerConnectionObserver* peerConnectionObserver, const std::string & videourl, const std::string & audiourl, const std::string & options)
+{
+	return signalingThread_->Invoke<bool>(RTC_FROM_HERE, [&]() {
+		// the observer is only dereferenced if it is still the registered one
+		std::map<std::string, PeerConnectionObserver* >::iterator it = peer_connectionobs_map_.find(peerid);
+		if ( (it == peer_connectionobs_map_.end()) || (it->second != peerConnectionObserver) )
+		{
+			RTC_LOG(WARNING) << "[peerid=" << peerid << "] closed before adding the stream";
+			return false;
+		}
+		return this->AddStream(peerConnectionObserver, videourl, audiourl, options);
+	});
+}
+
+/* ---------------------------------------------------------------------------
+**  publish the snapshot used by the read queries (signaling thread)
+** -------------------------------------------------------------------------*/
+void PeerConnectionManager::OnMessage(rtc::Message* msg)
+{
+	if (msg->message_id == kStatsMsg)
+	{
+		// one report by peer for its meter, its tier selector and its history at its own interval
+		int64_t now = rtc::TimeMillis();
+		bool sampleHistory = (statsIntervalMs_ > 0) && (now - lastHistoryMs_ + statsTickMs_/2 >= statsIntervalMs_);
+		if (sampleHistory)
+		{
+			lastHistoryMs_ = now;
+		}
+		for (auto it : peer_connectionobs_map_)
+		{
+			rtc::scoped_refptr<webrtc::PeerConnectionInterface> peerConnection = it.second->getPeerConnection();
+			if (peerConnection)
+			{
+				std::vector<rtc::scoped_refptr<webrtc::RTCStatsCollectorCallback>> callbacks;
+				callbacks.push_back(it.second->getBitrateMeter());
+				if (it.second->getTierSelector())
+				{
+					callbacks.push_back(it.second->getTierSelector());
+				}
+				if (sampleHistory)
+				{
+					callbacks.push_back(it.second->getStatsHistory());
+				}
+				peerConnection->GetStats(StatsDispatcher::Create(callbacks));
+			}
+		}
+		signalingThread_->PostDelayed(RTC_FROM_HERE, statsTickMs_, this, kStatsMsg);
+		return;
+	}
+
+	// reload the config file when it changes
+	if (!configFile_.empty())
+	{
+		struct stat fileStat;
+		if ( (stat(configFile_.c_str(), &fileStat) == 0) && (fileStat.st_mtime != configTime_) )
+		{
+			RTC_LOG(INFO) << "Reload config file:" << configFile_;
+			this->loadMediaList();
+		}
+	}
+
+	this->expireStreams();
+
+	std::map<std::string, EgressBandwidthManager::Peer> egressPeers;
+	std::shared_ptr<const Snapshot> previous = std::atomic_load(&snapshot_);
+	std::shared_ptr<Snapshot> snapshot(new Snapshot());
+	snapshot->version = previous->version + 1;
+	double qpWeighted = 0;
+	for (auto it : peer_connectionobs_map_)
+	{
+		PeerSnapshot peer;
+		peer.peerid = it.first;
+		peer.peerConnection = it.second->getPeerConnection();
+		peer.statsHistory = it.second->getStatsHistory();
+		peer.streamLabel = it.second->getStreamLabel();
+		peer.content["shard"] = it.second->getShard()->index();
+
+		// bitrate sent, measured on the stats tick for the admission of the next calls
+		rtc::scoped_refptr<BitrateMeter> bitrateMeter = it.second->getBitrateMeter();
+		snapshot->egressKbps += bitrateMeter->bitrateKbps();
+		snapshot->encodeFps += bitrateMeter->encodeFps();
+		qpWeighted += bitrateMeter->qp() * bitrateMeter->encodeFps();
+		peer.content["link"]["bitrate"] = bitrateMeter->bitrateKbps();
+		peer.content["link"]["available"] = bitrateMeter->availableKbps();
+		peer.content["link"]["rtt"] = bitrateMeter->rttMs();
+		peer.content["link"]["loss"] = bitrateMeter->lossRatio();
+		if ( (egressManager_) && (peer.peerConnection) )
+		{
+			EgressBandwidthManager::Peer & egressPeer = egressPeers[it.first];
+			egressPeer.peerConnection = peer.peerConnection;
+			egressPeer.meter = bitrateMeter;
+			egressPeer.weight = it.second->getEgressWeight();
+			egressPeer.maxKbps = it.second->getEgressMaxKbps();
+			// with -E the viewers of a stream share the encoder of its track in their shard, one track by tier
+			if (sharedVideoEncoders_)
+			{
+				rtc::scoped_refptr<VideoTierSelector> tierSelector = it.second->getTierSelector();
+				egressPeer.group = std::to_string(it.second->getShard()->index()) + "|" + peer.streamLabel;
+				if (tierSelector)
+				{
+					egressPeer.group += "|" + std::to_string(tierSelector->currentTier());
+				}
+			}
+			peer.content["link"]["allocated"] = egressManager_->allocatedKbps(it.first);
+		}
+
+		// the tier is chosen on the stats tick from the last bandwidth estimation
+		rtc::scoped_refptr<VideoTierSelector> tierSelector = it.second->getTierSelector();
+		if (tierSelector)
+		{
+			peer.content["tier"] = tierSelector->getStats();
+		}
+
+		// local SDP and streams cached by the observer
+		Json::Value localDescription = it.second->getLocalDescription();
+		for (const std::string & key : localDescription.getMemberNames())
+		{
+			peer.content[key] = localDescription[key];
+		}
+		snapshot->peers.push_back(peer);
+	}
+	double pixelRate = 0;
+	for (auto & shard : shards_)
+	{
+		for (auto & it : shard->streams())
+		{
+			StreamSnapshot & stream = snapshot->streams[it.first];
+			stream.viewers += it.second.viewers;
+			if (it.second.metrics)
+			{
+				stream.sources.push_back(it.second.metrics);
+			}
+
+			// pixels to encode, once for all the viewers with shared encoders
+			if (it.second.frameCounter)
+			{
+				double fps = 0;
+				double streamPixelRate = 0;
+				it.second.frameCounter->sample(fps, streamPixelRate);
+				stream.fps = std::max(stream.fps, fps);
+				pixelRate += streamPixelRate * (sharedVideoEncoders_ ? std::min(it.second.viewers, 1) : it.second.viewers);
+			}
+		}
+	}
+	if (snapshot->encodeFps > 0)
+	{
+		snapshot->qp = qpWeighted / snapshot->encodeFps;
+	}
+
+	// the version of the stream list changes only when a stream or a viewer comes or goes
+	bool streamListChanged = (snapshot->streams.size() != previous->streams.size());
+	for (auto & it : snapshot->streams)
+	{
+		std::map<std::string, StreamSnapshot>::const_iterator stream = previous->streams.find(it.first);
+		if ( (stream == previous->streams.end()) || (stream->second.viewers != it.second.viewers) )
+		{
+			streamListChanged = true;
+		}
+	}
+	snapshot->streamListVersion = previous->streamListVersion + (streamListChanged ? 1 : 0);
+	admission_->update(pixelRate, snapshot->egressKbps);
+
+	// divide the egress budget from the last statistics of the peers
+	int64_t now = rtc::TimeMillis();
+	if ( (egressManager_) && (now - lastEgressMs_ >= kEgressPeriodMs) )
+	{
+		lastEgressMs_ = now;
+		egressManager_->allocate(egressPeers);
+	}
+	std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>(snapshot));
+	signalingThread_->PostDelayed(RTC_FROM_HERE, kSnapshotPeriodMs, this, kSnapshotMsg);
+}
+
+/* ---------------------------------------------------------------------------
+**  close the warm streams after their linger or beyond the warm pool (signaling thread)
+** -------------------------------------------------------------------------*/
+void PeerConnectionManager::expireStreams()
+{
+	int64_t now = rtc::TimeMillis();
+	std::vector<std::pair<int64_t, std::pair<FactoryShard*, std::string>>> warmStreams;
+	for (auto & shard : shards_)
+	{
+		std::vector<std::string> expired;
+		for (auto & it : shard->streams())
+		{
+			if (it.second.idleSinceMs != 0)
+			{
+				if (now - it.second.idleSinceMs >= it.second.lingerMs)
+				{
+					expired.push_back(it.first);
+				}
+				else
+				{
+					warmStreams.push_back(std::make_pair(it.second.idleSinceMs, std::make_pair(shard.get(), it.first)));
+				}
+			}
+		}
+		for (const std::string & streamLabel : expired)
+		{
+			shard->closeStream(streamLabel);
+		}
+	}
+
+	// the least recently watched streams leave the warm pool first
+	if (warmStreams.size() > warmPoolSize_)
+	{
+		std::sort(warmStreams.begin(), warmStreams.end());
+		for (size_t i = 0; i < warmStreams.size() - warmPoolSize_; ++i)
+		{
+			warmStreams[i].second.first->closeStream(warmStreams[i].second.second);
+		}
+	}
+}
+
 /* ---------------------------------------------------------------------------
 **  check if factory is initialized
 ** -------------------------------------------------------------------------*/
 bool PeerConnectionManager::InitializePeerConnection()
 {
-	return (peer_connection_factory_.get() != NULL);
+	this->loadMediaList();
+
+	// start to publish the snapshot of the state and to sample the statistics of the peers
+	signalingThread_->PostDelayed(RTC_FROM_HERE, kSnapshotPeriodMs, this, kSnapshotMsg);
+	signalingThread_->PostDelayed(RTC_FROM_HERE, statsTickMs_, this, kStatsMsg);
+
+	bool initialized = true;
+	for (auto & shard : shards_)
+	{
+		initialized = initialized && (shard->factory().get() != NULL);
+	}
+	return initialized;
+}
+
+/* ---------------------------------------------------------------------------
+**  choose the shard of a new PeerConnection
+** -------------------------------------------------------------------------*/
+PeerConnectionManager::FactoryShard* PeerConnectionManager::selectShard(const std::string & streamLabel)
+{
+	size_t index = 0;
+	if (shardByStream_)
+	{
+		// viewers of a stream share the shard, the source and the encoders
+		index = std::hash<std::string>()(streamLabel) % shards_.size();
+	}
+	else
+	{
+		index = nextShard_++ % shards_.size();
+	}
+	return shards_[index].get();
+}
+
+/* ---------------------------------------------------------------------------
+**  stream label, without space because SDP use label
+** -------------------------------------------------------------------------*/
+std::string PeerConnectionManager::getStreamLabel(const std::string & videourl, const std::string & audiourl)
+{
+	std::string streamLabel = videourl;
+	if (!audiourl.empty()) {
+		streamLabel += "|" + audiourl;
+	}
+	streamLabel.erase(std::remove_if(streamLabel.begin(), streamLabel.end(), isspace), streamLabel.end());
+	return streamLabel;
 }
 
 /* ---------------------------------------------------------------------------
@@ -808,25 +1711,36 @@ bool PeerConnectionManager::InitializePeerConnection()
 PeerConnectionManager::PeerConnectionObserver*
 PeerConnectionManager::CreatePeerConnection(
 	const std::string& peerid,
-	webrtc::PeerConnectionInterface::RTCConfiguration &config
+	webrtc::PeerConnectionInterface::RTCConfiguration &config,
+	FactoryShard* shard
 	)
 {
-	RTC_LOG(WARNING) << __FUNCTION__ << "CreatePeerConnection called";
+	RTC_LOG(INFO) << __FUNCTION__;
 	webrtc::FakeConstraints constraints;
 	constraints.AddOptional(webrtc::MediaConstraintsInterface::kEnableDtlsSrtp, "true");
 
-	RTC_LOG(WARNING) << __FUNCTION__ << "here1010";
+	// certificate of the pool, generated by the factory when the pool is not ready
+	if (certificatePool_)
+	{
+		rtc::scoped_refptr<rtc::RTCCertificate> certificate = certificatePool_->get();
+		if (certificate)
+		{
+			config.certificates.push_back(certificate);
+		}
+	}
 
-	PeerConnectionObserver* obs = new PeerConnectionObserver(this, peerid, config, constraints);
 
-	RTC_LOG(WARNING) << __FUNCTION__ << "here2323010";
+	// candidates gathered before the remote description is received
+	config.ice_candidate_pool_size = iceCandidatePoolSize_;
 
-	if (!obs)
+	PeerConnectionObserver* obs = new PeerConnectionObserver(this, shard, peerid, config, constraints, shard->createPortAllocator(minPort_, maxPort_), statsDepth_);
+	if (!obs->getPeerConnection())
 	{
 		RTC_LOG(LERROR) << __FUNCTION__ << "CreatePeerConnection failed";
+		delete obs;
+		obs = NULL;
 	}
 
-	RTC_LOG(WARNING) << __FUNCTION__ << "here23452";
 	return obs;
 }
 
@@ -835,24 +1749,38 @@ PeerConnectionManager::CreatePeerConnection(
 ** -------------------------------------------------------------------------*/
 rtc::scoped_refptr<webrtc::VideoTrackInterface>
 PeerConnectionManager::CreateVideoTrack(
+	FactoryShard* shard,
 	const std::string &pipename,
-	const std::string &options)
+	const std::string &options,
+	std::vector<PausableSource*> & sources,
+	std::shared_ptr<SourceMetrics> metrics)
 {
 	RTC_LOG(INFO) << "pipename:" << pipename << " options:" << options;
 	rtc::scoped_refptr<webrtc::VideoTrackInterface> video_track;
 
 	std::unique_ptr<cricket::VideoCapturer> capturer;
-	RTC_LOG(INFO) << "Using pipename for ZMQFrameReader:" << pipename;
-
-	// int timeout = 10;
-	// std::string tmp;
-	// if (CivetServer::getParam(options, "timeout", tmp)) {
-	// 	timeout = std::stoi(tmp);
-	// }
-	// std::string rtptransport;
-	// CivetServer::getParam(options, "rtptransport", rtptransport);
-	// capturer.reset(new RTSPVideoCapturer("rtsp://b1.dnsdojo.com:1935/live/sys3.stream", timeout, rtptransport));
-	capturer.reset(new ZMQFrameReader(pipename));
+#ifdef HAVE_LIVE555
+	if (pipename.find("rtsp://") == 0)
+	{
+		int timeout = 10;
+		std::string tmp;
+		if (CivetServer::getParam(options, "timeout", tmp)) {
+			timeout = std::stoi(tmp);
+		}
+		std::string rtptransport;
+		CivetServer::getParam(options, "rtptransport", rtptransport);
+		RTSPVideoCapturer* rtspCapturer = new RTSPVideoCapturer(*rtspSessionManager_, pipename, timeout, rtptransport, metrics);
+		sources.push_back(rtspCapturer);
+		capturer.reset(rtspCapturer);
+	}
+	else
+#endif
+	{
+		RTC_LOG(INFO) << "Using pipename for ZMQFrameReader:" << pipename;
+		ZMQFrameReader* zmqCapturer = new ZMQFrameReader(pipename, metrics);
+		sources.push_back(zmqCapturer);
+		capturer.reset(zmqCapturer);
+	}
 
 	if (!capturer)
 	{
@@ -860,8 +1788,19 @@ PeerConnectionManager::CreateVideoTrack(
 	}
 	else
 	{
-		rtc::scoped_refptr<webrtc::VideoTrackSourceInterface> videoSource = peer_connection_factory_->CreateVideoSource(std::move(capturer), NULL);
-		video_track = peer_connection_factory_->CreateVideoTrack(kVideoLabel, videoSource);
+		rtc::scoped_refptr<webrtc::VideoTrackSourceInterface> videoSource = shard->factory()->CreateVideoSource(std::move(capturer), NULL);
+		video_track = shard->factory()->CreateVideoTrack(kVideoLabel, videoSource);
+
+		// resolution and frame rate cap of the stream
+		std::string height;
+		std::string fps;
+		CivetServer::getParam(options, "height", height);
+		CivetServer::getParam(options, "fps", fps);
+		if ( (video_track) && ( (!height.empty()) || (!fps.empty()) ) )
+		{
+			rtc::scoped_refptr<TierVideoSource> cappedSource = TierVideoSource::Create(video_track, height.empty() ? 0 : std::stoi(height), fps.empty() ? 0 : std::stoi(fps));
+			video_track = shard->factory()->CreateVideoTrack(kVideoLabel + std::string("_capped"), cappedSource);
+		}
 	}
 	return video_track;
 }
@@ -869,69 +1808,189 @@ PeerConnectionManager::CreateVideoTrack(
 
 rtc::scoped_refptr<webrtc::AudioTrackInterface>
 PeerConnectionManager::CreateAudioTrack(
+	FactoryShard* shard,
 	const std::string &audiourl,
-	const std::string &options)
+	const std::string &options,
+	std::vector<PausableSource*> & sources)
 {
 	RTC_LOG(INFO) << "audiourl:" << audiourl << " options:" << options;
 
 	rtc::scoped_refptr<webrtc::AudioTrackInterface> audio_track;
-	// nothing here, since we don't need audio for now
+#ifdef HAVE_LIVE555
+	if (audiourl.find("rtsp://") == 0)
+	{
+		int timeout = 10;
+		std::string tmp;
+		if (CivetServer::getParam(options, "timeout", tmp)) {
+			timeout = std::stoi(tmp);
+		}
+		std::string rtptransport;
+		CivetServer::getParam(options, "rtptransport", rtptransport);
+
+		// Opus is forwarded without transcoding unless audiopassthrough=0
+		OpusPacketStore* opusStore = audioEncoderfactory_->store();
+		if (CivetServer::getParam(options, "audiopassthrough", tmp) && (tmp == "0")) {
+			opusStore = NULL;
+		}
+
+		// same url as the video share the RTSP session
+		rtc::scoped_refptr<RTSPAudioSource> audioSource(RTSPAudioSource::Create(*rtspSessionManager_, audioDecoderfactory_, opusStore, audiourl, timeout, rtptransport));
+		sources.push_back(audioSource.get());
+		audio_track = shard->factory()->CreateAudioTrack(kAudioLabel, audioSource);
+	}
+#endif
+	// nothing for other sources, since we don't need audio for now
 	return audio_track;
 }
   
+/* ---------------------------------------------------------------------------
+**  Create a stream with the factory of a shard (signaling thread)
+** -------------------------------------------------------------------------*/
+bool
+PeerConnectionManager::createStream(
+	FactoryShard* shard,
+	const std::string &streamLabel,
+	const std::string &videourl,
+	const std::string &audiourl,
+	const std::string &options)
+{
+	bool ret = false;
+	std::map<std::string, FactoryShard::StreamEntry> & streams = shard->streams();
+	std::vector<PausableSource*> sources;
+	std::shared_ptr<SourceMetrics> metrics = std::make_shared<SourceMetrics>();
+	rtc::scoped_refptr<webrtc::VideoTrackInterface> video_track(this->CreateVideoTrack(shard, videourl, options, sources, metrics));
+
+	// quality tiers scaled from the video track
+	std::shared_ptr<VideoTiers> videoTiers;
+	std::string tierConfig;
+	if ( (video_track) && (CivetServer::getParam(options, "tiers", tierConfig)) ) {
+		std::vector<VideoTiers::Tier> tiers = VideoTiers::parse(tierConfig);
+		for (VideoTiers::Tier & tier : tiers) {
+			rtc::scoped_refptr<TierVideoSource> tierSource = TierVideoSource::Create(video_track, tier.height);
+			tier.track = shard->factory()->CreateVideoTrack(kVideoLabel + std::string("_") + std::to_string(tier.height), tierSource);
+		}
+		if (!tiers.empty()) {
+			videoTiers = std::make_shared<VideoTiers>(tiers);
+			video_track = tiers.front().track;
+		}
+	}
+	rtc::scoped_refptr<webrtc::AudioTrackInterface> audio_track;
+	if (!audiourl.empty()) {
+		audio_track = this->CreateAudioTrack(shard, audiourl, options, sources);
+	}
+	rtc::scoped_refptr<webrtc::MediaStreamInterface> stream = shard->factory()->CreateLocalMediaStream(streamLabel);
+	if (!stream.get())
+	{
+		RTC_LOG(LS_ERROR) << "Cannot create stream";
+	}
+	else
+	{
+		if ( (video_track) && (!stream->AddTrack(video_track)) )
+		{
+			RTC_LOG(LS_ERROR) << "Adding VideoTrack to MediaStream failed";
+		} 
+
+		if ( (audio_track) && (!stream->AddTrack(audio_track)) )
+		{
+			RTC_LOG(LS_ERROR) << "Adding AudioTrack to MediaStream failed";
+		} 
+
+		RTC_LOG(INFO) << "Adding Stream to map";
+		FactoryShard::StreamEntry & entry = streams[streamLabel];
+		entry.stream = stream;
+		entry.tiers = videoTiers;
+		entry.viewers = 0;
+		entry.sources = sources;
+		entry.lingerMs = lingerMs_;
+		entry.idleSinceMs = 0;
+		entry.warm = false;
+		entry.paused = false;
+		entry.metrics = metrics;
+		if (video_track)
+		{
+			entry.frameCounter = std::make_shared<FrameCounter>(video_track);
+		}
+		std::string linger;
+		if (CivetServer::getParam(options, "linger", linger)) {
+			entry.lingerMs = std::stoi(linger);
+		}
+		ret = true;
+	}
+	return ret;
+}
+
 /* ---------------------------------------------------------------------------
 **  Add a stream to a PeerConnection
 ** -------------------------------------------------------------------------*/
 bool
 PeerConnectionManager::AddStream(
-	webrtc::PeerConnectionInterface* peer_connection,
+	PeerConnectionObserver* peerConnectionObserver,
 	const std::string &videourl,
 	const std::string &audiourl,
 	const std::string &options)
 {
 	bool ret = false;
+	FactoryShard* shard = peerConnectionObserver->getShard();
+	rtc::scoped_refptr<webrtc::PeerConnectionInterface> peer_connection = peerConnectionObserver->getPeerConnection();
 
 	std::string pipename = videourl;
 	std::string audio = audiourl;
 		
-	// compute stream label removing space because SDP use label
-	std::string streamLabel = pipename;
-	streamLabel.erase(std::remove_if(streamLabel.begin(), streamLabel.end(), isspace), streamLabel.end());
+	// streams are created by the factory of the shard
+	std::string streamLabel = getStreamLabel(pipename, audio);
+	std::map<std::string, FactoryShard::StreamEntry> & streams = shard->streams();
 
-	std::map<std::string, rtc::scoped_refptr<webrtc::MediaStreamInterface> >::iterator it = stream_map_.find(streamLabel);
-	if (it == stream_map_.end())
+	std::map<std::string, FactoryShard::StreamEntry>::iterator it = streams.find(streamLabel);
+	if (it == streams.end())
 	{
-		// need to create the stream
-		rtc::scoped_refptr<webrtc::VideoTrackInterface> video_track(this->CreateVideoTrack(pipename, options));
-		rtc::scoped_refptr<webrtc::MediaStreamInterface> stream = peer_connection_factory_->CreateLocalMediaStream(streamLabel);
-		if (!stream.get())
-		{
-			RTC_LOG(LS_ERROR) << "Cannot create stream";
-		}
-		else
-		{
-			if ( (video_track) && (!stream->AddTrack(video_track)) )
-			{
-				RTC_LOG(LS_ERROR) << "Adding VideoTrack to MediaStream failed";
-			} 
-
-			RTC_LOG(INFO) << "Adding Stream to map";
-			stream_map_[streamLabel] = stream;
-		}
+		this->createStream(shard, streamLabel, pipename, audio, options);
 	}
 
-
-	it = stream_map_.find(streamLabel);
-	if (it != stream_map_.end())
+	it = streams.find(streamLabel);
+	if (it != streams.end())
 	{
-		if (!peer_connection->AddStream(it->second))
+		if (!peer_connection->AddStream(it->second.stream))
 		{
 			RTC_LOG(LS_ERROR) << "Adding stream to PeerConnection failed";
+			if ( (it->second.viewers == 0) && (!it->second.paused) )
+			{
+				streams.erase(it);
+			}
 		}
 		else
 		{
 			RTC_LOG(INFO) << "stream added to PeerConnection";
 			ret = true;
+
+			// one more viewer, released when the PeerConnection is closed
+			shard->acquireStream(streamLabel);
+			peerConnectionObserver->setStreamLabel(streamLabel);
+
+			// priority of the stream and max bitrate of the call for the egress budget
+			std::string tmp;
+			double weight = 1;
+			if (CivetServer::getParam(options, "priority", tmp))
+			{
+				weight = std::max(atof(tmp.c_str()), 0.01);
+			}
+			int maxKbps = 0;
+			if (CivetServer::getParam(options, "bitrate", tmp))
+			{
+				maxKbps = atoi(tmp.c_str()) * 2 / 1000;
+			}
+			peerConnectionObserver->setEgressLimits(weight, maxKbps);
+
+			// the tier sent is chosen from the bandwidth estimation
+			if (it->second.tiers)
+			{
+				for (rtc::scoped_refptr<webrtc::RtpSenderInterface> sender : peer_connection->GetSenders())
+				{
+					if (sender->media_type() == cricket::MEDIA_TYPE_VIDEO)
+					{
+						peerConnectionObserver->setTierSelector(VideoTierSelector::Create(it->second.tiers, sender));
+					}
+				}
+			}
 		}
 	}
 	else
@@ -942,6 +2001,49 @@ PeerConnectionManager::AddStream(
 	return ret;
 }
 
+/* ---------------------------------------------------------------------------
+**  cache the local description for the snapshot (signaling thread of the peer)
+** -------------------------------------------------------------------------*/
+void PeerConnectionManager::PeerConnectionObserver::updateLocalDescription()
+{
+	Json::Value localDescription(Json::objectValue);
+	if ( (m_pc) && (m_pc->local_description()) )
+	{
+		std::string sdp;
+		m_pc->local_description()->ToString(&sdp);
+		localDescription["sdp"] = sdp;
+
+		Json::Value streams;
+		rtc::scoped_refptr<webrtc::StreamCollectionInterface> localstreams (m_pc->local_streams());
+		if (localstreams) {
+			for (unsigned int i = 0; i<localstreams->count(); i++) {
+				if (localstreams->at(i)) {
+					Json::Value tracks;
+
+					const webrtc::VideoTrackVector& videoTracks = localstreams->at(i)->GetVideoTracks();
+					for (unsigned int j=0; j<videoTracks.size() ; j++)
+					{
+						tracks[videoTracks.at(j)->kind()].append(videoTracks.at(j)->id());
+					}
+					const webrtc::AudioTrackVector& audioTracks = localstreams->at(i)->GetAudioTracks();
+					for (unsigned int j=0; j<audioTracks.size() ; j++)
+					{
+						tracks[audioTracks.at(j)->kind()].append(audioTracks.at(j)->id());
+					}
+
+					Json::Value stream;
+					stream[localstreams->at(i)->label()] = tracks;
+
+					streams.append(stream);
+				}
+			}
+		}
+		localDescription["streams"] = streams;
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_localDescription = localDescription;
+}
+
 /* ---------------------------------------------------------------------------
 **  ICE callback
 ** -------------------------------------------------------------------------*/
@@ -962,7 +2064,17 @@ void PeerConnectionManager::PeerConnectionObserver::OnIceCandidate(const webrtc:
 		jmessage[kCandidateSdpMidName] = candidate->sdp_mid();
 		jmessage[kCandidateSdpMlineIndexName] = candidate->sdp_mline_index();
 		jmessage[kCandidateSdpName] = sdp;
-		iceCandidateList_.append(jmessage);
+
+		IceCandidateListener listener;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			iceCandidateList_.append(jmessage);
+			listener = m_iceCandidateListener;
+		}
+		if (listener)
+		{
+			listener(jmessage);
+		}
 	}
 }
 
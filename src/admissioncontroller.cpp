@@ -0,0 +1,141 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** admissioncontroller.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+#include "rtc_base/logging.h"
+#include "rtc_base/timeutils.h"
+
+#include "CivetServer.h"
+#include "admissioncontroller.h"
+
+constexpr double AdmissionController::kDegradeRatio;
+
+AdmissionController::AdmissionController(const std::string & limits)
+	: m_maxPeers(0), m_maxPixelRate(0), m_maxEgressKbps(0), m_maxCpu(0), m_maxCallRate(0)
+	, m_pixelRate(0), m_egressKbps(0), m_cpu(0), m_lastCpuBusy(0), m_lastCpuTotal(0)
+{
+	std::string value;
+	if (CivetServer::getParam(limits, "peers", value)) {
+		m_maxPeers = std::stoi(value);
+	}
+	if (CivetServer::getParam(limits, "pixelrate", value)) {
+		m_maxPixelRate = std::stod(value);
+	}
+	if (CivetServer::getParam(limits, "egress", value)) {
+		m_maxEgressKbps = std::stoi(value);
+	}
+	if (CivetServer::getParam(limits, "cpu", value)) {
+		m_maxCpu = std::stoi(value);
+	}
+	if (CivetServer::getParam(limits, "callrate", value)) {
+		m_maxCallRate = std::stod(value);
+	}
+	RTC_LOG(INFO) << "AdmissionController peers:" << m_maxPeers << " pixelrate:" << m_maxPixelRate << " egress:" << m_maxEgressKbps << "kbps cpu:" << m_maxCpu << "% callrate:" << m_maxCallRate;
+}
+
+void AdmissionController::update(double pixelRate, int egressKbps)
+{
+	m_pixelRate = pixelRate;
+	m_egressKbps = egressKbps;
+	if (m_maxCpu > 0) {
+		m_cpu = (int)this->cpuLoad();
+	}
+
+	// forget the clients with a full bucket
+	std::lock_guard<std::mutex> lock(m_mutex);
+	int64_t now = rtc::TimeMillis();
+	for (std::map<std::string, Bucket>::iterator it = m_buckets.begin(); it != m_buckets.end(); ) {
+		if ( (now - it->second.lastMs) * m_maxCallRate / 1000 + it->second.tokens >= m_maxCallRate ) {
+			it = m_buckets.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+double AdmissionController::cpuLoad()
+{
+	// busy part of the time since the previous read
+	double load = m_cpu;
+	FILE* file = fopen("/proc/stat", "r");
+	if (file) {
+		unsigned long long user = 0, nice = 0, system = 0, idle = 0, iowait = 0, irq = 0, softirq = 0, steal = 0;
+		if (fscanf(file, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) >= 4) {
+			unsigned long long busy = user + nice + system + irq + softirq + steal;
+			unsigned long long total = busy + idle + iowait;
+			if ( (m_lastCpuTotal != 0) && (total > m_lastCpuTotal) ) {
+				load = 100.0 * (busy - m_lastCpuBusy) / (total - m_lastCpuTotal);
+			}
+			m_lastCpuBusy = busy;
+			m_lastCpuTotal = total;
+		}
+		fclose(file);
+	}
+	return load;
+}
+
+AdmissionController::Decision AdmissionController::admit(const std::string & clientIp, int peers, int & retryAfter, std::string & reason)
+{
+	Decision decision = Accept;
+	retryAfter = 0;
+
+	// call rate of the client
+	if (m_maxCallRate > 0) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		int64_t now = rtc::TimeMillis();
+		std::map<std::string, Bucket>::iterator it = m_buckets.find(clientIp);
+		if (it == m_buckets.end()) {
+			Bucket bucket;
+			bucket.tokens = std::max(m_maxCallRate, 1.0);
+			bucket.lastMs = now;
+			it = m_buckets.insert(std::make_pair(clientIp, bucket)).first;
+		}
+		Bucket & bucket = it->second;
+		bucket.tokens = std::min(std::max(m_maxCallRate, 1.0), bucket.tokens + (now - bucket.lastMs) * m_maxCallRate / 1000);
+		bucket.lastMs = now;
+		if (bucket.tokens < 1) {
+			retryAfter = (int)ceil((1 - bucket.tokens) / m_maxCallRate);
+			reason = "too many calls from " + clientIp;
+			return Reject;
+		}
+		bucket.tokens -= 1;
+	}
+
+	// load of the server, the ratio of the most used resource
+	double ratio = 0;
+	std::string resource;
+	if ( (m_maxPeers > 0) && ((peers + 1.0) / m_maxPeers > ratio) ) {
+		ratio = (peers + 1.0) / m_maxPeers;
+		resource = "peers";
+	}
+	if ( (m_maxPixelRate > 0) && (m_pixelRate / m_maxPixelRate > ratio) ) {
+		ratio = m_pixelRate / m_maxPixelRate;
+		resource = "pixel rate";
+	}
+	if ( (m_maxEgressKbps > 0) && ((double)m_egressKbps / m_maxEgressKbps > ratio) ) {
+		ratio = (double)m_egressKbps / m_maxEgressKbps;
+		resource = "egress bandwidth";
+	}
+	if ( (m_maxCpu > 0) && ((double)m_cpu / m_maxCpu > ratio) ) {
+		ratio = (double)m_cpu / m_maxCpu;
+		resource = "cpu";
+	}
+	if (ratio > 1) {
+		decision = Reject;
+		retryAfter = kRetryAfter;
+		reason = "overloaded " + resource;
+	} else if (ratio > kDegradeRatio) {
+		decision = Degrade;
+		reason = "degraded " + resource;
+	}
+	return decision;
+}
@@ -0,0 +1,127 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** asynclog.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include <stdio.h>
+
+#include <chrono>
+#include <algorithm>
+
+#include "asynclog.h"
+
+AsyncLogSink* AsyncLogSink::s_instance = NULL;
+
+AsyncLogSink::AsyncLogSink(size_t capacity, int flushPeriodMs)
+	: m_flushPeriodMs(flushPeriodMs)
+	, m_ring(capacity)
+	, m_pending(0)
+	, m_streams{ Stream(this, 0), Stream(this, 1) }
+	, m_active(-1)
+	, m_severity(rtc::LS_NONE)
+	, m_dropped(0)
+	, m_running(true)
+{
+	m_thread = std::thread(&AsyncLogSink::run, this);
+	s_instance = this;
+}
+
+AsyncLogSink::~AsyncLogSink()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_severityMutex);
+		int active = m_active;
+		if (active >= 0) {
+			rtc::LogMessage::RemoveLogToStream(&m_streams[active]);
+		}
+		m_active = -1;
+	}
+	s_instance = NULL;
+	m_running = false;
+	m_thread.join();
+}
+
+void AsyncLogSink::setSeverity(rtc::LoggingSeverity severity)
+{
+	// the new stream is added before the previous one is removed, no message is lost
+	std::lock_guard<std::mutex> lock(m_severityMutex);
+	int previous = m_active;
+	int next = (previous == 0) ? 1 : 0;
+	rtc::LogMessage::AddLogToStream(&m_streams[next], severity);
+	m_active = next;
+	m_severity = severity;
+	if (previous >= 0) {
+		rtc::LogMessage::RemoveLogToStream(&m_streams[previous]);
+	}
+}
+
+void AsyncLogSink::Stream::OnLogMessage(const std::string& message)
+{
+	// while both streams are added, the message is written once
+	if (m_owner->m_active == m_index) {
+		m_owner->write(message);
+	}
+}
+
+void AsyncLogSink::write(const std::string& message)
+{
+	// rtc::LogMessage already calls the streams one at a time, the lock is not contended
+	std::lock_guard<std::mutex> lock(m_writeMutex);
+	uint32_t length = std::min(message.size(), m_ring.capacity()/2);
+	size_t space = m_ring.capacity() - m_ring.available();
+	if (space < sizeof(length) + length) {
+		m_dropped++;
+		return;
+	}
+	m_ring.write((const char*)&length, sizeof(length));
+	m_ring.write(message.c_str(), length);
+}
+
+void AsyncLogSink::drain(std::string & out)
+{
+	// the header and the message are written one after the other, a message not complete is read at the next drain
+	for (;;) {
+		if (m_pending == 0) {
+			if (m_ring.available() < sizeof(m_pending)) {
+				break;
+			}
+			m_ring.read((char*)&m_pending, sizeof(m_pending));
+		}
+		if (m_ring.available() < m_pending) {
+			break;
+		}
+		size_t offset = out.size();
+		out.resize(offset + m_pending);
+		m_ring.read(&out[offset], m_pending);
+		m_pending = 0;
+	}
+}
+
+void AsyncLogSink::run()
+{
+	std::string out;
+	uint64_t reported = 0;
+	bool running = true;
+	while (running) {
+		running = m_running;
+		if (running) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(m_flushPeriodMs));
+		}
+
+		out.clear();
+		this->drain(out);
+		uint64_t dropped = m_dropped;
+		if (dropped != reported) {
+			out += "AsyncLogSink dropped:" + std::to_string(dropped - reported) + " messages\n";
+			reported = dropped;
+		}
+		if (!out.empty()) {
+			fwrite(out.c_str(), 1, out.size(), stderr);
+			fflush(stderr);
+		}
+	}
+}
@@ -0,0 +1,67 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** certificatepool.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include "rtc_base/logging.h"
+#include "rtc_base/rtccertificategenerator.h"
+
+#include "certificatepool.h"
+
+CertificatePool::CertificatePool(size_t size, int rotationMs)
+	: m_size(size), m_rotationMs(rotationMs), m_thread(rtc::Thread::Create()), m_next(0)
+{
+	m_thread->SetName("certificates", NULL);
+	m_thread->Start();
+	m_thread->Post(RTC_FROM_HERE, this);
+}
+
+CertificatePool::~CertificatePool()
+{
+	m_thread->Clear(this);
+	m_thread->Stop();
+}
+
+rtc::scoped_refptr<rtc::RTCCertificate> CertificatePool::get()
+{
+	rtc::scoped_refptr<rtc::RTCCertificate> certificate;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_certificates.empty())
+	{
+		certificate = m_certificates.at(m_next++ % m_certificates.size());
+	}
+	return certificate;
+}
+
+void CertificatePool::OnMessage(rtc::Message* msg)
+{
+	// valid for the peers created until the certificate leaves the pool
+	uint64_t expiresMs = 2 * m_size * m_rotationMs;
+	rtc::scoped_refptr<rtc::RTCCertificate> certificate = rtc::RTCCertificateGenerator::GenerateCertificate(rtc::KeyParams::ECDSA(rtc::EC_NIST_P256), rtc::Optional<uint64_t>(expiresMs));
+
+	// fill the pool, then replace the oldest certificate at each period
+	int delayMs = m_rotationMs;
+	if (!certificate)
+	{
+		RTC_LOG(LS_ERROR) << "CertificatePool cannot generate certificate";
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_certificates.push_back(certificate);
+		if (m_certificates.size() > m_size)
+		{
+			m_certificates.pop_front();
+		}
+		if (m_certificates.size() < m_size)
+		{
+			delayMs = 0;
+		}
+		RTC_LOG(INFO) << "CertificatePool certificates:" << m_certificates.size();
+	}
+	m_thread->PostDelayed(RTC_FROM_HERE, delayMs, this);
+}
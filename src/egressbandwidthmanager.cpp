@@ -0,0 +1,135 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** egressbandwidthmanager.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include "rtc_base/logging.h"
+
+#include "egressbandwidthmanager.h"
+
+const int EgressBandwidthManager::kMinKbps;
+
+int EgressBandwidthManager::demandKbps(const Peer & peer)
+{
+	int demand = (peer.maxKbps > 0) ? peer.maxKbps : kDefaultMaxKbps;
+
+	// a congested link gives back a part of what it sends
+	int sentKbps = peer.meter->bitrateKbps();
+	if ( (peer.meter->lossRatio() > kLossThreshold) && (sentKbps > 0) )
+	{
+		demand = std::min(demand, (int)(sentKbps * kBackoff));
+	}
+	// above the bandwidth estimation, keep a margin to let it grow
+	int availableKbps = peer.meter->availableKbps();
+	if (availableKbps > 0)
+	{
+		demand = std::min(demand, availableKbps * 5 / 4);
+	}
+	return std::max(demand, kMinKbps);
+}
+
+void EgressBandwidthManager::allocate(const std::map<std::string, Peer> & peers)
+{
+	// a shared encoder follows its best link, its group asks the best demand for each of its peers
+	std::map<std::string, std::vector<std::string>> groups;
+	for (auto & it : peers)
+	{
+		groups[it.second.group.empty() ? "peer:" + it.first : "group:" + it.second.group].push_back(it.first);
+	}
+	std::map<std::string, double> weights;
+	std::map<std::string, int> unsatisfied;
+	for (auto & group : groups)
+	{
+		int demand = 0;
+		double weight = 0;
+		for (const std::string & peerid : group.second)
+		{
+			demand = std::max(demand, this->demandKbps(peers.at(peerid)));
+			weight += peers.at(peerid).weight;
+		}
+		unsatisfied[group.first] = demand * group.second.size();
+		weights[group.first] = weight;
+	}
+
+	// weighted max-min share : the groups that need less than their share are satisfied first
+	std::map<std::string, int> groupAllocation;
+	double remaining = m_budgetKbps;
+	while (!unsatisfied.empty())
+	{
+		double totalWeight = 0;
+		for (auto & it : unsatisfied)
+		{
+			totalWeight += weights[it.first];
+		}
+		bool satisfied = false;
+		for (auto it = unsatisfied.begin(); it != unsatisfied.end(); )
+		{
+			double share = remaining * weights[it->first] / totalWeight;
+			if (it->second <= share)
+			{
+				groupAllocation[it->first] = it->second;
+				remaining -= it->second;
+				satisfied = true;
+				it = unsatisfied.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+		if (!satisfied)
+		{
+			for (auto & it : unsatisfied)
+			{
+				groupAllocation[it.first] = (int)(remaining * weights[it.first] / totalWeight);
+			}
+			unsatisfied.clear();
+		}
+	}
+
+	// the peers of a group get the same limit
+	std::map<std::string, int> allocation;
+	for (auto & group : groups)
+	{
+		int limit = std::max(groupAllocation[group.first] / (int)group.second.size(), kMinKbps);
+		for (const std::string & peerid : group.second)
+		{
+			allocation[peerid] = limit;
+		}
+	}
+
+	// the current bitrate is not given, the congestion controller keeps its estimation
+	std::map<std::string, int> allocated;
+	for (auto & it : allocation)
+	{
+		int previous = this->allocatedKbps(it.first);
+		if ( (previous == 0) || (std::fabs(it.second - previous) > previous * kHysteresis) )
+		{
+			RTC_LOG(INFO) << "EgressBandwidthManager peerid:" << it.first << " max:" << it.second << "kbps weight:" << peers.at(it.first).weight;
+			webrtc::PeerConnectionInterface::BitrateParameters bitrateParam;
+			bitrateParam.min_bitrate_bps = rtc::Optional<int>(std::min(it.second, kMinKbps) * 1000);
+			bitrateParam.max_bitrate_bps = rtc::Optional<int>(it.second * 1000);
+			peers.at(it.first).peerConnection->SetBitrate(bitrateParam);
+			allocated[it.first] = it.second;
+		}
+		else
+		{
+			allocated[it.first] = previous;
+		}
+	}
+	m_allocated.swap(allocated);
+}
+
+int EgressBandwidthManager::allocatedKbps(const std::string & peerid)
+{
+	std::map<std::string, int>::iterator it = m_allocated.find(peerid);
+	return (it != m_allocated.end()) ? it->second : 0;
+}
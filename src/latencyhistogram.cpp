@@ -0,0 +1,103 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** latencyhistogram.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include <algorithm>
+
+#include "latencyhistogram.h"
+
+LatencyHistogram::LatencyHistogram() : m_max(0)
+{
+	for (std::atomic<uint64_t> & count : m_counts)
+	{
+		count.store(0, std::memory_order_relaxed);
+	}
+}
+
+size_t LatencyHistogram::index(uint64_t value)
+{
+	size_t idx = value;
+	if (value >= kSub)
+	{
+		// the highest bit gives the power of two, the next bits the sub-bucket
+		int exponent = 63 - __builtin_clzll(value);
+		idx = (exponent - kSubBits + 1) * kSub + ((value >> (exponent - kSubBits)) & (kSub - 1));
+	}
+	return std::min(idx, kBuckets - 1);
+}
+
+uint64_t LatencyHistogram::upperBound(size_t index)
+{
+	uint64_t bound = index;
+	if (index >= kSub)
+	{
+		int exponent = index / kSub + kSubBits - 1;
+		uint64_t lower = (uint64_t)(kSub + index % kSub) << (exponent - kSubBits);
+		bound = lower + ((uint64_t)1 << (exponent - kSubBits)) - 1;
+	}
+	return bound;
+}
+
+void LatencyHistogram::record(int64_t durationUs)
+{
+	uint64_t value = (durationUs > 0) ? durationUs : 0;
+	m_counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t max = m_max.load(std::memory_order_relaxed);
+	while ( (value > max) && (!m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) )
+	{
+	}
+}
+
+void LatencyHistogram::add(const LatencyHistogram & other)
+{
+	for (size_t i = 0; i < kBuckets; ++i)
+	{
+		m_counts[i].fetch_add(other.m_counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	uint64_t value = other.m_max.load(std::memory_order_relaxed);
+	uint64_t max = m_max.load(std::memory_order_relaxed);
+	while ( (value > max) && (!m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) )
+	{
+	}
+}
+
+Json::Value LatencyHistogram::summary() const
+{
+	// read while recording goes on, the total is the sum of the buckets read
+	uint64_t counts[kBuckets];
+	uint64_t total = 0;
+	for (size_t i = 0; i < kBuckets; ++i)
+	{
+		counts[i] = m_counts[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+	uint64_t max = m_max.load(std::memory_order_relaxed);
+
+	Json::Value value;
+	value["count"] = (Json::UInt64)total;
+	const std::pair<const char*, double> percentiles[] = { {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99} };
+	for (const auto & percentile : percentiles)
+	{
+		uint64_t rank = (uint64_t)(total * percentile.second);
+		uint64_t cumulated = 0;
+		uint64_t bound = 0;
+		for (size_t i = 0; i < kBuckets; ++i)
+		{
+			cumulated += counts[i];
+			if ( (counts[i] != 0) && (cumulated > rank) )
+			{
+				bound = std::min(upperBound(i), max);
+				break;
+			}
+		}
+		value[percentile.first] = (Json::UInt64)bound;
+	}
+	value["max"] = (Json::UInt64)max;
+	return value;
+}
@@ -0,0 +1,119 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** loadmonitor.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include "api/stats/rtcstats_objects.h"
+#include "rtc_base/timeutils.h"
+
+#include "loadmonitor.h"
+
+/* ---------------------------------------------------------------------------
+**  FrameCounter
+** -------------------------------------------------------------------------*/
+FrameCounter::FrameCounter(rtc::scoped_refptr<webrtc::VideoTrackInterface> track)
+	: m_track(track), m_frames(0), m_pixels(0), m_lastFrames(0), m_lastPixels(0), m_lastSampleUs(rtc::TimeMicros())
+{
+	m_track->AddOrUpdateSink(this, rtc::VideoSinkWants());
+}
+
+FrameCounter::~FrameCounter()
+{
+	m_track->RemoveSink(this);
+}
+
+void FrameCounter::OnFrame(const webrtc::VideoFrame& frame)
+{
+	m_frames++;
+	m_pixels += frame.width() * frame.height();
+}
+
+void FrameCounter::sample(double & fps, double & pixelRate)
+{
+	int64_t now = rtc::TimeMicros();
+	uint64_t frames = m_frames;
+	uint64_t pixels = m_pixels;
+	double elapsed = (now - m_lastSampleUs) / (double)rtc::kNumMicrosecsPerSec;
+	fps = 0;
+	pixelRate = 0;
+	if (elapsed > 0)
+	{
+		fps = (frames - m_lastFrames) / elapsed;
+		pixelRate = (pixels - m_lastPixels) / elapsed;
+	}
+	m_lastFrames = frames;
+	m_lastPixels = pixels;
+	m_lastSampleUs = now;
+}
+
+/* ---------------------------------------------------------------------------
+**  BitrateMeter
+** -------------------------------------------------------------------------*/
+void BitrateMeter::OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report)
+{
+	uint64_t bytes = 0;
+	uint64_t packets = 0;
+	uint64_t nacks = 0;
+	uint64_t frames = 0;
+	uint64_t qpSum = 0;
+	for (const webrtc::RTCOutboundRTPStreamStats* stream : report->GetStatsOfType<webrtc::RTCOutboundRTPStreamStats>())
+	{
+		if (stream->bytes_sent.is_defined())
+		{
+			bytes += *stream->bytes_sent;
+		}
+		if (stream->packets_sent.is_defined())
+		{
+			packets += *stream->packets_sent;
+		}
+		if (stream->nack_count.is_defined())
+		{
+			nacks += *stream->nack_count;
+		}
+		if ( (stream->frames_encoded.is_defined()) && (stream->qp_sum.is_defined()) )
+		{
+			frames += *stream->frames_encoded;
+			qpSum += *stream->qp_sum;
+		}
+	}
+	for (const webrtc::RTCIceCandidatePairStats* pair : report->GetStatsOfType<webrtc::RTCIceCandidatePairStats>())
+	{
+		if ( (pair->nominated.is_defined()) && (*pair->nominated) )
+		{
+			if (pair->available_outgoing_bitrate.is_defined())
+			{
+				m_availableKbps = (int)(*pair->available_outgoing_bitrate / 1000);
+			}
+			if (pair->current_round_trip_time.is_defined())
+			{
+				m_rttMs = (int)(*pair->current_round_trip_time * 1000);
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if ( (packets > m_lastPackets) && (nacks >= m_lastNacks) )
+	{
+		m_lossRatio = (double)(nacks - m_lastNacks) / (packets - m_lastPackets);
+	}
+	m_lastPackets = packets;
+	m_lastNacks = nacks;
+	int64_t timestampUs = report->timestamp_us();
+	if ( (m_lastTimestampUs != 0) && (timestampUs > m_lastTimestampUs) && (bytes >= m_lastBytes) )
+	{
+		m_bitrateKbps = (int)((bytes - m_lastBytes) * 8 * 1000 / (timestampUs - m_lastTimestampUs));
+	}
+	if ( (m_lastTimestampUs != 0) && (timestampUs > m_lastTimestampUs) && (frames >= m_lastFrames) && (qpSum >= m_lastQpSum) )
+	{
+		m_encodeFps = (double)(frames - m_lastFrames) * 1000000 / (timestampUs - m_lastTimestampUs);
+		m_qp = (frames > m_lastFrames) ? (double)(qpSum - m_lastQpSum) / (frames - m_lastFrames) : 0;
+	}
+	m_lastFrames = frames;
+	m_lastQpSum = qpSum;
+	m_lastBytes = bytes;
+	m_lastTimestampUs = timestampUs;
+}
@@ -8,6 +8,9 @@
 ** -------------------------------------------------------------------------*/
 
 #include <iostream>
+#include <sstream>
+#include <climits>
+#include <cerrno>
 
 #include "rtc_base/ssladapter.h"
 #include "rtc_base/thread.h"
@@ -15,6 +18,50 @@
 
 #include "PeerConnectionManager.h"
 #include "HttpServerRequestHandler.h"
+#include "tracecapture.h"
+#include "asynclog.h"
+
+/* ---------------------------------------------------------------------------
+**  check the limits of the admission control : known names and positive numbers
+** -------------------------------------------------------------------------*/
+static bool checkAdmissionLimits(const std::string & limits)
+{
+	std::istringstream is(limits);
+	std::string limit;
+	while (std::getline(is, limit, '&'))
+	{
+		size_t pos = limit.find('=');
+		if (pos == std::string::npos)
+		{
+			return false;
+		}
+		std::string name = limit.substr(0, pos);
+		std::string value = limit.substr(pos+1);
+		char* end = NULL;
+		errno = 0;
+		if ( (name == "peers") || (name == "egress") || (name == "cpu") )
+		{
+			long number = strtol(value.c_str(), &end, 10);
+			if ( (value.empty()) || (*end != '\0') || (errno == ERANGE) || (number < 0) || (number > INT_MAX) )
+			{
+				return false;
+			}
+		}
+		else if ( (name == "pixelrate") || (name == "callrate") )
+		{
+			double number = strtod(value.c_str(), &end);
+			if ( (value.empty()) || (*end != '\0') || (errno == ERANGE) || (!(number >= 0)) )
+			{
+				return false;
+			}
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return true;
+}
 
 /* ---------------------------------------------------------------------------
 **  main
@@ -28,9 +75,9 @@ int main(int argc, char* argv[])
 	int logLevel              = rtc::LERROR;
 	const char* webroot       = "./html";
 	std::string sslCertificate;
-	webrtc::AudioDeviceModule::AudioLayer audioLayer = webrtc::AudioDeviceModule::kDummyAudio;
 	std::string streamName;
-	std::map<std::string,std::string> urlList;
+	int nbHttpThreads = 50;
+	PeerConnectionManager::Options webRtcOptions;
 
 	std::string httpAddress("0.0.0.0:");
 	std::string httpPort = "8000";
@@ -42,7 +89,7 @@ int main(int argc, char* argv[])
 	httpAddress.append(httpPort);
 
 	int c = 0;
-	while ((c = getopt (argc, argv, "hVv::" "c:H:w:" "t:S::s::" "a::n:u:")) != -1)
+	while ((c = getopt (argc, argv, "hVv::" "c:H:w:" "t:S::s::" "a::n:u:" "R:r:T:N:F:P:E" "L:W:C:" "K:G" "I:U:" "A:B:" "Y:")) != -1)
 	{
 		switch (c)
 		{
@@ -54,15 +101,67 @@ int main(int argc, char* argv[])
 			case 'S': localstunurl = optarg ? optarg : defaultlocalstunurl; stunurl = localstunurl; break;
 			case 's': localstunurl = NULL; if (optarg) stunurl = optarg; break;
 			
-			case 'a': audioLayer = optarg ? (webrtc::AudioDeviceModule::AudioLayer)atoi(optarg) : webrtc::AudioDeviceModule::kDummyAudio; break;
+			case 'a': webRtcOptions.audioLayer = optarg ? (webrtc::AudioDeviceModule::AudioLayer)atoi(optarg) : webrtc::AudioDeviceModule::kDummyAudio; break;
 			case 'n': streamName = optarg; break;
 			case 'u': {
 				if (!streamName.empty()) {
-					urlList[streamName]=optarg;
+					webRtcOptions.urlList[streamName]=optarg;
 					streamName.clear();
 				}
 			}
 			break;
+			case 'R': webRtcOptions.nbRtspSchedulers = atoi(optarg); break;
+			case 'r': {
+				// nb alone or nb:minms:maxms, nothing after
+				char extra = 0;
+				int count = sscanf(optarg, "%d:%d:%d%c", &webRtcOptions.maxRtspReconnects, &webRtcOptions.minRtspReconnectDelayMs, &webRtcOptions.maxRtspReconnectDelayMs, &extra);
+				if ( (count == 1) && (sscanf(optarg, "%d%c", &webRtcOptions.maxRtspReconnects, &extra) != 1) ) {
+					count = 0;
+				}
+				if ( ( (count != 1) && (count != 3) ) || (webRtcOptions.maxRtspReconnects <= 0) || (webRtcOptions.minRtspReconnectDelayMs <= 0) || (webRtcOptions.maxRtspReconnectDelayMs < webRtcOptions.minRtspReconnectDelayMs) ) {
+					std::cerr << argv[0] << ": invalid RTSP reconnection '" << optarg << "', usage: -r nb[:minms:maxms] with nb > 0 and 0 < minms <= maxms" << std::endl;
+					exit(1);
+				}
+			}
+			break;
+			case 'T': webRtcOptions.signalingTimeoutMs = atoi(optarg); break;
+			case 'N': nbHttpThreads = atoi(optarg); break;
+			case 'F': webRtcOptions.nbFactoryShards = atoi(optarg); break;
+			case 'P': webRtcOptions.shardPolicy = optarg; break;
+			case 'E': webRtcOptions.sharedVideoEncoders = true; break;
+			case 'L': webRtcOptions.lingerMs = atoi(optarg); break;
+			case 'W': webRtcOptions.warmPoolSize = atoi(optarg); break;
+			case 'C': webRtcOptions.configFile = optarg; break;
+			case 'K': webRtcOptions.nbCertificates = atoi(optarg); break;
+			case 'G': webRtcOptions.gcmCiphers = true; break;
+			case 'I': webRtcOptions.iceCandidatePoolSize = atoi(optarg); break;
+			case 'U':
+				if ( (sscanf(optarg, "%d:%d", &webRtcOptions.minPort, &webRtcOptions.maxPort) != 2) || (webRtcOptions.minPort <= 0) || (webRtcOptions.maxPort < webRtcOptions.minPort) || (webRtcOptions.maxPort > 65535) ) {
+					std::cerr << argv[0] << ": invalid port range '" << optarg << "', usage: -U minport:maxport with 0 < minport <= maxport <= 65535" << std::endl;
+					exit(1);
+				}
+			break;
+			case 'A':
+				webRtcOptions.admissionLimits = optarg;
+				if (!checkAdmissionLimits(webRtcOptions.admissionLimits)) {
+					std::cerr << argv[0] << ": invalid limits '" << optarg << "', usage: -A name=value[&name=value...] with names peers, egress, cpu (integers) and pixelrate, callrate (numbers), all >= 0" << std::endl;
+					exit(1);
+				}
+			break;
+			case 'B': webRtcOptions.egressBudgetKbps = atoi(optarg); break;
+			case 'Y': {
+				// ms alone or ms:samples, nothing after
+				char extra = 0;
+				int count = sscanf(optarg, "%d:%d%c", &webRtcOptions.statsIntervalMs, &webRtcOptions.statsDepth, &extra);
+				if ( (count == 1) && (sscanf(optarg, "%d%c", &webRtcOptions.statsIntervalMs, &extra) != 1) ) {
+					count = 0;
+				}
+				if ( (count < 1) || (count > 2) || (webRtcOptions.statsIntervalMs < 0) || (webRtcOptions.statsDepth < 1) ) {
+					std::cerr << argv[0] << ": invalid statistics sampling '" << optarg << "', usage: -Y ms[:samples] with ms >= 0 (0 to disable) and samples > 0" << std::endl;
+					exit(1);
+				}
+			}
+			break;
 			
 			case 'v': 
 				logLevel--; 
@@ -87,8 +186,25 @@ int main(int argc, char* argv[])
 				std::cout << "\t -s[stun_address]   : use an external STUN server (default " << stunurl << ")"                    << std::endl;
 				std::cout << "\t -t[username:password@]turn_address : use an external TURN relay server (default disabled)"       << std::endl;
 
-				std::cout << "\t -a[audio layer]    : spefify audio capture layer to use (default:" << audioLayer << ")"          << std::endl;
+				std::cout << "\t -a[audio layer]    : spefify audio capture layer to use (default:" << webRtcOptions.audioLayer << ")"          << std::endl;
 				std::cout << "\t -n name -u url     : register a stream with name using url"                                      << std::endl;
+				std::cout << "\t -C config.json     : load the streams to register from a config file, reloaded when modified"   << std::endl;
+				std::cout << "\t -R nb              : number of threads shared by the RTSP sources (default " << webRtcOptions.nbRtspSchedulers << ")" << std::endl;
+				std::cout << "\t -r nb[:minms:maxms]: RTSP reconnections in progress at once and their backoff delays (default " << webRtcOptions.maxRtspReconnects << ":" << webRtcOptions.minRtspReconnectDelayMs << ":" << webRtcOptions.maxRtspReconnectDelayMs << ")" << std::endl;
+				std::cout << "\t -T timeout         : timeout in ms of the signaling steps of a call (default " << webRtcOptions.signalingTimeoutMs << ")" << std::endl;
+				std::cout << "\t -N nb              : number of HTTP threads (default " << nbHttpThreads << ")" << std::endl;
+				std::cout << "\t -F nb              : number of PeerConnectionFactory shards, each with its own threads (default " << webRtcOptions.nbFactoryShards << ")" << std::endl;
+				std::cout << "\t -P policy          : assign peers to shards by stream or roundrobin (default " << webRtcOptions.shardPolicy << ")" << std::endl;
+				std::cout << "\t -E                 : encode each stream once for all the viewers"                                 << std::endl;
+				std::cout << "\t -L linger          : time in ms a stream stays connected and paused without viewer (default " << webRtcOptions.lingerMs << ")" << std::endl;
+				std::cout << "\t -W nb              : maximum number of paused streams kept connected (default " << webRtcOptions.warmPoolSize << ")" << std::endl;
+				std::cout << "\t -K nb              : number of DTLS certificates generated in background, 0 to disable (default " << webRtcOptions.nbCertificates << ")" << std::endl;
+				std::cout << "\t -G                 : prefer AES-GCM SRTP ciphers"                                                 << std::endl;
+				std::cout << "\t -I nb              : number of ICE sessions gathered before the offer (default " << webRtcOptions.iceCandidatePoolSize << ")" << std::endl;
+				std::cout << "\t -U minport:maxport : range of the UDP ports used by ICE (default any)"                             << std::endl;
+				std::cout << "\t -A limits          : limits of the new calls like peers=500&pixelrate=100000000&egress=500000&cpu=90&callrate=2 (default none)" << std::endl;
+				std::cout << "\t -B kbps            : egress budget divided between the peers by the priority of their stream (default none)" << std::endl;
+				std::cout << "\t -Y ms[:samples]    : interval and history of the statistics sampled from the peers, 0 to disable (default " << webRtcOptions.statsIntervalMs << ":" << webRtcOptions.statsDepth << ")" << std::endl;
 			
 				std::cout << "\t [url]              : url to register in the source list"                                         << std::endl;
 			
@@ -101,20 +217,26 @@ int main(int argc, char* argv[])
 	while (optind<argc)
 	{
 		std::string url(argv[optind]);
-		urlList[url]=url;
+		webRtcOptions.urlList[url]=url;
 		optind++;
 	}
 
-	rtc::LogMessage::LogToDebug((rtc::LoggingSeverity)logLevel);
+	// the logs are written to stderr by a background thread
+	AsyncLogSink logSink;
+	rtc::LogMessage::LogToDebug(rtc::LS_NONE);
+	logSink.setSeverity((rtc::LoggingSeverity)logLevel);
 	rtc::LogMessage::LogTimestamps();
 	rtc::LogMessage::LogThreads();
-	std::cout << "Logger level:" <<  rtc::LogMessage::GetLogToDebug() << std::endl;
+	TraceCapture::install();
+	std::cout << "Logger level:" <<  logLevel << std::endl;
 
 	rtc::Thread* thread = rtc::Thread::Current();
 	rtc::InitializeSSL();
 
 	// webrtc server
-	PeerConnectionManager webRtcServer(stunurl, turnurl, audioLayer);
+	webRtcOptions.stunurl = stunurl;
+	webRtcOptions.turnurl = turnurl;
+	PeerConnectionManager webRtcServer(webRtcOptions);
 	if (!webRtcServer.InitializePeerConnection())
 	{
 		std::cout << "Cannot Initialize WebRTC server" << std::endl;
@@ -123,14 +245,16 @@ int main(int argc, char* argv[])
 	{
 		// http server
 		std::vector<std::string> options;
-		// options.push_back("num_threads");
-		// options.push_back("1");
+		options.push_back("num_threads");
+		options.push_back(std::to_string(nbHttpThreads));
 		options.push_back("document_root");
 		options.push_back(webroot);
 		options.push_back("access_control_allow_origin");
 		options.push_back("*");
 		options.push_back("listening_ports");
 		options.push_back(httpAddress);
+		options.push_back("enable_keep_alive");
+		options.push_back("yes");
 		if (!sslCertificate.empty()) {
 			options.push_back("ssl_certificate");
 			options.push_back(sslCertificate);
@@ -0,0 +1,91 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** metrics.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include <iomanip>
+
+#include "metrics.h"
+
+const char* SourceMetrics::stageName(Stage stage)
+{
+	static const char* names[kStageCount] = { "receive", "base64", "decode", "convert", "onframe" };
+	return names[stage];
+}
+
+Json::Value SourceMetrics::latency(const std::vector<std::shared_ptr<SourceMetrics>> & sources)
+{
+	Json::Value value(Json::objectValue);
+	for (int stage = 0; stage < kStageCount; ++stage)
+	{
+		LatencyHistogram merged;
+		for (auto & source : sources)
+		{
+			merged.add(source->m_latency[stage]);
+		}
+		Json::Value summary = merged.summary();
+		if (summary["count"].asUInt64() != 0)
+		{
+			value[stageName((Stage)stage)] = summary;
+		}
+	}
+	return value;
+}
+
+Json::Value Metrics::latency() const
+{
+	Json::Value value(Json::objectValue);
+	value["encode"] = m_encodeLatency.summary();
+	value["packetize"] = m_packetizeLatency.summary();
+	return value;
+}
+
+void Metrics::render(std::ostringstream & os) const
+{
+	header(os, "webrtcstreamer_signaling_seconds", "summary", "Time to handle a call, an offer or an answer");
+	sample(os, "webrtcstreamer_signaling_seconds_sum", "", m_signalingUs / 1e6);
+	sample(os, "webrtcstreamer_signaling_seconds_count", "", m_signalingRequests);
+
+	header(os, "webrtcstreamer_http_requests_total", "counter", "HTTP requests handled");
+	sample(os, "webrtcstreamer_http_requests_total", "", m_httpRequests);
+
+	header(os, "webrtcstreamer_http_requests_in_flight", "gauge", "HTTP requests being handled by the civetweb workers");
+	sample(os, "webrtcstreamer_http_requests_in_flight", "", m_httpInFlight);
+}
+
+void Metrics::header(std::ostringstream & os, const char* name, const char* type, const char* help)
+{
+	os << "# HELP " << name << " " << help << "\n";
+	os << "# TYPE " << name << " " << type << "\n";
+}
+
+void Metrics::sample(std::ostringstream & os, const char* name, const std::string & labels, double value)
+{
+	os << name;
+	if (!labels.empty())
+	{
+		os << "{" << labels << "}";
+	}
+	os << " " << std::setprecision(15) << value << "\n";
+}
+
+std::string Metrics::label(const char* name, const std::string & value)
+{
+	// escape as the text format expects
+	std::string escaped;
+	for (char c : value)
+	{
+		switch (c)
+		{
+			case '\\': escaped += "\\\\"; break;
+			case '"':  escaped += "\\\""; break;
+			case '\n': escaped += "\\n";  break;
+			default:   escaped += c;      break;
+		}
+	}
+	return std::string(name) + "=\"" + escaped + "\"";
+}
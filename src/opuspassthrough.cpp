@@ -0,0 +1,191 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** opuspassthrough.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include "rtc_base/logging.h"
+
+#include "opuspassthrough.h"
+
+// key written in the first samples of each channel : "OPPT" key checksum
+static const int16_t kTagMagic1  = 0x4f50;
+static const int16_t kTagMagic2  = 0x5054;
+static const size_t  kTagSamples = 5;
+
+/* ---------------------------------------------------------------------------
+**  OpusPacketStore
+** -------------------------------------------------------------------------*/
+uint32_t OpusPacketStore::addSource()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint32_t key = m_nextKey++;
+	m_histories[key];
+	return key;
+}
+
+void OpusPacketStore::removeSource(uint32_t key)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_histories.erase(key);
+}
+
+void OpusPacketStore::push(uint32_t key, const uint8_t* data, size_t size, int samples)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::map<uint32_t, History>::iterator it = m_histories.find(key);
+	if (it != m_histories.end()) {
+		// the readers only move their cursor, the history is bounded by its size
+		History & history = it->second;
+		if (history.packets.size() >= kMaxPackets) {
+			history.packets.pop_front();
+		}
+		history.packets.push_back(Packet());
+		history.packets.back().seq = history.nextSeq++;
+		history.packets.back().data.assign(data, data+size);
+		history.packets.back().samples = samples;
+	}
+}
+
+bool OpusPacketStore::read(uint32_t key, uint64_t* cursor, rtc::Buffer* encoded, int* samples)
+{
+	bool found = false;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::map<uint32_t, History>::iterator it = m_histories.find(key);
+	if ( (it != m_histories.end()) && (!it->second.packets.empty()) ) {
+		const std::deque<Packet> & packets = it->second.packets;
+		if (*cursor == 0) {
+			// a new reader starts from the packet of the current block
+			*cursor = packets.back().seq;
+		} else if (*cursor < packets.front().seq) {
+			// the reader is too late, the packets it missed are lost
+			*cursor = packets.front().seq;
+		}
+		if (*cursor < it->second.nextSeq) {
+			const Packet & packet = packets[*cursor - packets.front().seq];
+			encoded->AppendData(packet.data.data(), packet.data.size());
+			*samples = packet.samples;
+			(*cursor)++;
+			found = true;
+		}
+	}
+	return found;
+}
+
+int OpusPacketStore::sampleCount(const uint8_t* data, size_t size)
+{
+	if (size < 1) {
+		return 0;
+	}
+	// frame duration in samples at 48kHz from the TOC configuration
+	int config = data[0] >> 3;
+	int duration = 0;
+	if (config < 12) {
+		static const int silk[] = { 480, 960, 1920, 2880 };
+		duration = silk[config % 4];
+	} else if (config < 16) {
+		duration = (config % 2) ? 960 : 480;
+	} else {
+		static const int celt[] = { 120, 240, 480, 960 };
+		duration = celt[config % 4];
+	}
+	// number of frames in the packet
+	int frames = 0;
+	switch (data[0] & 0x3) {
+		case 0: frames = 1; break;
+		case 1:
+		case 2: frames = 2; break;
+		case 3: frames = (size > 1) ? (data[1] & 0x3f) : 0; break;
+	}
+	// a packet lasts at most 120ms
+	int samples = duration*frames;
+	return (samples <= 5760) ? samples : 0;
+}
+
+void OpusPacketStore::tag(int16_t* audio, size_t samplesPerChannel, size_t channels, uint32_t key)
+{
+	int16_t values[kTagSamples];
+	values[0] = kTagMagic1;
+	values[1] = kTagMagic2;
+	values[2] = (int16_t)(key >> 16);
+	values[3] = (int16_t)(key & 0xffff);
+	values[4] = ~(values[0] ^ values[1] ^ values[2] ^ values[3]);
+
+	// same value in each channel to survive a down/up mix
+	memset(audio, 0, samplesPerChannel*channels*sizeof(int16_t));
+	for (size_t i = 0; (i < kTagSamples) && (i < samplesPerChannel); ++i) {
+		for (size_t c = 0; c < channels; ++c) {
+			audio[i*channels + c] = values[i];
+		}
+	}
+}
+
+bool OpusPacketStore::untag(const int16_t* audio, size_t samplesPerChannel, size_t channels, uint32_t* key)
+{
+	if ( (samplesPerChannel < kTagSamples) || (channels == 0) ) {
+		return false;
+	}
+	int16_t values[kTagSamples];
+	for (size_t i = 0; i < kTagSamples; ++i) {
+		values[i] = audio[i*channels];
+	}
+	if ( (values[0] != kTagMagic1) || (values[1] != kTagMagic2) ) {
+		return false;
+	}
+	if (values[4] != (int16_t)~(values[0] ^ values[1] ^ values[2] ^ values[3])) {
+		return false;
+	}
+	*key = ((uint32_t)(uint16_t)values[2] << 16) | (uint16_t)values[3];
+	return true;
+}
+
+/* ---------------------------------------------------------------------------
+**  OpusPassthroughEncoder
+** -------------------------------------------------------------------------*/
+webrtc::AudioEncoder::EncodedInfo OpusPassthroughEncoder::EncodeImpl(uint32_t rtp_timestamp, rtc::ArrayView<const int16_t> audio, rtc::Buffer* encoded)
+{
+	uint32_t key = 0;
+	size_t samplesPerChannel = audio.size()/this->NumChannels();
+	if (OpusPacketStore::untag(audio.data(), samplesPerChannel, this->NumChannels(), &key)) {
+		if (key != m_key) {
+			// the timestamps of a new source start from the block
+			m_key = key;
+			m_cursor = 0;
+			m_credit = 0;
+			m_timestamp = rtp_timestamp;
+		}
+		m_credit += samplesPerChannel*OpusPacketStore::kSampleRate/this->SampleRateHz();
+
+		// a packet lasts at least 10ms, one is sent at most by block with the timestamp of its samples
+		EncodedInfo info;
+		int samples = 0;
+		size_t size = encoded->size();
+		if ( (m_credit > 0) && (m_store->read(m_key, &m_cursor, encoded, &samples)) ) {
+			info.encoded_bytes = encoded->size() - size;
+			info.encoded_timestamp = m_timestamp;
+			info.payload_type = m_payloadType;
+			info.encoder_type = CodecType::kOpus;
+			info.speech = true;
+			m_timestamp += samples;
+			m_credit -= samples;
+		}
+		return info;
+	}
+	return m_encoder->Encode(rtp_timestamp, audio, encoded);
+}
+
+/* ---------------------------------------------------------------------------
+**  PassthroughAudioEncoderFactory
+** -------------------------------------------------------------------------*/
+std::unique_ptr<webrtc::AudioEncoder> PassthroughAudioEncoderFactory::MakeAudioEncoder(int payload_type, const webrtc::SdpAudioFormat& format)
+{
+	std::unique_ptr<webrtc::AudioEncoder> encoder = m_factory->MakeAudioEncoder(payload_type, format);
+	if ( (encoder) && (strcasecmp(format.name.c_str(), "opus") == 0) ) {
+		RTC_LOG(INFO) << "PassthroughAudioEncoderFactory::MakeAudioEncoder opus payload_type:" << payload_type;
+		encoder.reset(new OpusPassthroughEncoder(std::move(encoder), &m_store, payload_type));
+	}
+	return encoder;
+}
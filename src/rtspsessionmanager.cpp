@@ -0,0 +1,472 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** rtspsessionmanager.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#ifdef HAVE_LIVE555
+
+#include <algorithm>
+
+#include "rtc_base/logging.h"
+#include "rtc_base/timeutils.h"
+
+#include "rtspsessionmanager.h"
+
+/* ---------------------------------------------------------------------------
+**  RTSPScheduler
+** -------------------------------------------------------------------------*/
+RTSPScheduler::RTSPScheduler() : m_sessions(0)
+{
+	m_trigger = m_env.taskScheduler().createEventTrigger(RTSPScheduler::processTasks);
+	rtc::Thread::Start();
+}
+
+RTSPScheduler::~RTSPScheduler()
+{
+	m_env.stop();
+	rtc::Thread::Stop();
+	// event loop is stopped, remaining tasks can run in the current thread
+	RTSPScheduler::processTasks(this);
+	m_env.taskScheduler().deleteEventTrigger(m_trigger);
+}
+
+void RTSPScheduler::post(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push(task);
+	}
+	// triggerEvent is the only live555 call that can be used from another thread
+	m_env.taskScheduler().triggerEvent(m_trigger, this);
+}
+
+void RTSPScheduler::processTasks(void* clientData)
+{
+	RTSPScheduler* scheduler = (RTSPScheduler*)clientData;
+	std::queue<std::function<void()>> tasks;
+	{
+		std::lock_guard<std::mutex> lock(scheduler->m_mutex);
+		tasks.swap(scheduler->m_tasks);
+	}
+	while (!tasks.empty()) {
+		tasks.front()();
+		tasks.pop();
+	}
+}
+
+void RTSPScheduler::Run()
+{
+	RTC_LOG(INFO) << "RTSPScheduler::Run() started";
+	m_env.mainloop();
+	RTC_LOG(INFO) << "RTSPScheduler::Run() lastline";
+}
+
+/* ---------------------------------------------------------------------------
+**  RTSPSession
+** -------------------------------------------------------------------------*/
+RTSPSession::RTSPSession(RTSPSessionManager& manager, RTSPScheduler& scheduler, const std::string & uri, int timeout, int rtptransport)
+	: m_manager(manager), m_scheduler(scheduler), m_uri(uri), m_timeout(timeout), m_rtptransport(rtptransport), m_lastAccepted(NULL)
+	, m_state(STOPPED), m_attempts(0), m_reconnectCount(0), m_nextRetryMs(0), m_holdSlot(false), m_reconnectTask(NULL)
+	, m_random(std::random_device()())
+	, m_reorderEnabled( (rtptransport == RTSPConnection::RTPUDPUNICAST) || (rtptransport == RTSPConnection::RTPUDPMULTICAST) ), m_receptionTask(NULL)
+{
+	m_scheduler.addSession();
+}
+
+RTSPSession::~RTSPSession()
+{
+	m_scheduler.removeSession();
+}
+
+void RTSPSession::connect()
+{
+	RTC_LOG(INFO) << "RTSPSession::connect " << m_uri;
+	m_state = CONNECTING;
+	m_connection.reset(new RTSPConnection(m_scheduler.env(), this, m_uri.c_str(), m_timeout, m_rtptransport, 1));
+	m_receptionTask = m_scheduler.env().taskScheduler().scheduleDelayedTask(kReceptionPeriodMs*1000, RTSPSession::receptionTask, this);
+}
+
+void RTSPSession::disconnect()
+{
+	RTC_LOG(INFO) << "RTSPSession::disconnect " << m_uri;
+	m_scheduler.env().taskScheduler().unscheduleDelayedTask(m_reconnectTask);
+	m_scheduler.env().taskScheduler().unscheduleDelayedTask(m_receptionTask);
+	this->releaseReconnectSlot();
+	m_state = STOPPED;
+	m_connection.reset();
+}
+
+Json::Value RTSPSession::getStats()
+{
+	static const char* stateNames[] = { "stopped", "connecting", "connected", "waiting" };
+
+	Json::Value stats;
+	stats["url"]            = m_uri;
+	stats["state"]          = stateNames[m_state];
+	stats["attempts"]       = (int)m_attempts;
+	stats["reconnectCount"] = (int)m_reconnectCount;
+	if (m_state == WAITING) {
+		stats["nextRetryIn"] = Json::Int64(m_nextRetryMs - rtc::TimeMillis());
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_lastError.empty()) {
+		stats["lastError"] = m_lastError;
+	}
+	for (auto & it : m_reception) {
+		Json::Value reception;
+		reception["threshold"] = it.second.thresholdMs;
+		reception["jitter"]    = it.second.jitterMs;
+		reception["lost"]      = it.second.lost;
+		reception["late"]      = it.second.late;
+		stats["reorder"][it.first] = reception;
+	}
+	return stats;
+}
+
+RTPSource* RTSPSession::rtpSource(const std::string & id)
+{
+	// the id of a subsession is the name of its sink, which reads the RTP source once playing
+	RTPSource* source = NULL;
+	Medium* medium = NULL;
+	if ( (Medium::lookupByName(m_scheduler.env(), id.c_str(), medium)) && (medium->isSink()) ) {
+		FramedSource* input = ((MediaSink*)medium)->source();
+		if ( (input != NULL) && (input->isRTPSource()) ) {
+			source = (RTPSource*)input;
+		}
+	}
+	return source;
+}
+
+void RTSPSession::updateReordering()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto & route : m_routes) {
+		RTPSource* source = this->rtpSource(route.first);
+		if (source == NULL) {
+			// not playing or closed by a reconnection
+			m_reception.erase(route.first);
+			continue;
+		}
+
+		// packets of all the synchronization sources of the subsession
+		unsigned expected = 0;
+		unsigned received = 0;
+		double jitterMs = 0;
+		RTPReceptionStatsDB::Iterator it(source->receptionStatsDB());
+		while (RTPReceptionStats* stats = it.next(True)) {
+			expected += stats->totNumPacketsExpected();
+			received += stats->totNumPacketsReceived();
+			if (source->timestampFrequency() != 0) {
+				jitterMs = std::max(jitterMs, stats->jitter()*1000.0/source->timestampFrequency());
+			}
+		}
+
+		Reception & reception = m_reception[route.first];
+		if ( (expected < reception.expected) || (received < reception.received) ) {
+			// new synchronization source, restart the counters from it
+			reception.expected = 0;
+			reception.received = 0;
+		}
+		// a packet that arrives after the threshold is dropped by live555, it is counted as received
+		// without moving the highest sequence number, it is the only trace of a late packet
+		unsigned newExpected = expected - reception.expected;
+		unsigned newReceived = received - reception.received;
+		unsigned late = (newReceived > newExpected) ? newReceived - newExpected : 0;
+		reception.late += late;
+		reception.lost = (expected > received) ? expected - received : 0;
+		reception.expected = expected;
+		reception.received = received;
+		reception.jitterMs = jitterMs;
+
+		if (m_reorderEnabled) {
+			// wait for a few jitters, longer when packets came too late, then decay to it
+			int threshold = std::min(std::max((int)(4*jitterMs), kMinReorderMs), kMaxReorderMs);
+			if (late != 0) {
+				threshold = std::max(threshold, std::min(reception.thresholdMs*3/2, kMaxReorderMs));
+			} else {
+				threshold = std::max(threshold, reception.thresholdMs - reception.thresholdMs/8);
+			}
+			if (threshold != reception.thresholdMs) {
+				RTC_LOG(LS_VERBOSE) << "RTSPSession::updateReordering " << m_uri << " " << route.first << " threshold:" << threshold << "ms jitter:" << jitterMs << "ms late:" << late;
+				reception.thresholdMs = threshold;
+			}
+			source->setPacketReorderingThresholdTime(reception.thresholdMs*1000);
+		}
+	}
+}
+
+void RTSPSession::receptionTask(void* clientData)
+{
+	RTSPSession* session = (RTSPSession*)clientData;
+	session->updateReordering();
+	session->m_receptionTask = session->m_scheduler.env().taskScheduler().scheduleDelayedTask(kReceptionPeriodMs*1000, RTSPSession::receptionTask, session);
+}
+
+void RTSPSession::releaseReconnectSlot()
+{
+	if (m_holdSlot) {
+		m_holdSlot = false;
+		m_manager.releaseReconnectSlot();
+	}
+}
+
+void RTSPSession::scheduleReconnect(const std::string & reason)
+{
+	RTC_LOG(WARNING) << "RTSPSession::scheduleReconnect " << m_uri << " " << reason << " attempts:" << m_attempts;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_lastError = reason;
+	}
+	this->releaseReconnectSlot();
+
+	// exponential backoff with jitter in [delay/2, delay]
+	int64_t delay = m_manager.minReconnectDelayMs();
+	for (int i = 0; (i < m_attempts) && (delay < m_manager.maxReconnectDelayMs()); ++i) {
+		delay *= 2;
+	}
+	if (delay > m_manager.maxReconnectDelayMs()) {
+		delay = m_manager.maxReconnectDelayMs();
+	}
+	delay = delay/2 + std::uniform_int_distribution<int64_t>(0, delay/2)(m_random);
+	m_attempts++;
+
+	m_state = WAITING;
+	m_nextRetryMs = rtc::TimeMillis() + delay;
+	m_scheduler.env().taskScheduler().unscheduleDelayedTask(m_reconnectTask);
+	m_reconnectTask = m_scheduler.env().taskScheduler().scheduleDelayedTask(delay*1000, RTSPSession::reconnectTask, this);
+}
+
+void RTSPSession::reconnectTask(void* clientData)
+{
+	RTSPSession* session = (RTSPSession*)clientData;
+	session->m_reconnectTask = NULL;
+	if (!session->m_connection) {
+		return;
+	}
+	if (!session->m_manager.acquireReconnectSlot()) {
+		// too many reconnections in progress, retry later without increasing the backoff
+		int64_t delay = std::uniform_int_distribution<int64_t>(session->m_manager.minReconnectDelayMs()/2, session->m_manager.minReconnectDelayMs())(session->m_random);
+		RTC_LOG(LS_VERBOSE) << "RTSPSession::reconnectTask " << session->m_uri << " no slot, retry in " << delay << "ms";
+		session->m_nextRetryMs = rtc::TimeMillis() + delay;
+		session->m_reconnectTask = session->m_scheduler.env().taskScheduler().scheduleDelayedTask(delay*1000, RTSPSession::reconnectTask, session);
+		return;
+	}
+	RTC_LOG(INFO) << "RTSPSession::reconnectTask " << session->m_uri << " attempts:" << session->m_attempts;
+	session->m_holdSlot = true;
+	session->m_state = CONNECTING;
+	session->m_reconnectCount++;
+	session->m_connection->start();
+}
+
+void RTSPSession::addSink(RTSPConnection::Callback* sink)
+{
+	bool renegotiate = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_sinks.push_back(sink);
+		renegotiate = !m_routes.empty();
+	}
+	if (renegotiate) {
+		// subsessions were already dispatched, restart to offer them to the new consumer
+		m_scheduler.post([this]() {
+			if (m_connection) {
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_routes.clear();
+					m_reception.clear();
+				}
+				m_connection->start();
+			}
+		});
+	}
+}
+
+bool RTSPSession::removeSink(RTSPConnection::Callback* sink)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_sinks.remove(sink);
+	for (auto it = m_routes.begin(); it != m_routes.end(); ) {
+		if (it->second == sink) {
+			m_reception.erase(it->first);
+			it = m_routes.erase(it);
+		} else {
+			++it;
+		}
+	}
+	if (m_lastAccepted == sink) {
+		m_lastAccepted = NULL;
+	}
+	return m_sinks.empty();
+}
+
+bool RTSPSession::onNewSession(const char* id, const char* media, const char* codec, const char* sdp)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_lastAccepted = NULL;
+	for (RTSPConnection::Callback* sink : m_sinks) {
+		if (sink->onNewSession(id, media, codec, sdp)) {
+			m_routes[id] = sink;
+			m_lastAccepted = sink;
+			break;
+		}
+	}
+	if (m_lastAccepted) {
+		m_state = CONNECTED;
+		this->releaseReconnectSlot();
+	}
+	return (m_lastAccepted != NULL);
+}
+
+bool RTSPSession::onData(const char* id, unsigned char* buffer, ssize_t size, struct timeval presentationTime)
+{
+	bool success = false;
+	if (m_attempts != 0) {
+		// data is flowing, restart the backoff from the minimum
+		m_attempts = 0;
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::map<std::string, RTSPConnection::Callback*>::iterator it = m_routes.find(id);
+	if (it != m_routes.end()) {
+		success = it->second->onData(id, buffer, size, presentationTime);
+	}
+	return success;
+}
+
+ssize_t RTSPSession::onNewBuffer(unsigned char* buffer, ssize_t size)
+{
+	// the sink of a subsession is created just after it was accepted by onNewSession
+	ssize_t markerSize = 0;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_lastAccepted) {
+		markerSize = m_lastAccepted->onNewBuffer(buffer, size);
+		m_lastAccepted = NULL;
+	}
+	return markerSize;
+}
+
+void RTSPSession::onConnectionTimeout(RTSPConnection& connection)
+{
+	this->scheduleReconnect("connection timeout");
+}
+
+void RTSPSession::onDataTimeout(RTSPConnection& connection)
+{
+	this->scheduleReconnect("data timeout");
+}
+
+void RTSPSession::onError(RTSPConnection& connection, const char* error)
+{
+	this->scheduleReconnect(error ? error : "error");
+}
+
+/* ---------------------------------------------------------------------------
+**  RTSPSessionManager
+** -------------------------------------------------------------------------*/
+RTSPSessionManager::RTSPSessionManager(int nbSchedulers, int maxConcurrentReconnects, int minReconnectDelayMs, int maxReconnectDelayMs)
+	: m_maxConcurrentReconnects(maxConcurrentReconnects), m_minReconnectDelayMs(minReconnectDelayMs), m_maxReconnectDelayMs(maxReconnectDelayMs), m_reconnecting(0)
+{
+	if (nbSchedulers < 1) {
+		nbSchedulers = 1;
+	}
+	RTC_LOG(INFO) << "RTSPSessionManager nbSchedulers:" << nbSchedulers << " reconnects:" << m_maxConcurrentReconnects << " backoff:" << m_minReconnectDelayMs << "-" << m_maxReconnectDelayMs << "ms";
+	for (int i = 0; i < nbSchedulers; ++i) {
+		m_schedulers.push_back(std::unique_ptr<RTSPScheduler>(new RTSPScheduler()));
+	}
+}
+
+RTSPSessionManager::~RTSPSessionManager()
+{
+	for (auto & it : m_sessions) {
+		RTSPSession* session = it.second;
+		session->scheduler().post([session]() {
+			session->disconnect();
+			delete session;
+		});
+	}
+	m_sessions.clear();
+	m_schedulers.clear();
+}
+
+int RTSPSessionManager::decodeRTPTransport(const std::string & rtpTransportString)
+{
+	int rtptransport = RTSPConnection::RTPUDPUNICAST;
+	if (rtpTransportString == "tcp") {
+		rtptransport = RTSPConnection::RTPOVERTCP;
+	} else if (rtpTransportString == "http") {
+		rtptransport = RTSPConnection::RTPOVERHTTP;
+	} else if (rtpTransportString == "multicast") {
+		rtptransport = RTSPConnection::RTPUDPMULTICAST;
+	}
+	return rtptransport;
+}
+
+bool RTSPSessionManager::acquireReconnectSlot()
+{
+	if (++m_reconnecting > m_maxConcurrentReconnects) {
+		m_reconnecting--;
+		return false;
+	}
+	return true;
+}
+
+Json::Value RTSPSessionManager::getStats(const std::string & uri)
+{
+	Json::Value stats;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::map<std::string, RTSPSession*>::iterator it = m_sessions.find(uri);
+	if (it != m_sessions.end()) {
+		stats = it->second->getStats();
+	}
+	return stats;
+}
+
+RTSPScheduler* RTSPSessionManager::getScheduler()
+{
+	// least loaded scheduler
+	RTSPScheduler* scheduler = NULL;
+	for (auto & it : m_schedulers) {
+		if ( (scheduler == NULL) || (it->sessionCount() < scheduler->sessionCount()) ) {
+			scheduler = it.get();
+		}
+	}
+	return scheduler;
+}
+
+void RTSPSessionManager::subscribe(RTSPConnection::Callback* sink, const std::string & uri, int timeout, const std::string & rtptransport)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::map<std::string, RTSPSession*>::iterator it = m_sessions.find(uri);
+	if (it != m_sessions.end()) {
+		RTC_LOG(INFO) << "RTSPSessionManager::subscribe reuse session " << uri;
+		it->second->addSink(sink);
+	} else {
+		RTC_LOG(INFO) << "RTSPSessionManager::subscribe new session " << uri;
+		RTSPSession* session = new RTSPSession(*this, *this->getScheduler(), uri, timeout, decodeRTPTransport(rtptransport));
+		session->addSink(sink);
+		m_sessions[uri] = session;
+		session->scheduler().post([session]() { session->connect(); });
+	}
+}
+
+void RTSPSessionManager::unsubscribe(RTSPConnection::Callback* sink, const std::string & uri)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::map<std::string, RTSPSession*>::iterator it = m_sessions.find(uri);
+	if (it != m_sessions.end()) {
+		RTSPSession* session = it->second;
+		if (session->removeSink(sink)) {
+			RTC_LOG(INFO) << "RTSPSessionManager::unsubscribe close session " << uri;
+			m_sessions.erase(it);
+			session->scheduler().post([session]() {
+				session->disconnect();
+				delete session;
+			});
+		}
+	}
+}
+
+#endif
@@ -11,6 +11,7 @@
 
 #include "rtc_base/timeutils.h"
 #include "rtc_base/logging.h"
+#include "rtc_base/trace_event.h"
 
 #include "modules/video_coding/h264_sprop_parameter_sets.h"
 #include "api/video/i420_buffer.h"
@@ -19,23 +20,13 @@
 #include "libyuv/convert.h"
 
 #include "rtspvideocapturer.h"
+#include "tracecapture.h"
+#include "asynclog.h"
 
 uint8_t marker[] = { 0, 0, 0, 1};
 
-int decodeRTPTransport(const std::string & rtpTransportString) 
-{
-	int rtptransport = RTSPConnection::RTPUDPUNICAST;
-	if (rtpTransportString == "tcp") {
-		rtptransport = RTSPConnection::RTPOVERTCP;
-	} else if (rtpTransportString == "http") {
-		rtptransport = RTSPConnection::RTPOVERHTTP;
-	} else if (rtpTransportString == "multicast") {
-		rtptransport = RTSPConnection::RTPUDPMULTICAST;
-	}
-	return rtptransport;
-}
-
-RTSPVideoCapturer::RTSPVideoCapturer(const std::string & uri, int timeout, const std::string & rtptransport) : m_connection(m_env, this, uri.c_str(), timeout, decodeRTPTransport(rtptransport), 1)
+RTSPVideoCapturer::RTSPVideoCapturer(RTSPSessionManager & sessionManager, const std::string & uri, int timeout, const std::string & rtptransport, std::shared_ptr<SourceMetrics> metrics) 
+	: m_sessionManager(sessionManager), m_uri(uri), m_timeout(timeout), m_rtptransport(rtptransport), m_paused(false), m_waitIdr(false), m_metrics(metrics), m_onFrameUs(0)
 {
 	RTC_LOG(INFO) << "RTSPVideoCapturer" << uri ;
 	m_h264 = h264_new();
@@ -44,6 +35,7 @@ RTSPVideoCapturer::RTSPVideoCapturer(const std::string & uri, int timeout, const
 RTSPVideoCapturer::~RTSPVideoCapturer()
 {
 	RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer::~RTSPVideoCapturer firstline";
+	m_sessionManager.unsubscribe(this, m_uri);
 	h264_free(m_h264);
 	RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer::~RTSPVideoCapturer lastline";
 }
@@ -103,10 +95,67 @@ bool RTSPVideoCapturer::onNewSession(const char* id,const char* media, const cha
 
 bool RTSPVideoCapturer::onData(const char* id, unsigned char* buffer, ssize_t size, struct timeval presentationTime)
 {
+	bool success = true;
+	if (m_paused) {
+		this->cache(buffer, size, presentationTime);
+	} else {
+		// resume from the last picture received while paused, stamped now as its capture time is past
+		std::list<CachedData> cached;
+		cached.swap(m_cache);
+		for (CachedData & data : cached) {
+			this->decode(id, data.data.data(), data.data.size(), presentationTime);
+		}
+		if ( (m_codec == "H264") && (!cached.empty()) ) {
+			// the slices after the cached IDR reference pictures that were not kept
+			m_waitIdr = true;
+		}
+		success = this->decode(id, buffer, size, presentationTime);
+	}
+	return success;
+}
+
+void RTSPVideoCapturer::cache(unsigned char* buffer, ssize_t size, struct timeval presentationTime)
+{
+	if (m_codec == "H264") {
+		int type = (size > (ssize_t)sizeof(marker)) ? (buffer[sizeof(marker)] & 0x1f) : 0;
+		if (type == NAL_UNIT_TYPE_SPS) {
+			// a new sequence begins
+			m_cache.clear();
+		} else if (type == NAL_UNIT_TYPE_CODED_SLICE_IDR) {
+			// the slices of a previous IDR are not needed anymore
+			m_cache.remove_if([presentationTime](const CachedData & data) {
+				int type = (data.data.size() > sizeof(marker)) ? (data.data[sizeof(marker)] & 0x1f) : 0;
+				return (type == NAL_UNIT_TYPE_CODED_SLICE_IDR) && ( (data.presentationTime.tv_sec != presentationTime.tv_sec) || (data.presentationTime.tv_usec != presentationTime.tv_usec) );
+			});
+		} else if (type == NAL_UNIT_TYPE_PPS) {
+			// a repeated PPS is kept once
+			m_cache.remove_if([buffer, size](const CachedData & data) {
+				return (data.data.size() == (size_t)size) && (memcmp(data.data.data(), buffer, size) == 0);
+			});
+		} else {
+			// only the last IDR and its parameter sets are kept
+			return;
+		}
+	} else {
+		// frames are independent, keep only the last one
+		m_cache.clear();
+	}
+	CachedData data;
+	data.data.assign(buffer, buffer+size);
+	data.presentationTime = presentationTime;
+	m_cache.push_back(std::move(data));
+}
+
+bool RTSPVideoCapturer::decode(const char* id, unsigned char* buffer, ssize_t size, struct timeval presentationTime)
+{
+	TRACE_EVENT1(TRACE_CATEGORY, "RTSPVideoCapturer::decode", "size", size);
 	int64_t ts = presentationTime.tv_sec;
 	ts = ts*1000 + presentationTime.tv_usec/1000;
-	RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer:onData size:" << size << " ts:" << ts;
+	STREAMER_LOG_VERBOSE << "RTSPVideoCapturer:onData size:" << size << " ts:" << ts;
 	int res = 0;
+	int64_t startUs = rtc::TimeMicros();
+	// the decoder gives the frame before returning, the time of OnFrame is not decoding
+	m_onFrameUs = 0;
 
 	if (m_codec == "H264") {
 		int nal_start = 0;
@@ -145,24 +194,31 @@ bool RTSPVideoCapturer::onData(const char* id, unsigned char* buffer, ssize_t si
 			RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer:onData PPS";
 			m_cfg.insert(m_cfg.end(), buffer, buffer+size);
 		}
+		else if ( (m_waitIdr) && (m_h264->nal->nal_unit_type != NAL_UNIT_TYPE_CODED_SLICE_IDR) ) {
+			RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer:onData wait IDR";
+			m_metrics->addDropped();
+		}
 		else if (m_decoder.get()) {
 			if (m_h264->nal->nal_unit_type == NAL_UNIT_TYPE_CODED_SLICE_IDR) {
 				RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer:onData IDR";
+				m_waitIdr = false;
 				uint8_t buf[m_cfg.size() + size];
 				memcpy(buf, m_cfg.data(), m_cfg.size());
 				memcpy(buf+m_cfg.size(), buffer, size);
 				webrtc::EncodedImage input_image(buf, sizeof(buf), sizeof(buf) + webrtc::EncodedImage::GetBufferPaddingBytes(webrtc::VideoCodecType::kVideoCodecH264));
 				input_image._timeStamp = ts*1000;
 				res = m_decoder->Decode(input_image, false, NULL);
+				m_metrics->addLatency(SourceMetrics::kDecode, rtc::TimeMicros() - startUs - m_onFrameUs);
 			}
 			else {
-				RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer:onData SLICE NALU:" << m_h264->nal->nal_unit_type;
+				STREAMER_LOG_VERBOSE << "RTSPVideoCapturer:onData SLICE NALU:" << m_h264->nal->nal_unit_type;
 				webrtc::EncodedImage input_image(buffer, size, size + webrtc::EncodedImage::GetBufferPaddingBytes(webrtc::VideoCodecType::kVideoCodecH264));
 				input_image._timeStamp = ts*1000;
 				res = m_decoder->Decode(input_image, false, NULL);
+				m_metrics->addLatency(SourceMetrics::kDecode, rtc::TimeMicros() - startUs - m_onFrameUs);
 			}
 		} else {
-			RTC_LOG(LS_ERROR) << "RTSPVideoCapturer:onData no decoder";
+			STREAMER_LOG_EVERY_MS(LS_ERROR, 1000) << "RTSPVideoCapturer:onData no decoder";
 			res = -1;
 		}
 	} else if (m_codec == "JPEG") {
@@ -182,20 +238,25 @@ bool RTSPVideoCapturer::onData(const char* id, unsigned char* buffer, ssize_t si
 							width, height,
 							libyuv::kRotate0, ::libyuv::FOURCC_MJPG);									
 									
+			m_metrics->addLatency(SourceMetrics::kDecode, rtc::TimeMicros() - startUs);
 			if (conversionResult >= 0) {
 				webrtc::VideoFrame frame(I420buffer, 0, ts*1000, webrtc::kVideoRotation_0);
 				this->Decoded(frame);
 			} else {
-				RTC_LOG(LS_ERROR) << "RTSPVideoCapturer:onData decoder error:" << conversionResult;
+				STREAMER_LOG_EVERY_MS(LS_ERROR, 1000) << "RTSPVideoCapturer:onData decoder error:" << conversionResult;
 				res = -1;
 			}
 		} else {
-			RTC_LOG(LS_ERROR) << "RTSPVideoCapturer:onData cannot JPEG dimension";
+			STREAMER_LOG_EVERY_MS(LS_ERROR, 1000) << "RTSPVideoCapturer:onData cannot JPEG dimension";
 			res = -1;
 		}
 			    
 	}
 
+	m_metrics->addDecodeTime(rtc::TimeMicros() - startUs - m_onFrameUs);
+	if (res != 0) {
+		m_metrics->addDropped();
+	}
 	return (res == 0);
 }
 
@@ -214,11 +275,17 @@ ssize_t RTSPVideoCapturer::onNewBuffer(unsigned char* buffer, ssize_t size)
 
 int32_t RTSPVideoCapturer::Decoded(webrtc::VideoFrame& decodedImage)
 {
+	TRACE_EVENT0(TRACE_CATEGORY, "RTSPVideoCapturer::OnFrame");
 	if (decodedImage.timestamp_us() == 0) {
 		decodedImage.set_timestamp_us(decodedImage.timestamp());
 	}
-	RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer::Decoded " << decodedImage.size() << " " << decodedImage.timestamp_us() << " " << decodedImage.timestamp() << " " << decodedImage.ntp_time_ms() << " " << decodedImage.render_time_ms();
+	m_metrics->addFrame();
+	STREAMER_LOG_VERBOSE << "RTSPVideoCapturer::Decoded " << decodedImage.size() << " " << decodedImage.timestamp_us() << " " << decodedImage.timestamp() << " " << decodedImage.ntp_time_ms() << " " << decodedImage.render_time_ms();
+	int64_t onFrameStartUs = rtc::TimeMicros();
 	this->OnFrame(decodedImage, decodedImage.height(), decodedImage.width());
+	int64_t onFrameUs = rtc::TimeMicros() - onFrameStartUs;
+	m_onFrameUs += onFrameUs;
+	m_metrics->addLatency(SourceMetrics::kOnFrame, onFrameUs);
 	return true;
 }
 
@@ -226,27 +293,19 @@ cricket::CaptureState RTSPVideoCapturer::Start(const cricket::VideoFormat& forma
 {
 	SetCaptureFormat(&format);
 	SetCaptureState(cricket::CS_RUNNING);
-	rtc::Thread::Start();
+	m_sessionManager.subscribe(this, m_uri, m_timeout, m_rtptransport);
 	return cricket::CS_RUNNING;
 }
 
 void RTSPVideoCapturer::Stop()
 {
 	RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer::Stop() started";
-	m_env.stop();
-	rtc::Thread::Stop();
+	m_sessionManager.unsubscribe(this, m_uri);
 	SetCaptureFormat(NULL);
 	SetCaptureState(cricket::CS_STOPPED);
 	RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer::Stop() done";
 }
 
-void RTSPVideoCapturer::Run()
-{
-	RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer::Run() started";
-	m_env.mainloop();
-	RTC_LOG(LS_VERBOSE) << "RTSPVideoCapturer::Run() lastline";
-}
-
 bool RTSPVideoCapturer::GetPreferredFourccs(std::vector<unsigned int>* fourccs)
 {
 	return true;
@@ -0,0 +1,306 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** sharedvideoencoder.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include <algorithm>
+
+#include "rtc_base/logging.h"
+#include "rtc_base/timeutils.h"
+
+#include "sharedvideoencoder.h"
+
+/* ---------------------------------------------------------------------------
+**  SharedEncoderGroup
+** -------------------------------------------------------------------------*/
+SharedEncoderGroup::SharedEncoderGroup(std::unique_ptr<webrtc::VideoEncoder> encoder, const webrtc::SdpVideoFormat & format, const webrtc::VideoCodec & settings, LatencyHistogram* encodeLatency, LatencyHistogram* packetizeLatency)
+	: m_encoder(std::move(encoder)), m_format(format), m_settings(settings), m_keyframePending(false), m_lastKeyframeMs(0), m_encodeLatency(encodeLatency), m_packetizeLatency(packetizeLatency)
+{
+	RTC_LOG(INFO) << "SharedEncoderGroup " << m_format.name << " " << m_settings.width << "x" << m_settings.height;
+	m_encoder->RegisterEncodeCompleteCallback(this);
+}
+
+SharedEncoderGroup::~SharedEncoderGroup()
+{
+	RTC_LOG(INFO) << "~SharedEncoderGroup " << m_format.name << " " << m_settings.width << "x" << m_settings.height;
+	m_encoder->Release();
+}
+
+int32_t SharedEncoderGroup::init(int numberOfCores, size_t maxPayloadSize)
+{
+	std::lock_guard<std::mutex> lock(m_encoderMutex);
+	return m_encoder->InitEncode(&m_settings, numberOfCores, maxPayloadSize);
+}
+
+bool SharedEncoderGroup::matches(const webrtc::SdpVideoFormat & format, const webrtc::VideoCodec & settings)
+{
+	return (format == m_format)
+		&& (settings.codecType == m_settings.codecType)
+		&& (settings.width == m_settings.width)
+		&& (settings.height == m_settings.height)
+		&& (settings.numberOfSimulcastStreams == m_settings.numberOfSimulcastStreams);
+}
+
+bool SharedEncoderGroup::hasFrame(const webrtc::VideoFrameBuffer* buffer)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return std::find_if(m_frames.begin(), m_frames.end(), [buffer](const EncodedFrame & frame) { return frame.buffer.get() == buffer; }) != m_frames.end();
+}
+
+void SharedEncoderGroup::addMember(SharedVideoEncoder* member)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_members[member] = std::make_pair(webrtc::BitrateAllocation(), 0);
+}
+
+void SharedEncoderGroup::removeMember(SharedVideoEncoder* member)
+{
+	std::lock_guard<std::mutex> encoderLock(m_encoderMutex);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_members.erase(member);
+	this->applyRateAllocation();
+}
+
+size_t SharedEncoderGroup::memberCount()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_members.size();
+}
+
+void SharedEncoderGroup::setRateAllocation(SharedVideoEncoder* member, const webrtc::BitrateAllocation & allocation, uint32_t framerate)
+{
+	std::lock_guard<std::mutex> encoderLock(m_encoderMutex);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_members[member] = std::make_pair(allocation, framerate);
+	this->applyRateAllocation();
+}
+
+void SharedEncoderGroup::applyRateAllocation()
+{
+	// follow the best link, viewers with less bandwidth should use a lower tier
+	const std::pair<webrtc::BitrateAllocation, uint32_t>* best = NULL;
+	for (auto & it : m_members) {
+		if ( (best == NULL) || (it.second.first.get_sum_bps() > best->first.get_sum_bps()) ) {
+			best = &it.second;
+		}
+	}
+	if ( (best != NULL) && (best->first.get_sum_bps() != 0) ) {
+		m_encoder->SetRateAllocation(best->first, best->second);
+	}
+}
+
+int32_t SharedEncoderGroup::encode(const webrtc::VideoFrame & frame, bool keyframe, webrtc::EncodedImageCallback* callback)
+{
+	int32_t res = WEBRTC_VIDEO_CODEC_OK;
+	rtc::scoped_refptr<webrtc::VideoFrameBuffer> buffer = frame.video_frame_buffer();
+	auto sameBuffer = [&buffer](const EncodedFrame & encodedFrame) { return encodedFrame.buffer == buffer; };
+
+	std::list<std::shared_ptr<Output>> outputs;
+	{
+		// the members wait for the one that encodes the frame
+		std::lock_guard<std::mutex> encoderLock(m_encoderMutex);
+		bool encodeFrame = false;
+		bool forceKeyframe = false;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (keyframe) {
+				m_keyframePending = true;
+			}
+			if (std::find_if(m_frames.begin(), m_frames.end(), sameBuffer) == m_frames.end()) {
+				// first member receiving this frame
+				EncodedFrame encodedFrame;
+				encodedFrame.buffer = buffer;
+				encodedFrame.rtpTimestamp = frame.timestamp();
+				m_frames.push_back(encodedFrame);
+				if (m_frames.size() > kCacheSize) {
+					m_frames.pop_front();
+				}
+				encodeFrame = true;
+
+				// requests received since the last keyframe give one keyframe
+				int64_t now = rtc::TimeMillis();
+				forceKeyframe = m_keyframePending && (now - m_lastKeyframeMs >= kMinKeyframeIntervalMs);
+				if (forceKeyframe) {
+					m_keyframePending = false;
+				}
+			}
+		}
+
+		if (encodeFrame) {
+			std::vector<webrtc::FrameType> frameTypes(std::max<int>(m_settings.numberOfSimulcastStreams, 1), forceKeyframe ? webrtc::kVideoFrameKey : webrtc::kVideoFrameDelta);
+			int64_t startUs = rtc::TimeMicros();
+			res = m_encoder->Encode(frame, NULL, &frameTypes);
+			if (m_encodeLatency) {
+				m_encodeLatency->record(rtc::TimeMicros() - startUs);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::deque<EncodedFrame>::iterator it = std::find_if(m_frames.begin(), m_frames.end(), sameBuffer);
+		if (it != m_frames.end()) {
+			outputs = it->outputs;
+		}
+	}
+
+	// packetize outside of the lock, the timestamps are the ones of the member
+	int64_t startUs = rtc::TimeMicros();
+	for (std::shared_ptr<Output> & output : outputs) {
+		webrtc::EncodedImage image(output->image);
+		image._timeStamp = frame.timestamp();
+		image.ntp_time_ms_ = frame.ntp_time_ms();
+		image.capture_time_ms_ = frame.render_time_ms();
+		callback->OnEncodedImage(image, output->hasInfo ? &output->info : NULL, output->fragmentation.get());
+	}
+	if ( (m_packetizeLatency) && (!outputs.empty()) ) {
+		m_packetizeLatency->record(rtc::TimeMicros() - startUs);
+	}
+	return res;
+}
+
+webrtc::EncodedImageCallback::Result SharedEncoderGroup::OnEncodedImage(const webrtc::EncodedImage& image, const webrtc::CodecSpecificInfo* info, const webrtc::RTPFragmentationHeader* fragmentation)
+{
+	// called from Encode or from a thread of the encoder
+	std::shared_ptr<Output> output(new Output());
+	output->data.assign(image._buffer, image._buffer + image._length);
+	output->image = image;
+	output->image._buffer = output->data.data();
+	output->image._size = output->data.size();
+	output->hasInfo = (info != NULL);
+	if (info) {
+		output->info = *info;
+	}
+	if (fragmentation) {
+		output->fragmentation.reset(new webrtc::RTPFragmentationHeader());
+		output->fragmentation->CopyFrom(*fragmentation);
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (image._frameType == webrtc::kVideoFrameKey) {
+		m_lastKeyframeMs = rtc::TimeMillis();
+	}
+	// the encoder keeps the timestamp of the frame it was given
+	std::deque<EncodedFrame>::reverse_iterator it = std::find_if(m_frames.rbegin(), m_frames.rend(), [&image](const EncodedFrame & frame) { return frame.rtpTimestamp == image._timeStamp; });
+	if (it != m_frames.rend()) {
+		it->outputs.push_back(output);
+	} else {
+		RTC_LOG(LS_WARNING) << "SharedEncoderGroup no frame for encoded image ts:" << image._timeStamp;
+	}
+	return Result(Result::OK);
+}
+
+/* ---------------------------------------------------------------------------
+**  SharedVideoEncoderFactory
+** -------------------------------------------------------------------------*/
+std::unique_ptr<webrtc::VideoEncoder> SharedVideoEncoderFactory::CreateVideoEncoder(const webrtc::SdpVideoFormat& format)
+{
+	std::unique_ptr<webrtc::VideoEncoder> encoder;
+	if (m_shared) {
+		encoder.reset(new SharedVideoEncoder(this, format));
+	} else {
+		encoder = m_factory->CreateVideoEncoder(format);
+	}
+	return encoder;
+}
+
+std::shared_ptr<SharedEncoderGroup> SharedVideoEncoderFactory::find(const webrtc::SdpVideoFormat & format, const webrtc::VideoCodec & settings, const webrtc::VideoFrameBuffer* buffer)
+{
+	std::shared_ptr<SharedEncoderGroup> found;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::list<std::weak_ptr<SharedEncoderGroup>>::iterator it = m_groups.begin();
+	while (it != m_groups.end()) {
+		std::shared_ptr<SharedEncoderGroup> group = it->lock();
+		if (!group) {
+			it = m_groups.erase(it);
+		} else {
+			if ( (!found) && (group->matches(format, settings)) && (group->hasFrame(buffer)) ) {
+				found = group;
+			}
+			++it;
+		}
+	}
+	return found;
+}
+
+std::shared_ptr<SharedEncoderGroup> SharedVideoEncoderFactory::create(const webrtc::SdpVideoFormat & format, const webrtc::VideoCodec & settings, int numberOfCores, size_t maxPayloadSize)
+{
+	std::shared_ptr<SharedEncoderGroup> group;
+	std::unique_ptr<webrtc::VideoEncoder> encoder = m_factory->CreateVideoEncoder(format);
+	if (!encoder) {
+		RTC_LOG(LS_ERROR) << "SharedVideoEncoderFactory cannot create encoder " << format.name;
+	} else {
+		group.reset(new SharedEncoderGroup(std::move(encoder), format, settings, m_encodeLatency, m_packetizeLatency));
+		if (group->init(numberOfCores, maxPayloadSize) != WEBRTC_VIDEO_CODEC_OK) {
+			RTC_LOG(LS_ERROR) << "SharedVideoEncoderFactory cannot init encoder " << format.name;
+			group.reset();
+		} else {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_groups.push_back(group);
+		}
+	}
+	return group;
+}
+
+/* ---------------------------------------------------------------------------
+**  SharedVideoEncoder
+** -------------------------------------------------------------------------*/
+int32_t SharedVideoEncoder::InitEncode(const webrtc::VideoCodec* codec_settings, int32_t number_of_cores, size_t max_payload_size)
+{
+	// the group is chosen with the first frame
+	this->leave();
+	m_settings = *codec_settings;
+	m_numberOfCores = number_of_cores;
+	m_maxPayloadSize = max_payload_size;
+	return WEBRTC_VIDEO_CODEC_OK;
+}
+
+int32_t SharedVideoEncoder::Encode(const webrtc::VideoFrame& frame, const webrtc::CodecSpecificInfo* codec_specific_info, const std::vector<webrtc::FrameType>* frame_types)
+{
+	bool keyframe = false;
+	if (frame_types) {
+		keyframe = std::find(frame_types->begin(), frame_types->end(), webrtc::kVideoFrameKey) != frame_types->end();
+	}
+
+	// alone in the group, join the group that already encodes the same frames
+	if ( (!m_group) || (m_group->memberCount() == 1) ) {
+		std::shared_ptr<SharedEncoderGroup> group = m_factory->find(m_format, m_settings, frame.video_frame_buffer().get());
+		if ( (group) && (group != m_group) ) {
+			this->leave();
+			m_group = group;
+			m_group->addMember(this);
+			m_group->setRateAllocation(this, m_allocation, m_framerate);
+			// the previous frames were not encoded by this group
+			keyframe = true;
+		}
+	}
+	if (!m_group) {
+		m_group = m_factory->create(m_format, m_settings, m_numberOfCores, m_maxPayloadSize);
+		if (!m_group) {
+			return WEBRTC_VIDEO_CODEC_ERROR;
+		}
+		m_group->addMember(this);
+		m_group->setRateAllocation(this, m_allocation, m_framerate);
+	}
+	return m_group->encode(frame, keyframe, m_callback);
+}
+
+int32_t SharedVideoEncoder::SetRateAllocation(const webrtc::BitrateAllocation& allocation, uint32_t framerate)
+{
+	m_allocation = allocation;
+	m_framerate = framerate;
+	if (m_group) {
+		m_group->setRateAllocation(this, allocation, framerate);
+	}
+	return WEBRTC_VIDEO_CODEC_OK;
+}
+
+void SharedVideoEncoder::leave()
+{
+	if (m_group) {
+		m_group->removeMember(this);
+		m_group.reset();
+	}
+}
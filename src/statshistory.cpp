@@ -0,0 +1,184 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** statshistory.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <set>
+#include <algorithm>
+
+#include "api/stats/rtcstats_objects.h"
+#include "rtc_base/timeutils.h"
+
+#include "statshistory.h"
+
+// numeric value of a member, false if it is not defined or not a number
+static bool toDouble(const webrtc::RTCStatsMemberInterface* member, double & value)
+{
+	bool ret = member->is_defined();
+	if (ret)
+	{
+		switch (member->type())
+		{
+			case webrtc::RTCStatsMemberInterface::kInt32:  value = *member->cast_to<webrtc::RTCStatsMember<int32_t>>(); break;
+			case webrtc::RTCStatsMemberInterface::kUint32: value = *member->cast_to<webrtc::RTCStatsMember<uint32_t>>(); break;
+			case webrtc::RTCStatsMemberInterface::kInt64:  value = *member->cast_to<webrtc::RTCStatsMember<int64_t>>(); break;
+			case webrtc::RTCStatsMemberInterface::kUint64: value = *member->cast_to<webrtc::RTCStatsMember<uint64_t>>(); break;
+			case webrtc::RTCStatsMemberInterface::kDouble: value = *member->cast_to<webrtc::RTCStatsMember<double>>(); break;
+			default: ret = false; break;
+		}
+	}
+	return ret;
+}
+
+// string value of a member, empty if it is not defined
+static std::string toString(const webrtc::RTCStatsMemberInterface* member)
+{
+	std::string value;
+	if ( (member->is_defined()) && (member->type() == webrtc::RTCStatsMemberInterface::kString) )
+	{
+		value = *member->cast_to<webrtc::RTCStatsMember<std::string>>();
+	}
+	return value;
+}
+
+void StatsHistory::OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report)
+{
+	// the candidates used by the nominated pairs, the others are not kept
+	std::set<std::string> candidates;
+	for (const webrtc::RTCStats& stats : *report)
+	{
+		bool nominated = false;
+		std::string local;
+		std::string remote;
+		for (const webrtc::RTCStatsMemberInterface* member : stats.Members())
+		{
+			if (strcmp(member->name(), "nominated") == 0)
+			{
+				nominated = (member->is_defined()) && (*member->cast_to<webrtc::RTCStatsMember<bool>>());
+			}
+			else if (strcmp(member->name(), "localCandidateId") == 0)
+			{
+				local = toString(member);
+			}
+			else if (strcmp(member->name(), "remoteCandidateId") == 0)
+			{
+				remote = toString(member);
+			}
+		}
+		if (nominated)
+		{
+			candidates.insert(local);
+			candidates.insert(remote);
+		}
+	}
+
+	// extracted before the lock, the report is not kept
+	std::map<std::string, double> sample;
+	for (const webrtc::RTCStats& stats : *report)
+	{
+		std::string type(stats.type());
+		if ( ( (type == "local-candidate") || (type == "remote-candidate") ) && (candidates.find(stats.id()) == candidates.end()) )
+		{
+			continue;
+		}
+
+		// the rtp streams give their mediaType, the tracks their kind
+		std::string prefix(type);
+		bool keep = true;
+		for (const webrtc::RTCStatsMemberInterface* member : stats.Members())
+		{
+			if ( (strcmp(member->name(), "mediaType") == 0) || (strcmp(member->name(), "kind") == 0) )
+			{
+				std::string kind = toString(member);
+				if (!kind.empty())
+				{
+					prefix += "." + kind;
+				}
+			}
+			else if (strcmp(member->name(), "nominated") == 0)
+			{
+				keep = (member->is_defined()) && (*member->cast_to<webrtc::RTCStatsMember<bool>>());
+			}
+		}
+		if (!keep)
+		{
+			continue;
+		}
+		prefix += "." + stats.id();
+		for (const webrtc::RTCStatsMemberInterface* member : stats.Members())
+		{
+			double value = 0;
+			if (toDouble(member, value))
+			{
+				sample[prefix + "." + member->name()] = value;
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t slot = m_next;
+	m_timestamps[slot] = rtc::TimeMillis();
+	for (auto & it : m_series)
+	{
+		it.second[slot] = std::numeric_limits<double>::quiet_NaN();
+	}
+	for (auto & it : sample)
+	{
+		std::map<std::string, std::vector<double>>::iterator series = m_series.find(it.first);
+		if (series == m_series.end())
+		{
+			series = m_series.insert(std::make_pair(it.first, std::vector<double>(m_depth, std::numeric_limits<double>::quiet_NaN()))).first;
+		}
+		series->second[slot] = it.second;
+	}
+	// the series of the stats that are gone, like a previous candidate pair, are removed
+	for (std::map<std::string, std::vector<double>>::iterator it = m_series.begin(); it != m_series.end(); )
+	{
+		if (std::all_of(it->second.begin(), it->second.end(), [](double value) { return std::isnan(value); }))
+		{
+			it = m_series.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+	m_next = (m_next + 1) % m_depth;
+	m_count = std::min(m_count + 1, m_depth);
+}
+
+Json::Value StatsHistory::query(const std::string & field, size_t last)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t count = std::min(last, m_count);
+	size_t first = (m_next + m_depth - count) % m_depth;
+
+	Json::Value value;
+	value["timestamps"] = Json::Value(Json::arrayValue);
+	for (size_t i = 0; i < count; ++i)
+	{
+		value["timestamps"].append((Json::Int64)m_timestamps[(first + i) % m_depth]);
+	}
+	value["fields"] = Json::Value(Json::objectValue);
+	for (auto & it : m_series)
+	{
+		if (it.first.compare(0, field.size(), field) == 0)
+		{
+			Json::Value & series = value["fields"][it.first];
+			series = Json::Value(Json::arrayValue);
+			for (size_t i = 0; i < count; ++i)
+			{
+				double sample = it.second[(first + i) % m_depth];
+				series.append(std::isnan(sample) ? Json::Value() : Json::Value(sample));
+			}
+		}
+	}
+	return value;
+}
@@ -0,0 +1,270 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** tracecapture.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <chrono>
+
+#include "rtc_base/event_tracer.h"
+#include "rtc_base/trace_event.h"
+#include "rtc_base/platform_thread.h"
+#include "rtc_base/thread.h"
+#include "rtc_base/timeutils.h"
+#include "rtc_base/logging.h"
+
+#include "tracecapture.h"
+
+namespace {
+
+struct TraceEvent {
+	std::string           name;
+	const unsigned char*  category;
+	char                  phase;
+	unsigned long long    id;
+	bool                  hasId;
+	int64_t               timestampUs;
+	Json::Value           args;
+};
+
+// events of one thread, written by this thread, read when the capture ends
+class ThreadBuffer
+{
+	public:
+		static const size_t kCapacity = 8192;
+
+		ThreadBuffer() : m_threadId(rtc::CurrentThreadId()), m_next(0), m_count(0) {
+			rtc::Thread* thread = rtc::Thread::Current();
+			if (thread) {
+				m_threadName = thread->name();
+			}
+		}
+
+		void add(TraceEvent && event) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			// allocated by the first capture that reaches this thread
+			if (m_events.empty()) {
+				m_events.resize(kCapacity);
+			}
+			m_events[m_next] = std::move(event);
+			m_next = (m_next + 1) % kCapacity;
+			m_count = std::min(m_count + 1, kCapacity);
+		}
+
+		void clear() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_next = 0;
+			m_count = 0;
+		}
+
+		// oldest first, the buffer is emptied
+		void collect(std::vector<TraceEvent> & events) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			size_t first = (m_next + kCapacity - m_count) % kCapacity;
+			for (size_t i = 0; i < m_count; ++i) {
+				events.push_back(std::move(m_events[(first + i) % kCapacity]));
+			}
+			m_next = 0;
+			m_count = 0;
+		}
+
+		rtc::PlatformThreadId threadId() const  { return m_threadId; }
+		const std::string & threadName() const  { return m_threadName; }
+
+	private:
+		rtc::PlatformThreadId     m_threadId;
+		std::string               m_threadName;
+		std::mutex                m_mutex;
+		std::vector<TraceEvent>   m_events;
+		size_t                    m_next;
+		size_t                    m_count;
+};
+const size_t ThreadBuffer::kCapacity;
+
+std::mutex                                                        s_mutex;
+std::map<std::string, std::unique_ptr<unsigned char>>             s_categories;
+std::list<std::shared_ptr<ThreadBuffer>>                          s_buffers;
+std::mutex                                                        s_captureMutex;
+
+ThreadBuffer & threadBuffer()
+{
+	thread_local std::shared_ptr<ThreadBuffer> buffer;
+	if (!buffer) {
+		buffer = std::make_shared<ThreadBuffer>();
+		std::lock_guard<std::mutex> lock(s_mutex);
+		s_buffers.push_back(buffer);
+	}
+	return *buffer;
+}
+
+void setEnabled(bool enabled)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	for (auto & it : s_categories) {
+		// the categories disabled by default are verbose, they stay disabled
+		*it.second = ( (enabled) && (it.first.find("disabled-by-default") != 0) ) ? 1 : 0;
+	}
+}
+
+Json::Value argValue(unsigned char type, unsigned long long value)
+{
+	union {
+		unsigned long long  asUint;
+		long long           asInt;
+		double              asDouble;
+		const void*         asPointer;
+		const char*         asString;
+	} converted;
+	converted.asUint = value;
+
+	Json::Value json;
+	switch (type) {
+		case TRACE_VALUE_TYPE_BOOL:        json = (value != 0); break;
+		case TRACE_VALUE_TYPE_UINT:        json = (Json::UInt64)converted.asUint; break;
+		case TRACE_VALUE_TYPE_INT:         json = (Json::Int64)converted.asInt; break;
+		case TRACE_VALUE_TYPE_DOUBLE:      json = converted.asDouble; break;
+		case TRACE_VALUE_TYPE_STRING:
+		case TRACE_VALUE_TYPE_COPY_STRING: json = converted.asString ? converted.asString : ""; break;
+		case TRACE_VALUE_TYPE_POINTER: {
+			char pointer[32];
+			snprintf(pointer, sizeof(pointer), "%p", converted.asPointer);
+			json = pointer;
+			break;
+		}
+	}
+	return json;
+}
+
+}
+
+void TraceCapture::install()
+{
+	webrtc::SetupEventTracer(&TraceCapture::getCategoryEnabled, &TraceCapture::addTraceEvent);
+}
+
+const unsigned char* TraceCapture::getCategoryEnabled(const char* name)
+{
+	// called once by call site, the pointer is kept
+	std::lock_guard<std::mutex> lock(s_mutex);
+	std::unique_ptr<unsigned char> & enabled = s_categories[name];
+	if (!enabled) {
+		enabled.reset(new unsigned char(0));
+	}
+	return enabled.get();
+}
+
+void TraceCapture::addTraceEvent(char phase,
+	const unsigned char* categoryEnabled,
+	const char* name,
+	unsigned long long id,
+	int numArgs,
+	const char** argNames,
+	const unsigned char* argTypes,
+	const unsigned long long* argValues,
+	unsigned char flags)
+{
+	// only called while the category is enabled
+	TraceEvent event;
+	event.name = name;
+	event.category = categoryEnabled;
+	event.phase = phase;
+	event.id = id;
+	event.hasId = (flags & TRACE_EVENT_FLAG_HAS_ID) != 0;
+	event.timestampUs = rtc::TimeMicros();
+	for (int i = 0; i < numArgs; ++i) {
+		event.args[argNames[i]] = argValue(argTypes[i], argValues[i]);
+	}
+	threadBuffer().add(std::move(event));
+}
+
+Json::Value TraceCapture::capture(int durationMs)
+{
+	Json::Value value;
+	std::unique_lock<std::mutex> capture(s_captureMutex, std::try_to_lock);
+	if (!capture.owns_lock()) {
+		RTC_LOG(LS_WARNING) << "TraceCapture already running";
+		return value;
+	}
+
+	std::list<std::shared_ptr<ThreadBuffer>> buffers;
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		buffers = s_buffers;
+	}
+	for (auto & buffer : buffers) {
+		buffer->clear();
+	}
+
+	RTC_LOG(INFO) << "TraceCapture start duration:" << durationMs << "ms";
+	setEnabled(true);
+	std::this_thread::sleep_for(std::chrono::milliseconds(durationMs));
+	setEnabled(false);
+	RTC_LOG(INFO) << "TraceCapture stop";
+
+	// names of the categories by their enabled flag
+	std::map<const unsigned char*, std::string> categories;
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		for (auto & it : s_categories) {
+			categories[it.second.get()] = it.first;
+		}
+		buffers = s_buffers;
+
+		// the buffers of the threads that ended are only referenced here and in the copy
+		s_buffers.remove_if([](const std::shared_ptr<ThreadBuffer> & buffer) { return buffer.use_count() <= 2; });
+	}
+
+	int pid = getpid();
+	Json::Value & traceEvents = value["traceEvents"];
+	traceEvents = Json::Value(Json::arrayValue);
+	for (auto & buffer : buffers) {
+		std::vector<TraceEvent> events;
+		buffer->collect(events);
+		if (events.empty()) {
+			continue;
+		}
+		Json::Value threadName;
+		threadName["name"] = "thread_name";
+		threadName["ph"] = "M";
+		threadName["pid"] = pid;
+		threadName["tid"] = (Json::Int64)buffer->threadId();
+		threadName["args"]["name"] = buffer->threadName().empty() ? std::to_string(buffer->threadId()) : buffer->threadName();
+		traceEvents.append(threadName);
+
+		for (TraceEvent & event : events) {
+			Json::Value json;
+			json["name"] = event.name;
+			json["cat"] = categories[event.category];
+			json["ph"] = std::string(1, event.phase);
+			json["ts"] = (Json::Int64)event.timestampUs;
+			json["pid"] = pid;
+			json["tid"] = (Json::Int64)buffer->threadId();
+			if (event.hasId) {
+				char id[32];
+				snprintf(id, sizeof(id), "0x%llx", event.id);
+				json["id"] = id;
+			}
+			if (!event.args.isNull()) {
+				json["args"] = event.args;
+			}
+			traceEvents.append(json);
+		}
+	}
+	value["displayTimeUnit"] = "ms";
+	return value;
+}
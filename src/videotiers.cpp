@@ -0,0 +1,196 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** videotiers.cpp
+**
+** -------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <sstream>
+#include <algorithm>
+
+#include "api/stats/rtcstats_objects.h"
+#include "api/video/i420_buffer.h"
+#include "rtc_base/logging.h"
+#include "rtc_base/timeutils.h"
+
+#include "videotiers.h"
+
+/* ---------------------------------------------------------------------------
+**  TierVideoSource
+** -------------------------------------------------------------------------*/
+TierVideoSource::TierVideoSource(rtc::scoped_refptr<webrtc::VideoTrackInterface> track, int height, int fps)
+	: m_track(track), m_height(height), m_minIntervalUs(fps > 0 ? rtc::kNumMicrosecsPerSec / fps : 0), m_lastFrameUs(0)
+{
+	m_track->AddOrUpdateSink(this, rtc::VideoSinkWants());
+}
+
+TierVideoSource::~TierVideoSource()
+{
+	m_track->RemoveSink(this);
+}
+
+void TierVideoSource::OnFrame(const webrtc::VideoFrame& frame)
+{
+	if (m_minIntervalUs > 0) {
+		// drop the frames over the frame rate, 10% margin for the jitter of the source
+		if ( (m_lastFrameUs != 0) && (frame.timestamp_us() - m_lastFrameUs < m_minIntervalUs * 9 / 10) ) {
+			return;
+		}
+		m_lastFrameUs = frame.timestamp_us();
+	}
+
+	// nothing to scale for a tier without viewers, the adapter gives the size asked by the sinks
+	int adaptedWidth = 0;
+	int adaptedHeight = 0;
+	int cropWidth = 0;
+	int cropHeight = 0;
+	int cropX = 0;
+	int cropY = 0;
+	if (!this->AdaptFrame(frame.width(), frame.height(), frame.timestamp_us(), &adaptedWidth, &adaptedHeight, &cropWidth, &cropHeight, &cropX, &cropY)) {
+		return;
+	}
+	int height = std::min(frame.height(), adaptedHeight);
+	if (m_height > 0) {
+		height = std::min(height, m_height);
+	}
+
+	if (height >= frame.height()) {
+		// forward the same buffer, the viewers of all the tiers share its encoding
+		rtc::AdaptedVideoTrackSource::OnFrame(frame);
+	} else {
+		// scaled once for all the viewers of this tier, in a buffer reused when the encoders released it
+		int width = (frame.width() * height / frame.height()) & ~1;
+		rtc::scoped_refptr<webrtc::I420Buffer> scaled = m_pool.CreateBuffer(width, height);
+		scaled->ScaleFrom(*frame.video_frame_buffer()->ToI420());
+		rtc::AdaptedVideoTrackSource::OnFrame(webrtc::VideoFrame(scaled, frame.rotation(), frame.timestamp_us()));
+	}
+}
+
+/* ---------------------------------------------------------------------------
+**  VideoTiers
+** -------------------------------------------------------------------------*/
+std::vector<VideoTiers::Tier> VideoTiers::parse(const std::string & config)
+{
+	std::vector<Tier> tiers;
+	std::istringstream is(config);
+	std::string item;
+	while (std::getline(is, item, ',')) {
+		Tier tier;
+		tier.height = 0;
+		tier.bitrateKbps = 0;
+		if ( (sscanf(item.c_str(), "%d:%d", &tier.height, &tier.bitrateKbps) != 2) || (tier.height <= 0) || (tier.bitrateKbps <= 0) ) {
+			RTC_LOG(LS_ERROR) << "invalid tier:" << item << " in " << config;
+			tiers.clear();
+			break;
+		}
+		tiers.push_back(tier);
+	}
+	std::sort(tiers.begin(), tiers.end(), [](const Tier & a, const Tier & b) { return a.bitrateKbps > b.bitrateKbps; });
+	return tiers;
+}
+
+/* ---------------------------------------------------------------------------
+**  VideoTierSelector
+** -------------------------------------------------------------------------*/
+VideoTierSelector::VideoTierSelector(std::shared_ptr<VideoTiers> tiers, rtc::scoped_refptr<webrtc::RtpSenderInterface> sender)
+	: m_tiers(tiers), m_sender(sender), m_current(0), m_down(0), m_up(0), m_probe(0), m_bandwidthKbps(0)
+{
+	this->select(0);
+}
+
+Json::Value VideoTierSelector::getStats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Json::Value stats;
+	stats["tier"] = (Json::UInt64)m_current;
+	stats["height"] = m_tiers->at(m_current).height;
+	stats["bitrate"] = m_tiers->at(m_current).bitrateKbps;
+	stats["bandwidth"] = (int)m_bandwidthKbps;
+	return stats;
+}
+
+size_t VideoTierSelector::currentTier()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_current;
+}
+
+void VideoTierSelector::OnStatsDelivered(const rtc::scoped_refptr<const webrtc::RTCStatsReport>& report)
+{
+	// bandwidth estimation of the selected candidate pair
+	double bandwidthKbps = -1;
+	for (const webrtc::RTCIceCandidatePairStats* pair : report->GetStatsOfType<webrtc::RTCIceCandidatePairStats>()) {
+		if ( (pair->nominated.is_defined()) && (*pair->nominated) && (pair->available_outgoing_bitrate.is_defined()) ) {
+			bandwidthKbps = *pair->available_outgoing_bitrate / 1000;
+		}
+	}
+	if (bandwidthKbps < 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_bandwidthKbps = bandwidthKbps;
+
+	// go down quickly when the link cannot carry the tier
+	if ( (m_current + 1 < m_tiers->size()) && (bandwidthKbps < m_tiers->at(m_current).bitrateKbps * 0.9) ) {
+		m_up = 0;
+		if (m_probe > 0) {
+			m_probe = 0;
+			this->setMaxBitrate(m_tiers->at(m_current).bitrateKbps);
+		}
+		if (++m_down >= kDownSamples) {
+			this->select(m_current + 1);
+		}
+	} else if (m_probe > 0) {
+		// the estimation follows what is sent, the upper tier is chosen once the probe reached its bitrate
+		m_down = 0;
+		if (bandwidthKbps >= m_tiers->at(m_current - 1).bitrateKbps) {
+			this->select(m_current - 1);
+		} else if (++m_probe > kProbeSamples) {
+			RTC_LOG(INFO) << "VideoTierSelector probe of tier:" << (m_current - 1) << " failed bandwidth:" << bandwidthKbps;
+			m_probe = 0;
+			m_up = 0;
+			this->setMaxBitrate(m_tiers->at(m_current).bitrateKbps);
+		}
+	} else if ( (m_current > 0) && (bandwidthKbps > m_tiers->at(m_current).bitrateKbps * 0.9) ) {
+		// the link carries the tier, let the sender go up to the bitrate of the upper tier before switching
+		m_down = 0;
+		if (++m_up >= kUpSamples) {
+			RTC_LOG(INFO) << "VideoTierSelector probe of tier:" << (m_current - 1) << " bandwidth:" << bandwidthKbps;
+			m_probe = 1;
+			this->setMaxBitrate(m_tiers->at(m_current - 1).bitrateKbps);
+		}
+	} else {
+		m_down = 0;
+		m_up = 0;
+	}
+}
+
+void VideoTierSelector::select(size_t index)
+{
+	const VideoTiers::Tier & tier = m_tiers->at(index);
+	RTC_LOG(INFO) << "VideoTierSelector tier:" << index << " height:" << tier.height << " bitrate:" << tier.bitrateKbps << " bandwidth:" << m_bandwidthKbps;
+
+	m_current = index;
+	m_down = 0;
+	m_up = 0;
+	m_probe = 0;
+
+	// switching the track does not need a new negotiation
+	if (!m_sender->SetTrack(tier.track)) {
+		RTC_LOG(LS_ERROR) << "VideoTierSelector cannot set track of tier:" << index;
+	}
+	this->setMaxBitrate(tier.bitrateKbps);
+}
+
+void VideoTierSelector::setMaxBitrate(int bitrateKbps)
+{
+	webrtc::RtpParameters parameters = m_sender->GetParameters();
+	for (webrtc::RtpEncodingParameters & encoding : parameters.encodings) {
+		encoding.max_bitrate_bps = rtc::Optional<int>(bitrateKbps * 1000);
+	}
+	m_sender->SetParameters(parameters);
+}
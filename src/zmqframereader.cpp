@@ -1,5 +1,6 @@
 #include "rtc_base/timeutils.h"
 #include "rtc_base/logging.h"
+#include "rtc_base/trace_event.h"
 
 #include <zmq.hpp>
 #include <opencv2/opencv.hpp>
@@ -15,6 +16,8 @@
 #include <chrono>
 
 #include "zmqframereader.h"
+#include "tracecapture.h"
+#include "asynclog.h"
 
 static const std::string base64_chars =
 "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
@@ -68,7 +71,7 @@ std::string base64_decode(std::string const& encoded_string) {
     return ret;
 }
 
-ZMQFrameReader::ZMQFrameReader(const std::string &pipename): m_zmqctx(1), m_zmqsocket(m_zmqctx, ZMQ_SUB) {
+ZMQFrameReader::ZMQFrameReader(const std::string &pipename, std::shared_ptr<SourceMetrics> metrics): m_zmqctx(1), m_zmqsocket(m_zmqctx, ZMQ_SUB), m_paused(false), m_metrics(metrics) {
 	RTC_LOG(INFO) << "ZMQFrameReader" << pipename ;
 	this->pipename = pipename;
 	m_zmqsocket.connect (pipename);
@@ -106,17 +109,41 @@ void ZMQFrameReader::Run()
 
     while(this->running) {
     	zmq::message_t msg;
+	    int64_t receiveStartUs = rtc::TimeMicros();
 	    bool recvd = m_zmqsocket.recv(&msg, ZMQ_NOBLOCK);
+	    if (recvd) {
+	    	m_metrics->addLatency(SourceMetrics::kReceive, rtc::TimeMicros() - receiveStartUs);
+	    }
+	    if (recvd && m_paused) {
+	    	// keep reading without decoding, the last frame is shown at once on resume
+	    	m_lastMessage = std::move(msg);
+	    	continue;
+	    }
+	    if (!recvd && !m_paused && (m_lastMessage.size() > 0)) {
+	    	msg = std::move(m_lastMessage);
+	    	recvd = true;
+	    }
 	    if(recvd) {
-	    	RTC_LOG(LS_VERBOSE) << "ZMQFrameReader::Run " << "recvd frame for pipename=" << this->pipename;
+	    	TRACE_EVENT1(TRACE_CATEGORY, "ZMQFrameReader::frame", "size", msg.size());
+	    	STREAMER_LOG_VERBOSE << "ZMQFrameReader::Run " << "recvd frame for pipename=" << this->pipename;
 
 	    	auto elapsed = std::chrono::high_resolution_clock::now() - start;
 	    	ts = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+	    	int64_t decodeStartUs = rtc::TimeMicros();
+	        TRACE_EVENT_BEGIN0(TRACE_CATEGORY, "ZMQFrameReader::base64");
 	        std::string encoded_string = std::string(static_cast<char *>(msg.data()), msg.size());
 	        std::string decoded_string = base64_decode(encoded_string);
 	        std::vector<uchar> data(decoded_string.begin(), decoded_string.end());
+	        int64_t base64EndUs = rtc::TimeMicros();
+	        TRACE_EVENT_END0(TRACE_CATEGORY, "ZMQFrameReader::base64");
+	        m_metrics->addLatency(SourceMetrics::kBase64, base64EndUs - decodeStartUs);
 
+	        TRACE_EVENT_BEGIN0(TRACE_CATEGORY, "ZMQFrameReader::imdecode");
 	        cv::Mat frame = cv::imdecode(data, cv::IMREAD_UNCHANGED);
+	        int64_t jpegEndUs = rtc::TimeMicros();
+	        TRACE_EVENT_END0(TRACE_CATEGORY, "ZMQFrameReader::imdecode");
+	        TRACE_EVENT_BEGIN0(TRACE_CATEGORY, "ZMQFrameReader::convert");
+	        m_metrics->addLatency(SourceMetrics::kDecode, jpegEndUs - base64EndUs);
 	        cv::Mat bgra(frame.rows, frame.cols, CV_8UC4);
 	        //opencv reads the stream in BGR format by default
 	        cv::cvtColor(frame, bgra, CV_BGR2BGRA);
@@ -137,15 +164,21 @@ void ZMQFrameReader::Run()
 							width, height,
 							libyuv::kRotate0, ::libyuv::FOURCC_ARGB);									
 
+			int64_t convertEndUs = rtc::TimeMicros();
+			TRACE_EVENT_END0(TRACE_CATEGORY, "ZMQFrameReader::convert");
+			m_metrics->addLatency(SourceMetrics::kConvert, convertEndUs - jpegEndUs);
+			m_metrics->addDecodeTime(convertEndUs - decodeStartUs);
 			if (conversionResult >= 0) {
 				webrtc::VideoFrame frame(I420buffer, 0, ts * 1000, webrtc::kVideoRotation_0);
 				this->Decoded(frame);
+				m_metrics->addLatency(SourceMetrics::kOnFrame, rtc::TimeMicros() - convertEndUs);
 			} else {
-				RTC_LOG(LS_ERROR) << "ZMQFrameReader:Run decoder error:" << conversionResult;
+				STREAMER_LOG_EVERY_MS(LS_ERROR, 1000) << "ZMQFrameReader:Run decoder error:" << conversionResult;
+				m_metrics->addDropped();
 				res = -1;
 			}
 	    } else {
-	    	RTC_LOG(LS_VERBOSE) << "ZMQFrameReader::Run " << "no frame recvd for pipename=" << this->pipename;
+	    	STREAMER_LOG_VERBOSE << "ZMQFrameReader::Run " << "no frame recvd for pipename=" << this->pipename;
 	    }
     }
 
@@ -155,10 +188,12 @@ void ZMQFrameReader::Run()
 
 int32_t ZMQFrameReader::Decoded(webrtc::VideoFrame& decodedImage)
 {
+	TRACE_EVENT0(TRACE_CATEGORY, "ZMQFrameReader::OnFrame");
 	if (decodedImage.timestamp_us() == 0) {
 		decodedImage.set_timestamp_us(decodedImage.timestamp());
 	}
-	RTC_LOG(LS_VERBOSE) << "ZMQFrameReader::Decoded " << decodedImage.size() << " " << decodedImage.timestamp_us() << " " << decodedImage.timestamp() << " " << decodedImage.ntp_time_ms() << " " << decodedImage.render_time_ms();
+	m_metrics->addFrame();
+	STREAMER_LOG_VERBOSE << "ZMQFrameReader::Decoded " << decodedImage.size() << " " << decodedImage.timestamp_us() << " " << decodedImage.timestamp() << " " << decodedImage.ntp_time_ms() << " " << decodedImage.render_time_ms();
 	this->OnFrame(decodedImage, decodedImage.height(), decodedImage.width());
 	return true;
 }
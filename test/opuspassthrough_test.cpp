@@ -0,0 +1,90 @@
+/* ---------------------------------------------------------------------------
+** This software is in the public domain, furnished "as is", without technical
+** support, and with no warranty, express or implied, as to its usefulness for
+** any purpose.
+**
+** opuspassthrough_test.cpp
+**
+** Check that the encoders of several viewers of one source all forward each
+** of its packets.
+**
+** -------------------------------------------------------------------------*/
+
+#include <iostream>
+#include <vector>
+
+#include "opuspassthrough.h"
+
+/* ---------------------------------------------------------------------------
+**  encoder wrapped by the passthrough encoder, never used for tagged blocks
+** -------------------------------------------------------------------------*/
+class FakeAudioEncoder : public webrtc::AudioEncoder
+{
+	public:
+		// overide webrtc::AudioEncoder
+		virtual int    SampleRateHz() const override              { return OpusPacketStore::kSampleRate; }
+		virtual size_t NumChannels() const override               { return 1; }
+		virtual size_t Num10MsFramesInNextPacket() const override { return 1; }
+		virtual size_t Max10MsFramesInAPacket() const override    { return 1; }
+		virtual int    GetTargetBitrate() const override          { return 32000; }
+		virtual void   Reset() override                           {}
+
+	protected:
+		virtual EncodedInfo EncodeImpl(uint32_t rtp_timestamp, rtc::ArrayView<const int16_t> audio, rtc::Buffer* encoded) override {
+			return EncodedInfo();
+		}
+};
+
+static int failures = 0;
+
+static void check(bool condition, const std::string & message)
+{
+	if (!condition) {
+		std::cerr << "FAILED: " << message << std::endl;
+		failures++;
+	}
+}
+
+int main()
+{
+	const size_t kBlockSamples = OpusPacketStore::kSampleRate/100;
+	const int    kPackets = 200;
+	const int    kPayloadType = 111;
+
+	OpusPacketStore store;
+	uint32_t key = store.addSource();
+
+	std::vector<std::unique_ptr<OpusPassthroughEncoder>> encoders;
+	for (int i = 0; i < 2; ++i) {
+		encoders.push_back(std::unique_ptr<OpusPassthroughEncoder>(new OpusPassthroughEncoder(std::unique_ptr<webrtc::AudioEncoder>(new FakeAudioEncoder()), &store, kPayloadType)));
+	}
+
+	// the source pushes one 10ms packet and feeds one tagged block to each track
+	std::vector<int16_t> block(kBlockSamples);
+	OpusPacketStore::tag(block.data(), kBlockSamples, 1, key);
+	uint32_t timestamp = 0;
+	for (int i = 0; i < kPackets; ++i) {
+		uint8_t packet[2] = { 0x08, (uint8_t)i };
+		store.push(key, packet, sizeof(packet), kBlockSamples);
+
+		for (size_t e = 0; e < encoders.size(); ++e) {
+			rtc::Buffer encoded;
+			webrtc::AudioEncoder::EncodedInfo info = encoders[e]->Encode(timestamp, block, &encoded);
+			std::string name = "encoder " + std::to_string(e) + " packet " + std::to_string(i);
+			check(info.encoded_bytes == sizeof(packet), name + " not forwarded");
+			check( (encoded.size() == sizeof(packet)) && (encoded.data()[1] == (uint8_t)i), name + " does not match");
+			check(info.payload_type == kPayloadType, name + " has a wrong payload type");
+			check(info.encoded_timestamp == timestamp, name + " has a wrong timestamp");
+		}
+		timestamp += kBlockSamples;
+	}
+
+	store.removeSource(key);
+
+	if (failures) {
+		std::cerr << failures << " checks failed" << std::endl;
+		return 1;
+	}
+	std::cout << "opuspassthrough: " << kPackets << " packets forwarded to " << encoders.size() << " encoders" << std::endl;
+	return 0;
+}